@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "chunk.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
+
+/**
+ * 常量的种类
+ */
+typedef enum {
+    CONSTANT_VALUE,     // 不是对象的值，原样保存
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} ConstantTag;
+
+uint64_t hashSource(const char *source) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037u;
+    for (const char *c = source; *c != '\0'; c++) {
+        hash ^= (uint8_t) *c;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+// ========================== 写入 ==========================
+
+void writeU32(FILE *file, uint32_t value) {
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+void writeString(FILE *file, ObjectString *string) {
+    writeU32(file, (uint32_t) string->length);
+    fwrite(string->chars, sizeof(char), string->length, file);
+}
+
+void writeLines(FILE *file, Chunk *chunk) {
+    writeU32(file, (uint32_t) chunk->lineCount);
+    fwrite(chunk->lines, sizeof(LineStart), chunk->lineCount, file);
+}
+
+/**
+ * 写入函数，嵌套的函数在常量中递归写入
+ * @param file
+ * @param function
+ */
+static void writeFunction(FILE *file, ObjectFunction *function) {
+    Chunk *chunk = &function->chunk;
+    writeU32(file, (uint32_t) function->arity);
+    writeU32(file, (uint32_t) function->upValueCount);
+    writeU32(file, (uint32_t) function->copiedCount);
+    fputc(function->name != NULL, file);
+    if (function->name != NULL) {
+        writeString(file, function->name);
+    }
+
+    writeU32(file, (uint32_t) chunk->size);
+    fwrite(chunk->code, sizeof(uint8_t), chunk->size, file);
+    writeLines(file, chunk);
+
+    writeU32(file, (uint32_t) chunk->constants.size);
+    for (int i = 0; i < chunk->constants.size; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_STRING(value)) {
+            fputc(CONSTANT_STRING, file);
+            writeString(file, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            fputc(CONSTANT_FUNCTION, file);
+            writeFunction(file, AS_FUNCTION(value));
+        } else {
+            fputc(CONSTANT_VALUE, file);
+            fwrite(&value, sizeof(Value), 1, file);
+        }
+    }
+}
+
+bool writeBytecode(const char *path, ObjectFunction *function, uint64_t sourceHash) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    fwrite(BYTECODE_MAGIC, sizeof(char), 4, file);
+    writeU32(file, BYTECODE_VERSION);
+    writeU32(file, OP_COUNT);
+    writeU32(file, (uint32_t) getOptimizeLevel());
+    fwrite(&sourceHash, sizeof(sourceHash), 1, file);
+
+    // 编译时分配的全局变量槽位
+    writeU32(file, (uint32_t) vm.globalNames.size);
+    for (int i = 0; i < vm.globalNames.size; i++) {
+        writeString(file, globalName(i));
+    }
+
+    writeFunction(file, function);
+    bool failed = ferror(file);
+    return fclose(file) == 0 && !failed;
+}
+
+// ========================== 读取 ==========================
+
+bool openReader(Reader *reader, const char *path) {
+    reader->data = NULL;
+    reader->size = 0;
+    reader->position = 0;
+    reader->failed = false;
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    fseek(file, 0L, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+
+    uint8_t *buffer = fileSize > 0 ? (uint8_t *) malloc(fileSize) : NULL;
+    if (buffer == NULL || fread(buffer, sizeof(uint8_t), fileSize, file) < (size_t) fileSize) {
+        free(buffer);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+    reader->data = buffer;
+    reader->size = (size_t) fileSize;
+    return true;
+}
+
+void closeReader(Reader *reader) {
+    free((void *) reader->data);
+    reader->data = NULL;
+}
+
+bool readBytes(Reader *reader, void *buffer, size_t size) {
+    if (reader->failed || reader->size - reader->position < size) {
+        reader->failed = true;
+        return false;
+    }
+    memcpy(buffer, reader->data + reader->position, size);
+    reader->position += size;
+    return true;
+}
+
+uint32_t readU32(Reader *reader) {
+    uint32_t value = 0;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+uint8_t readU8(Reader *reader) {
+    uint8_t value = 0;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+int readCount(Reader *reader, size_t unit) {
+    uint32_t count = readU32(reader);
+    if (count > INT32_MAX || (size_t) count * unit > reader->size - reader->position) {
+        reader->failed = true;
+        return 0;
+    }
+    return (int) count;
+}
+
+ObjectString *readString(Reader *reader) {
+    int length = readCount(reader, 1);
+    if (reader->failed) {
+        return NULL;
+    }
+    ObjectString *string = copyString((const char *) reader->data + reader->position, length);
+    reader->position += length;
+    return string;
+}
+
+bool readLines(Reader *reader, Chunk *chunk) {
+    int count = readCount(reader, sizeof(LineStart));
+    if (reader->failed || count == 0) {
+        reader->failed = true;
+        return false;
+    }
+    chunk->lines = ALLOCATE(LineStart, count);
+    chunk->lineCapacity = count;
+    readBytes(reader, chunk->lines, sizeof(LineStart) * count);
+    chunk->lineCount = reader->failed ? 0 : count;
+    // 第一段从头开始，之后的偏移递增并且在字节码之内
+    for (int i = 0; i < chunk->lineCount; i++) {
+        int previous = i == 0 ? -1 : chunk->lines[i - 1].offset;
+        if ((i == 0 && chunk->lines[i].offset != 0) || chunk->lines[i].offset <= previous
+            || chunk->lines[i].offset >= chunk->size) {
+            reader->failed = true;
+        }
+    }
+    return !reader->failed;
+}
+
+/**
+ * 名字操作数必须指向字符串常量
+ * @param chunk
+ * @param index
+ * @return
+ */
+static bool isNameConstant(Chunk *chunk, int index) {
+    return index < chunk->constants.size && IS_STRING(chunk->constants.values[index]);
+}
+
+bool relocateChunk(Chunk *chunk, const int *globalSlots, int globalCount) {
+    int constantCount = chunk->constants.size;
+    for (int offset = 0; offset < chunk->size;) {
+        uint8_t *code = &chunk->code[offset];
+        if (code[0] >= OP_COUNT) {
+            return false;
+        }
+        // 闭包指令的长度取决于常量中的函数
+        if (code[0] == OP_CLOSURE && (offset + 1 >= chunk->size || code[1] >= constantCount
+                                      || !IS_FUNCTION(chunk->constants.values[code[1]]))) {
+            return false;
+        }
+        int length = getInstructionLength(chunk, offset, NULL);
+        if (offset + length > chunk->size) {
+            return false;
+        }
+        switch (code[0]) {
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL: {
+                int slot = (code[1] << 8) | code[2];
+                if (slot >= globalCount) {
+                    return false;
+                }
+                slot = globalSlots[slot];
+                code[1] = (slot >> 8) & 0xff;
+                code[2] = slot & 0xff;
+                break;
+            }
+            case OP_CONSTANT:
+                if (code[1] >= constantCount) {
+                    return false;
+                }
+                break;
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_GET_SUPER:
+            case OP_CLASS:
+            case OP_METHOD:
+            case OP_INVOKE:
+            case OP_INVOKE_PROPERTY:
+            case OP_TAIL_INVOKE:
+            case OP_SUPER_INVOKE:
+                if (!isNameConstant(chunk, code[1])) {
+                    return false;
+                }
+                break;
+            case OP_GET_LOCAL_PROPERTY:
+                if (!isNameConstant(chunk, code[2])) {
+                    return false;
+                }
+                break;
+            case OP_CLOSURE:
+                for (int i = 2; i < length; i += 2) {
+                    if (code[i] > CAPTURE_LOCAL_COPY) {
+                        return false;
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+// 栈深度表中不是指令开头的偏移
+#define NOT_INSTRUCTION (-2)
+// 栈深度表中还没有到达的指令
+#define UNREACHED (-1)
+
+/**
+ * 跳转指令的目标偏移
+ * @param chunk
+ * @param offset
+ * @return
+ */
+static int jumpTarget(Chunk *chunk, int offset) {
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+/**
+ * 以 depth 的栈深度到达 target，第一次到达时加入待检查的指令
+ * @param chunk
+ * @param depths
+ * @param work
+ * @param workCount
+ * @param target
+ * @param depth
+ * @return 目标不是指令的开头，或者和之前到达时的栈深度不同时返回 false
+ */
+static bool reachOffset(Chunk *chunk, int *depths, int *work, int *workCount, int target, int depth) {
+    if (target < 0 || target >= chunk->size || depths[target] == NOT_INSTRUCTION) {
+        return false;
+    }
+    if (depths[target] == UNREACHED) {
+        depths[target] = depth;
+        work[(*workCount)++] = target;
+        return true;
+    }
+    return depths[target] == depth;
+}
+
+static inline bool isCopyCapture(uint8_t kind) {
+    return kind == CAPTURE_COPIED || kind == CAPTURE_LOCAL_COPY;
+}
+
+/**
+ * 检查闭包指令给出的上值来源和嵌套函数读取上值的方式一致
+ * 按引用捕获的上值只能用上值指令读写，按值复制的上值只能用 OP_GET_COPIED 读取，否则会访问不存在的上值对象或者复制的值
+ * @param function 嵌套函数，字节码已经重定位
+ * @param captures 闭包指令中每个上值的来源和下标
+ * @return
+ */
+static bool checkCaptures(ObjectFunction *function, const uint8_t *captures) {
+    int copied = 0;
+    for (int i = 0; i < function->upValueCount; i++) {
+        copied += isCopyCapture(captures[i * 2]);
+    }
+    if (copied != function->copiedCount) {
+        return false;
+    }
+
+    Chunk *chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->size; offset += getInstructionLength(chunk, offset, NULL)) {
+        uint8_t *code = &chunk->code[offset];
+        switch (code[0]) {
+            case OP_GET_UP_VALUE:
+            case OP_SET_UP_VALUE:
+            case OP_GET_COPIED:
+                if (code[1] >= function->upValueCount
+                    || isCopyCapture(captures[code[1] * 2]) != (code[0] == OP_GET_COPIED)) {
+                    return false;
+                }
+                break;
+            case OP_CLOSURE: {
+                int length = getInstructionLength(chunk, offset, NULL);
+                for (int i = 2; i < length; i += 2) {
+                    if (code[i] != CAPTURE_UP_VALUE && code[i] != CAPTURE_COPIED) {
+                        continue;
+                    }
+                    if (code[i + 1] >= function->upValueCount
+                        || isCopyCapture(captures[code[i + 1] * 2]) != (code[i] == CAPTURE_COPIED)) {
+                        return false;
+                    }
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+bool verifyFunction(ObjectFunction *function) {
+    Chunk *chunk = &function->chunk;
+    if (chunk->size == 0) {
+        return false;
+    }
+    int *depths = (int *) malloc(sizeof(int) * chunk->size);
+    int *work = (int *) malloc(sizeof(int) * chunk->size);
+    int workCount = 0;
+    bool valid = true;
+
+    // 第一遍：标记指令的开头，所有跳转指令的目标都要是指令的开头，执行不到的指令也一样，预解码时会用到
+    for (int offset = 0; offset < chunk->size; offset++) {
+        depths[offset] = NOT_INSTRUCTION;
+    }
+    for (int offset = 0; offset < chunk->size; offset += getInstructionLength(chunk, offset, NULL)) {
+        depths[offset] = UNREACHED;
+    }
+    for (int offset = 0; offset < chunk->size && valid; offset += getInstructionLength(chunk, offset, NULL)) {
+        uint8_t opcode = chunk->code[offset];
+        if (opcode == OP_JUMP || opcode == OP_JUMP_IF_FALSE || opcode == OP_LOOP || opcode == OP_JUMP_IF_NOT_LESS) {
+            int target = jumpTarget(chunk, offset);
+            valid = target >= 0 && target < chunk->size && depths[target] != NOT_INSTRUCTION;
+        }
+    }
+
+    // 第二遍：从入口沿着控制流计算每条指令之前的栈深度，入口处栈上是被调用者和参数
+    valid = valid && reachOffset(chunk, depths, work, &workCount, 0, function->arity + 1);
+    while (valid && workCount > 0) {
+        int offset = work[--workCount];
+        int depth = depths[offset];
+        uint8_t *code = &chunk->code[offset];
+        int length = getInstructionLength(chunk, offset, NULL);
+        int popped = 0;
+        int pushed = 0;
+        bool fallsThrough = true;
+
+        switch (code[0]) {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_GET_GLOBAL:
+            case OP_CLASS:
+                pushed = 1;
+                break;
+            case OP_POP:
+            case OP_DEFINE_GLOBAL:
+            case OP_PRINT:
+            case OP_CLOSE_UP_VALUE:
+                popped = 1;
+                break;
+            case OP_SET_GLOBAL:
+            case OP_GET_PROPERTY:
+            case OP_NOT:
+            case OP_NEGATE:
+                popped = 1;
+                pushed = 1;
+                break;
+            case OP_GET_LOCAL:
+            case OP_GET_LOCAL_PROPERTY:
+                valid = code[1] < depth;
+                pushed = 1;
+                break;
+            case OP_SET_LOCAL:
+                valid = code[1] < depth;
+                popped = 1;
+                pushed = 1;
+                break;
+            case OP_ADD_LOCALS:
+                valid = code[1] < depth && code[2] < depth;
+                pushed = 1;
+                break;
+            case OP_GET_UP_VALUE:
+            case OP_GET_COPIED:
+                valid = code[1] < function->upValueCount;
+                pushed = 1;
+                break;
+            case OP_SET_UP_VALUE:
+                valid = code[1] < function->upValueCount;
+                popped = 1;
+                pushed = 1;
+                break;
+            case OP_SET_PROPERTY:
+            case OP_GET_SUPER:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_INHERIT:
+            case OP_METHOD:
+                popped = 2;
+                pushed = 1;
+                break;
+            case OP_JUMP:
+            case OP_LOOP:
+                valid = reachOffset(chunk, depths, work, &workCount, jumpTarget(chunk, offset), depth);
+                fallsThrough = false;
+                break;
+            case OP_JUMP_IF_FALSE:
+                valid = depth >= 1 && reachOffset(chunk, depths, work, &workCount, jumpTarget(chunk, offset), depth);
+                popped = 1;
+                pushed = 1;
+                break;
+            case OP_JUMP_IF_NOT_LESS:
+                // 跳转时留下条件，不跳转时两个操作数都弹出
+                valid = depth >= 2
+                        && reachOffset(chunk, depths, work, &workCount, jumpTarget(chunk, offset), depth - 1);
+                popped = 2;
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                popped = code[1] + 1;
+                pushed = 1;
+                break;
+            case OP_INVOKE:
+            case OP_INVOKE_PROPERTY:
+            case OP_TAIL_INVOKE:
+                popped = code[2] + 1;
+                pushed = 1;
+                break;
+            case OP_SUPER_INVOKE:
+                // 栈顶还有父类
+                popped = code[2] + 2;
+                pushed = 1;
+                break;
+            case OP_CLOSURE: {
+                // 闭包先入栈再捕获，局部函数可以捕获自己
+                for (int i = 2; i < length && valid; i += 2) {
+                    bool local = code[i] == CAPTURE_LOCAL || code[i] == CAPTURE_LOCAL_COPY;
+                    valid = code[i + 1] < (local ? depth + 1 : function->upValueCount);
+                }
+                valid = valid && checkCaptures(AS_FUNCTION(chunk->constants.values[code[1]]), &code[2]);
+                pushed = 1;
+                break;
+            }
+            case OP_RETURN:
+                popped = 1;
+                fallsThrough = false;
+                break;
+            default:
+                // 快速化和优化层的指令不会出现在字节码中
+                valid = false;
+                break;
+        }
+
+        valid = valid && popped <= depth;
+        if (valid && fallsThrough) {
+            // 最后一条指令不能继续往下执行
+            valid = reachOffset(chunk, depths, work, &workCount, offset + length, depth - popped + pushed);
+        }
+    }
+
+    free(depths);
+    free(work);
+    return valid;
+}
+
+#undef NOT_INSTRUCTION
+#undef UNREACHED
+
+/**
+ * 读取函数，读取过程中函数一直在虚拟机栈上，分配内存触发垃圾回收时不会被回收
+ * @param reader
+ * @param globalSlots 文件中的全局变量槽位到当前虚拟机中的槽位
+ * @param globalCount
+ * @return 读取失败时返回 NULL
+ */
+static ObjectFunction *readFunction(Reader *reader, const int *globalSlots, int globalCount) {
+    ObjectFunction *function = newFunction();
+    push(OBJECT_VAL(function));
+    Chunk *chunk = &function->chunk;
+
+    function->arity = (int) readU32(reader);
+    function->upValueCount = (int) readU32(reader);
+    function->copiedCount = (int) readU32(reader);
+    if (function->arity > UINT8_MAX || function->upValueCount > UINT8_COUNT
+        || function->copiedCount > function->upValueCount) {
+        reader->failed = true;
+    }
+    if (readU8(reader)) {
+        function->name = readString(reader);
+        writeBarrierObject((Object *) function, (Object *) function->name);
+    }
+
+    int size = readCount(reader, sizeof(uint8_t));
+    if (!reader->failed && size > 0) {
+        uint8_t *code = ALLOCATE(uint8_t, size);
+        readBytes(reader, code, size);
+        chunk->code = code;
+        chunk->capacity = size;
+        chunk->size = size;
+        readLines(reader, chunk);
+    }
+
+    int constantCount = readCount(reader, 1);
+    for (int i = 0; i < constantCount && !reader->failed; i++) {
+        Value value = NIL_VAL;
+        switch (readU8(reader)) {
+            case CONSTANT_VALUE:
+                readBytes(reader, &value, sizeof(Value));
+                if (IS_OBJECT(value)) {
+                    reader->failed = true;
+                    value = NIL_VAL;
+                }
+                break;
+            case CONSTANT_STRING: {
+                ObjectString *string = readString(reader);
+                if (string != NULL) {
+                    value = OBJECT_VAL(string);
+                }
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjectFunction *nested = readFunction(reader, globalSlots, globalCount);
+                if (nested != NULL) {
+                    value = OBJECT_VAL(nested);
+                }
+                break;
+            }
+            default:
+                reader->failed = true;
+                break;
+        }
+        addConstant(chunk, value);
+        // 读取过程中函数可能已经晋升
+        writeBarrier((Object *) function, value);
+    }
+
+    if (!reader->failed && (!relocateChunk(chunk, globalSlots, globalCount) || !verifyFunction(function))) {
+        reader->failed = true;
+    }
+    pop();
+    return reader->failed ? NULL : function;
+}
+
+ObjectFunction *readBytecode(const char *path, uint64_t sourceHash, bool checkHash) {
+    Reader reader;
+    if (!openReader(&reader, path)) {
+        return NULL;
+    }
+
+    char magic[4];
+    uint64_t hash = 0;
+    readBytes(&reader, magic, sizeof(magic));
+    uint32_t version = readU32(&reader);
+    uint32_t opcodeCount = readU32(&reader);
+    uint32_t optimizeLevel = readU32(&reader);
+    readBytes(&reader, &hash, sizeof(hash));
+
+    ObjectFunction *function = NULL;
+    if (!reader.failed && memcmp(magic, BYTECODE_MAGIC, sizeof(magic)) == 0 && version == BYTECODE_VERSION
+        && opcodeCount == OP_COUNT && optimizeLevel == (uint32_t) getOptimizeLevel()
+        && (!checkHash || hash == sourceHash)) {
+        // 按名字重新分配全局变量槽位，名字已经记在全局变量表里，不会被回收
+        int globalCount = readCount(&reader, sizeof(uint32_t));
+        int *globalSlots = (int *) malloc(sizeof(int) * (globalCount + 1));
+        for (int i = 0; i < globalCount && !reader.failed; i++) {
+            ObjectString *name = readString(&reader);
+            if (name != NULL) {
+                push(OBJECT_VAL(name));
+                globalSlots[i] = globalSlot(name);
+                pop();
+                if (globalSlots[i] > UINT16_MAX) {
+                    reader.failed = true;
+                }
+            }
+        }
+        if (!reader.failed) {
+            function = readFunction(&reader, globalSlots, globalCount);
+        }
+        // 脚本函数没有外层的闭包，不能有上值
+        if (reader.position != reader.size || (function != NULL && function->upValueCount > 0)) {
+            function = NULL;
+        }
+        free(globalSlots);
+    }
+    closeReader(&reader);
+    return function;
+}
@@ -0,0 +1,133 @@
+#ifndef CLOX_BYTECODE_H
+#define CLOX_BYTECODE_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// 编译好的字节码文件的扩展名
+#define BYTECODE_EXTENSION ".loxc"
+// 字节码文件的魔数
+#define BYTECODE_MAGIC "LOXC"
+// 字节码文件的格式版本，文件格式或者指令编号变化时增加，版本不同的文件不会被加载
+#define BYTECODE_VERSION 3
+
+/**
+ * 读取字节码文件和堆快照时的状态，整个文件一次读入内存
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t position;
+    bool failed;        // 读取越界或者内容不合法，之后的读取都返回 0
+} Reader;
+
+/**
+ * 把整个文件读入内存
+ * @param reader
+ * @param path
+ * @return 文件不存在或者读取失败时返回 false
+ */
+bool openReader(Reader *reader, const char *path);
+
+/**
+ * 释放读入的文件内容
+ * @param reader
+ */
+void closeReader(Reader *reader);
+
+/**
+ * 读取若干字节，剩余的内容不够时标记失败
+ * @param reader
+ * @param buffer
+ * @param size
+ * @return
+ */
+bool readBytes(Reader *reader, void *buffer, size_t size);
+
+uint8_t readU8(Reader *reader);
+
+uint32_t readU32(Reader *reader);
+
+/**
+ * 读取一个数量，数量乘以每个元素至少占的字节数超过剩余内容时返回 0 并标记失败
+ * @param reader
+ * @param unit
+ * @return
+ */
+int readCount(Reader *reader, size_t unit);
+
+/**
+ * 读取字符串并驻留
+ * @param reader
+ * @return 读取失败时返回 NULL
+ */
+ObjectString *readString(Reader *reader);
+
+void writeU32(FILE *file, uint32_t value);
+
+void writeString(FILE *file, ObjectString *string);
+
+/**
+ * 写入行号表
+ * @param file
+ * @param chunk
+ */
+void writeLines(FILE *file, Chunk *chunk);
+
+/**
+ * 读取行号表，字节码必须已经读入
+ * @param reader
+ * @param chunk
+ * @return 行号表是否合法
+ */
+bool readLines(Reader *reader, Chunk *chunk);
+
+/**
+ * 检查字节码并把全局变量的槽位换成当前虚拟机中的槽位
+ * 指令不能越过字节码的末尾，引用的常量必须存在，名字操作数必须是字符串常量
+ * @param chunk
+ * @param globalSlots 文件中的全局变量槽位到当前虚拟机中的槽位
+ * @param globalCount
+ * @return 字节码是否合法
+ */
+bool relocateChunk(Chunk *chunk, const int *globalSlots, int globalCount);
+
+/**
+ * 检查函数的字节码可以安全执行，字节码和嵌套函数都必须已经重定位
+ * 跳转目标是指令的开头；沿着控制流推算栈深度，汇合处的深度相同，不会弹出栈上没有的值，也不会越过字节码的末尾；
+ * 局部变量槽位和参数数量不超过当时的栈深度，上值下标小于上值数量，闭包指令给出的上值来源和嵌套函数的用法一致
+ * @param function
+ * @return 字节码是否可以执行
+ */
+bool verifyFunction(ObjectFunction *function);
+
+/**
+ * 计算源代码的哈希，用来判断字节码文件是不是由这份源代码编译出来的
+ * @param source
+ * @return
+ */
+uint64_t hashSource(const char *source);
+
+/**
+ * 把编译好的脚本函数连同嵌套的函数、常量、上值来源和行号写入字节码文件
+ * 全局变量的槽位和名字一起写入，加载时按照名字重新分配槽位
+ * @param path
+ * @param function 脚本函数
+ * @param sourceHash 源代码的哈希
+ * @return 是否写入成功
+ */
+bool writeBytecode(const char *path, ObjectFunction *function, uint64_t sourceHash);
+
+/**
+ * 读取字节码文件，得到可以直接执行的脚本函数
+ * 文件不存在、格式不对、版本或者优化级别不同、源代码哈希不同时返回 NULL
+ * @param path
+ * @param sourceHash 源代码的哈希
+ * @param checkHash 是否检查源代码哈希，直接执行字节码文件时没有源代码
+ * @return
+ */
+ObjectFunction *readBytecode(const char *path, uint64_t sourceHash, bool checkHash);
+
+#endif //CLOX_BYTECODE_H
@@ -5,24 +5,51 @@
 #include "chunk.h"
 #include "debug.h"
 #include "memory.h"
+#include "object.h"
+#include "ssa.h"
 #include "vm.h"
 
 
+/**
+ * 指令流中记录的指令开头的数量
+ * @param instructionCount
+ * @return
+ */
+static int getStartCount(int instructionCount) {
+    return (instructionCount + INSTRUCTION_START_STRIDE - 1) / INSTRUCTION_START_STRIDE;
+}
+
 void initChunk(Chunk *chunk) {
     dbg("Init Chunk");
     chunk->capacity = 0;
     chunk->size = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     initValueArray(&chunk->constants);
+    chunk->instructions = NULL;
+    chunk->instructionStarts = NULL;
+    chunk->instructionCount = 0;
+    chunk->inlineCaches = NULL;
+    chunk->inlineCacheCount = 0;
+    chunk->quickenCounters = NULL;
+    chunk->entry = NULL;
+    chunk->frameSize = 0;
+    chunk->optimized = NULL;
 }
 
 void freeChunk(Chunk  *chunk) {
+    // 常量可能已经在同一轮中被释放，这里不能再反汇编
     dbg("Free Chunk");
-    dbgChunk(chunk, "Chunk Free");
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(Instruction, chunk->instructions, chunk->instructionCount);
+    FREE_ARRAY(InstructionStart, chunk->instructionStarts, getStartCount(chunk->instructionCount));
+    FREE_ARRAY(InlineCache, chunk->inlineCaches, chunk->inlineCacheCount);
+    FREE_ARRAY(int8_t, chunk->quickenCounters, chunk->instructionCount);
+    freeOptimizedCode(chunk->optimized);
     initChunk(chunk);
 }
 
@@ -31,14 +58,59 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
     chunk->code[chunk->size] = byte;
-    chunk->lines[chunk->size] = line;
+    addLine(chunk, chunk->size, line);
     chunk->size++;
     dbg("Write [%hhu] To Chunk Line [%d]", byte, line);
 }
 
+void addLine(Chunk *chunk, int offset, int line) {
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+        return;
+    }
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+    chunk->lines[chunk->lineCount].offset = offset;
+    chunk->lines[chunk->lineCount].line = line;
+    chunk->lineCount++;
+}
+
+int getLine(Chunk *chunk, int offset) {
+    // 最后一个开始偏移不超过 offset 的段
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if (chunk->lines[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
+}
+
+void truncateChunk(Chunk *chunk, int size) {
+    chunk->size = size;
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= size) {
+        chunk->lineCount--;
+    }
+}
+
+void shrinkChunk(Chunk *chunk) {
+    chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, chunk->size);
+    chunk->capacity = chunk->size;
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines, chunk->lineCapacity, chunk->lineCount);
+    chunk->lineCapacity = chunk->lineCount;
+    ValueArray *constants = &chunk->constants;
+    constants->values = GROW_ARRAY(Value, constants->values, constants->capacity, constants->size);
+    constants->capacity = constants->size;
+}
+
 int addConstant(Chunk* chunk, Value value) {
     // 避免GC将常量回收
     push(value);
@@ -47,3 +119,241 @@ int addConstant(Chunk* chunk, Value value) {
     pop();
     return chunk->constants.size - 1;
 }
+
+
+int getInstructionLength(Chunk *chunk, int offset, int *words) {
+    int unused;
+    if (words == NULL) {
+        words = &unused;
+    }
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UP_VALUE:
+        case OP_SET_UP_VALUE:
+        case OP_GET_COPIED:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            *words = 2;
+            return 2;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            // 多一个字存放内联缓存
+            *words = 3;
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_NOT_LESS:
+            // 两个字节的偏移解码成一个跳转目标
+            *words = 2;
+            return 3;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            // 两个字节的全局变量槽位
+            *words = 2;
+            return 3;
+
+        case OP_SUPER_INVOKE:
+        case OP_ADD_LOCALS:
+            *words = 3;
+            return 3;
+        case OP_INVOKE:
+        case OP_INVOKE_PROPERTY:
+        case OP_TAIL_INVOKE:
+        case OP_GET_LOCAL_PROPERTY:
+            *words = 4;
+            return 3;
+        case OP_CLOSURE: {
+            ObjectFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            *words = 2 + function->upValueCount * 2;
+            return 2 + function->upValueCount * 2;
+        }
+        default:
+            *words = 1;
+            return 1;
+    }
+}
+
+/**
+ * 指令是否需要内联缓存
+ * @param opcode
+ * @return
+ */
+static bool hasInlineCache(uint8_t opcode) {
+    return opcode == OP_GET_PROPERTY || opcode == OP_SET_PROPERTY
+           || opcode == OP_INVOKE || opcode == OP_INVOKE_PROPERTY || opcode == OP_TAIL_INVOKE
+           || opcode == OP_GET_LOCAL_PROPERTY;
+}
+
+/**
+ * 读取两个字节的跳转偏移
+ * @param chunk
+ * @param offset
+ * @return
+ */
+static int readJump(Chunk *chunk, int offset) {
+    return (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+void decodeChunk(Chunk *chunk, void *const *handlers) {
+    // 第一遍：计算每条字节码指令在指令流中的位置
+    int *positions = ALLOCATE(int, chunk->size + 1);
+    int count = 0;
+    int cacheCount = 0;
+    for (int offset = 0; offset < chunk->size;) {
+        int words;
+        int length = getInstructionLength(chunk, offset, &words);
+        positions[offset] = count;
+        count += words;
+        if (hasInlineCache(chunk->code[offset])) {
+            cacheCount++;
+        }
+        offset += length;
+    }
+    positions[chunk->size] = count;
+
+    Instruction *instructions = ALLOCATE(Instruction, count);
+    InstructionStart *instructionStarts = ALLOCATE(InstructionStart, getStartCount(count));
+    InlineCache *caches = ALLOCATE(InlineCache, cacheCount);
+    int8_t *quickenCounters = ALLOCATE(int8_t, count);
+    InlineCache *cache = caches;
+    Value *constants = chunk->constants.values;
+
+    // 第二遍：解码操作数
+    for (int offset = 0; offset < chunk->size;) {
+        int words;
+        int length = getInstructionLength(chunk, offset, &words);
+        Instruction *instruction = &instructions[positions[offset]];
+        uint8_t *code = &chunk->code[offset];
+
+        if (handlers != NULL) {
+            instruction->handler = handlers[code[0]];
+        } else {
+            instruction->opcode = code[0];
+        }
+
+        switch (code[0]) {
+            case OP_CONSTANT:
+                instruction[1].value = constants[code[1]];
+                break;
+            case OP_GET_SUPER:
+            case OP_CLASS:
+            case OP_METHOD:
+                instruction[1].string = AS_STRING(constants[code[1]]);
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_GET_UP_VALUE:
+            case OP_SET_UP_VALUE:
+            case OP_GET_COPIED:
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                instruction[1].operand = code[1];
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+                instruction[1].operand = (code[1] << 8) | code[2];
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_NOT_LESS:
+                instruction[1].target = &instructions[positions[offset + length + readJump(chunk, offset)]];
+                break;
+            case OP_LOOP:
+                instruction[1].target = &instructions[positions[offset + length - readJump(chunk, offset)]];
+                break;
+            case OP_SUPER_INVOKE:
+                instruction[1].string = AS_STRING(constants[code[1]]);
+                instruction[2].operand = code[2];
+                break;
+            case OP_ADD_LOCALS:
+                instruction[1].operand = code[1];
+                instruction[2].operand = code[2];
+                break;
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+                instruction[1].string = AS_STRING(constants[code[1]]);
+                instruction[2].cache = cache;
+                break;
+            case OP_INVOKE:
+            case OP_INVOKE_PROPERTY:
+            case OP_TAIL_INVOKE:
+                instruction[1].string = AS_STRING(constants[code[1]]);
+                instruction[2].operand = code[2];
+                instruction[3].cache = cache;
+                break;
+            case OP_GET_LOCAL_PROPERTY:
+                instruction[1].operand = code[1];
+                instruction[2].string = AS_STRING(constants[code[2]]);
+                instruction[3].cache = cache;
+                break;
+            case OP_CLOSURE:
+                instruction[1].value = constants[code[1]];
+                for (int i = 2; i < words; i++) {
+                    instruction[i].operand = code[i];
+                }
+                break;
+            default:
+                break;
+        }
+        if (hasInlineCache(code[0])) {
+            cache->epoch = 0;
+            cache->count = 0;
+            cache++;
+        }
+
+        for (int i = 0; i < words; i++) {
+            quickenCounters[positions[offset] + i] = 0;
+        }
+        // 这条指令占用的字里面落在记录位置上的
+        int position = positions[offset];
+        for (int i = (position + INSTRUCTION_START_STRIDE - 1) / INSTRUCTION_START_STRIDE;
+             i * INSTRUCTION_START_STRIDE < position + words; i++) {
+            instructionStarts[i].index = position;
+            instructionStarts[i].offset = offset;
+        }
+        offset += length;
+    }
+
+    FREE_ARRAY(int, positions, chunk->size + 1);
+    chunk->instructions = instructions;
+    chunk->instructionStarts = instructionStarts;
+    chunk->instructionCount = count;
+    chunk->inlineCaches = caches;
+    chunk->inlineCacheCount = cacheCount;
+    chunk->quickenCounters = quickenCounters;
+    chunk->entry = instructions;
+    chunk->frameSize = count;
+    dbg("Decode Chunk To [%d] Instructions", count);
+}
+
+int getOptimizedIndex(Chunk *chunk, Instruction *instruction) {
+    OptimizedCode *code = chunk->optimized;
+    while ((uintptr_t) instruction - (uintptr_t) code->instructions >= (uintptr_t) code->count * sizeof(Instruction)) {
+        code = code->previous;
+    }
+    return code->sites[instruction - code->instructions];
+}
+
+int getInstructionOffset(Chunk *chunk, Instruction *instruction) {
+    int index = getInstructionIndex(chunk, instruction);
+    InstructionStart *start = &chunk->instructionStarts[index / INSTRUCTION_START_STRIDE];
+    int position = start->index;
+    int offset = start->offset;
+    for (;;) {
+        int words;
+        int length = getInstructionLength(chunk, offset, &words);
+        if (position + words > index) {
+            return offset;
+        }
+        position += words;
+        offset += length;
+    }
+}
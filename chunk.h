@@ -24,6 +24,7 @@ typedef enum {
     OP_SET_LOCAL,
     OP_GET_UP_VALUE,
     OP_SET_UP_VALUE,
+    OP_GET_COPIED,          // 读取按值捕获的上值
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
@@ -43,15 +44,182 @@ typedef enum {
     OP_LOOP,
     OP_CALL,
     OP_INVOKE,
+    OP_INVOKE_PROPERTY,     // (a.b)(...) 编译成的方法调用，接收者不是实例时和 OP_GET_PROPERTY 一样报错
     OP_SUPER_INVOKE,
     OP_CLOSURE,
     OP_CLOSE_UP_VALUE,
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
-    OP_RETURN
+    OP_RETURN,
+
+    // 超级指令，由窥孔优化合并常见的指令序列
+    OP_ADD_LOCALS,          // OP_GET_LOCAL a; OP_GET_LOCAL b; OP_ADD
+    OP_JUMP_IF_NOT_LESS,    // OP_LESS; OP_JUMP_IF_FALSE; OP_POP
+    OP_GET_LOCAL_PROPERTY,  // OP_GET_LOCAL; OP_GET_PROPERTY
+
+    // 尾调用，由窥孔优化改写紧跟在 OP_RETURN 前面的调用，复用当前的栈帧
+    OP_TAIL_CALL,           // OP_CALL; OP_RETURN
+    OP_TAIL_INVOKE,         // OP_INVOKE; OP_RETURN
+
+    // 快速化的特化指令，只会由虚拟机改写进指令流，不会出现在字节码中
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_CALL_NATIVE,
+
+    // 优化层的指令，只会出现在优化后的指令流中
+    OP_GUARD_NUMBER,        // 入口检查参数是数字，失败时退回基线指令流
+    OP_GUARD_STRING,        // 入口检查参数是字符串，失败时退回基线指令流
+    OP_INVOKE_INLINE,       // 接收者的形状符合时执行内联的方法体，否则按照 OP_INVOKE 调用
+    OP_INLINE_RETURN,       // 内联的方法体返回，结果放到接收者的槽位上
+    OP_CALL_INLINE,         // 被调用者是记录的闭包时执行内联的函数体，否则按照 OP_CALL 调用
+    OP_GUARD_SHAPE,         // 循环预备块检查局部变量的形状，失败时退回基线指令流
+    OP_GET_FIELD,           // 形状已经确定的实例按槽位读字段，实例在栈顶
+    OP_GET_LOCAL_FIELD,     // 形状已经确定的实例按槽位读字段，实例在局部变量里
+    OP_SET_FIELD,           // 形状已经确定的实例按槽位写已有的字段
+    OP_GET_HOISTED,         // 读取外提到循环预备块的表达式的值，然后跳过原来的表达式
+    OP_SET_HOISTED,         // 循环预备块记录外提的表达式的值
+
+    OP_COUNT                // 字节码数量
 } OpCode;
 
+/**
+ * OP_CLOSURE 中每个上值的来源
+ * 捕获之后不会再被赋值的变量按值复制进闭包，不需要上值对象
+ */
+typedef enum {
+    CAPTURE_UP_VALUE,       // 外层闭包按引用捕获的上值
+    CAPTURE_LOCAL,          // 外层函数的局部变量，按引用捕获
+    CAPTURE_COPIED,         // 复制外层闭包按值捕获的上值
+    CAPTURE_LOCAL_COPY,     // 复制外层函数的局部变量
+} CaptureKind;
+
+#define INLINE_CACHE_ENTRIES 4
+
+/**
+ * 内联缓存中一个形状的查找结果
+ * 形状属于唯一的类，所以方法也可以按照形状缓存
+ */
+typedef struct {
+    ObjectShape *shape;         // 接收者的形状
+    ObjectClosure *method;      // 属性是这个类的方法，不是方法时为 NULL
+    ObjectShape *transition;    // 设置字段时新增字段之后的形状，不是新增字段时为 NULL
+    int slot;                   // 字段的槽位
+} InlineCacheEntry;
+
+/**
+ * 属性访问和方法调用处的内联缓存
+ * 只看到一个形状时是单态的，最多记录 INLINE_CACHE_ENTRIES 个形状，再多就变成超多态，直接查表
+ */
+typedef struct {
+    uint32_t epoch;             // 填充缓存时的方法表版本，和虚拟机的版本不同时缓存失效
+    int count;                  // 记录的类的数量，超过 INLINE_CACHE_ENTRIES 表示超多态
+    InlineCacheEntry entries[INLINE_CACHE_ENTRIES];
+} InlineCache;
+
+struct InlinedCall;
+struct HoistedValue;
+
+/**
+ * 预解码后的指令
+ * 指令流中每个字是一个处理程序地址或者一个已经解码好的操作数
+ */
+typedef union Instruction {
+    const void *handler;            // 处理程序地址，线程化分发时使用
+    int opcode;                     // 字节码，switch 分发时使用
+    int operand;                    // 槽位、参数数量等整数操作数
+    Value value;                    // 常量
+    ObjectString *string;           // 名字
+    union Instruction *target;      // 跳转目标
+    InlineCache *cache;             // 内联缓存
+    ObjectShape *shape;             // 形状检查用到的形状
+    struct InlinedCall *inlined;    // 内联的方法调用
+    struct HoistedValue *hoisted;   // 外提的表达式的值
+} Instruction;
+
+/**
+ * 优化层内联的一处方法调用或者函数调用
+ * 方法调用在接收者的形状和记录的一致并且方法表没有变化时执行内联的方法体，
+ * 函数调用在被调用者就是记录的闭包时执行内联的函数体
+ */
+typedef struct InlinedCall {
+    ObjectString *name;             // 方法名，检查失败时按照普通的方法调用，函数调用为 NULL
+    ObjectClosure *method;          // 内联的方法或者函数，GC 时标记，保证地址不会被复用
+    ObjectShape *shape;             // 接收者的形状，函数调用为 NULL
+    uint32_t epoch;                 // 记录形状时的方法表版本
+    InlineCache *cache;             // 调用处的内联缓存，形状变化时用来重新确认方法，函数调用为 NULL
+    bool fields;                    // 方法体按照记录的形状直接读写字段，这时不能换成别的形状
+    union Instruction *body;        // 内联的方法体
+} InlinedCall;
+
+/**
+ * 外提到循环预备块的表达式的值
+ * 循环里有调用时，同一个函数的另一次执行可能覆盖这里的值，所以记下是哪个栈帧算出来的
+ */
+typedef struct HoistedValue {
+    Value value;
+    int frame;                      // 算出这个值的栈帧在调用栈中的下标
+} HoistedValue;
+
+/**
+ * 循环入口，解释器在循环回边处按照这里记录的类型检查槽位，都符合时切换到优化后的指令流
+ */
+typedef struct {
+    int index;                      // 循环开头在指令流中的下标
+    int entry;                      // 切换过来时在优化后的指令流中开始执行的位置，有预备块时是预备块
+    int depth;                      // 循环开头的栈深度
+    uint8_t *types;                 // 每个槽位推导出来的类型
+} LoopEntry;
+
+/**
+ * 优化层生成的指令流
+ * 前 instructionCount 个字和基线指令流一一对应，可以在相同的下标之间来回切换
+ * 后面追加内联的方法体、循环预备块和入口的参数检查
+ */
+typedef struct OptimizedCode {
+    union Instruction *instructions;
+    int count;
+    int *sites;                     // 每个字对应的基线指令流下标，报错和快速化计数时使用
+    union Instruction *entry;       // 函数入口，为 NULL 表示优化代码已经作废
+    LoopEntry *loops;
+    int loopCount;
+    InlinedCall *calls;
+    int callCount;
+    HoistedValue *hoisted;          // 外提的表达式的值
+    int hoistedCount;
+    ObjectShape **shapes;           // 检查用到的形状，GC 时标记，保证地址不会被复用，没有用到的位置为 NULL
+    int shapeCount;
+    int extraStack;                 // 内联的方法体额外需要的栈空间
+    int deopts;                     // 退回基线指令流的次数
+    struct OptimizedCode *previous; // 重新优化之前的版本，可能还有栈帧在执行，和函数一起释放
+} OptimizedCode;
+
+// 指令流中每隔这么多个字记一次所在指令的开头，查找字节码偏移时从最近的记录往后数
+#ifndef INSTRUCTION_START_STRIDE
+#define INSTRUCTION_START_STRIDE 16
+#endif
+
+/**
+ * 一条指令在指令流中的下标和字节码偏移
+ */
+typedef struct {
+    int index;
+    int offset;
+} InstructionStart;
+
+/**
+ * 行号表中的一段，从 offset 开始到下一段之前的字节码都在同一行
+ */
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 /**
  * 指令动态数组
  */
@@ -59,8 +227,20 @@ typedef struct {
     int size;
     int capacity;
     uint8_t *code;
-    int *lines;
+    LineStart *lines;               // 行号表，只在行号变化的地方记一段，按偏移递增
+    int lineCount;
+    int lineCapacity;
     ValueArray constants;
+
+    Instruction *instructions;      // 预解码的指令流，第一次执行前生成
+    InstructionStart *instructionStarts; // 每隔 INSTRUCTION_START_STRIDE 个字记一次包含这个字的指令的开头
+    int instructionCount;
+    InlineCache *inlineCaches;      // 指令流中属性访问和方法调用使用的内联缓存
+    int inlineCacheCount;
+    int8_t *quickenCounters;        // 指令流中每个字的快速化计数，只有通用的指令会用到
+    Instruction *entry;             // 调用时开始执行的位置，有优化代码时是优化代码的入口
+    int frameSize;                  // 栈帧最多用到的栈空间，不会超过执行的指令流的长度
+    OptimizedCode *optimized;       // 优化层生成的指令流，没有优化时为 NULL
 } Chunk;
 
 /**
@@ -82,6 +262,35 @@ void freeChunk(Chunk *chunk);
  */
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 
+/**
+ * 记录从 offset 开始的字节码所在的行，和上一段同一行时不记录
+ * @param chunk
+ * @param offset 不能小于已经记录的偏移
+ * @param line
+ */
+void addLine(Chunk *chunk, int offset, int line);
+
+/**
+ * 字节码所在的行，二分查找行号表
+ * @param chunk
+ * @param offset
+ * @return
+ */
+int getLine(Chunk *chunk, int offset);
+
+/**
+ * 丢弃 size 之后的字节码和它们的行号
+ * @param chunk
+ * @param size
+ */
+void truncateChunk(Chunk *chunk, int size);
+
+/**
+ * 释放字节码、行号表和常量多余的容量，函数编译完之后不会再增长
+ * @param chunk
+ */
+void shrinkChunk(Chunk *chunk);
+
 /**
  * 添加常量
  * @param chunk
@@ -90,4 +299,51 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line);
  */
 int addConstant(Chunk *chunk, Value value);
 
+/**
+ * 字节码指令的长度
+ * @param chunk
+ * @param offset
+ * @param words 指令在指令流中占用的字数，可以为 NULL
+ * @return 指令在字节码中占用的字节数
+ */
+int getInstructionLength(Chunk *chunk, int offset, int *words);
+
+/**
+ * 预解码字节码，生成直接线程化的指令流
+ * 常量、名字和跳转目标都在这里解码好，执行的时候不再读取字节码
+ * @param chunk
+ * @param handlers 每个字节码的处理程序地址，为 NULL 时指令流中存放字节码本身
+ */
+void decodeChunk(Chunk *chunk, void *const *handlers);
+
+/**
+ * 优化后的指令流中的位置对应的基线指令流下标，位置可以在任何一个版本中
+ * @param chunk
+ * @param instruction
+ * @return
+ */
+int getOptimizedIndex(Chunk *chunk, Instruction *instruction);
+
+/**
+ * 指令流中的位置对应的基线指令流下标，位置可以在基线或者优化后的指令流中
+ * @param chunk
+ * @param instruction
+ * @return
+ */
+static inline int getInstructionIndex(Chunk *chunk, Instruction *instruction) {
+    uintptr_t distance = (uintptr_t) instruction - (uintptr_t) chunk->instructions;
+    if (distance < (uintptr_t) chunk->instructionCount * sizeof(Instruction)) {
+        return (int) (distance / sizeof(Instruction));
+    }
+    return getOptimizedIndex(chunk, instruction);
+}
+
+/**
+ * 指令流中的位置对应的字节码偏移，从最近记录的指令开头往后数，最多数过 INSTRUCTION_START_STRIDE 个字
+ * @param chunk
+ * @param instruction
+ * @return
+ */
+int getInstructionOffset(Chunk *chunk, Instruction *instruction);
+
 #endif //CLOX_CHUNK_H
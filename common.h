@@ -13,8 +13,36 @@
 
 //#define DEBUG_STRESS_GC
 
+// 测试用的解释器在构建时定义 CLOX_NO_LOG，输出里只有脚本打印的内容
+#ifndef CLOX_NO_LOG
 #define DEBUG_LOG_GC
+#endif
+
+// 测试用的解释器还定义 CLOX_TEST_NATIVES，多出两个检查本地函数调用路径的本地函数：sum、join
+
+// 统计执行的指令对和三元组，退出时输出，用来决定合并哪些超级指令
+//#define DEBUG_PROFILE_OPCODES
 
 #define NAN_BOXING
 
+// 编译器支持标签地址(labels as values)时，解释器使用线程化分发，否则退回 switch
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
+// 老年代的完整标记由多个线程并行进行，需要 POSIX 线程
+#if defined(__unix__) || defined(__APPLE__)
+#define PARALLEL_MARK
+#endif
+
+// 老年代除字符串以外的对象由后台线程清除和释放，暂停里只剩标记；和并行标记一样需要 POSIX 线程
+#if defined(__unix__) || defined(__APPLE__)
+#define BACKGROUND_SWEEP
+#endif
+
+// JIT 只支持 x86-64 Linux，并且依赖 NaN boxing 的值表示，其他平台只使用解释器
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+#define JIT_SUPPORTED
+#endif
+
 #endif //CLOX_COMMON_H
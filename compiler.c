@@ -12,28 +12,41 @@
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
 
 Parser parser;
 Compiler *currentCompiler;
 ClassCompiler *currentClass = NULL;
 
+// 是否延迟编译函数体
+static bool lazyCompile = false;
+// 正在编译的源代码
+static const char *sourceStart = NULL;
+// 正在编译的源代码的副本，延迟编译的函数共用，第一次略读函数体时创建
+static ObjectString *lazySource = NULL;
+
 /**
  * 初始化编译器
  * @param compiler
+ * @param function 要编译的函数
+ * @param type
  */
-static void initCompiler(Compiler *compiler, FunctionType type) {
+static void initCompiler(Compiler *compiler, ObjectFunction *function, FunctionType type) {
     compiler->enclosing = currentCompiler;
     // 函数，如果为全局部分则类型为SCRIPT
-    compiler->function = newFunction();
+    compiler->function = function;
     compiler->type = type;
 
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->propertyGet = -1;
+    compiler->captureCount = 0;
 
     currentCompiler = compiler;
 
-    // 如果是个函数，函数的名字在上一个Token
-    if (type != TYPE_SCRIPT) {
+    // 如果是个函数，函数的名字在上一个Token，延迟编译的函数已经有名字
+    if (type != TYPE_SCRIPT && function->name == NULL) {
         currentCompiler->function->name = copyString(parser.previous.start, parser.previous.length);
     }
 
@@ -41,6 +54,7 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
     Local *local = &currentCompiler->locals[currentCompiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->isAssigned = false;
     if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
         local->name.start = "this";
         local->name.length = 4;
@@ -273,6 +287,8 @@ static void patchJump(int offset) {
 
     getCurrentChunk()->code[offset] = (jump >> 8) & 0xff;
     getCurrentChunk()->code[offset + 1] = jump & 0xff;
+    // 跳转落在当前位置，前面的指令不能再改写
+    currentCompiler->propertyGet = -1;
 }
 
 /**
@@ -291,6 +307,72 @@ static void emitLoop(int loopStart) {
     emitByte(offset & 0xff);
 }
 
+static void copyUpValue(ObjectFunction *function, uint8_t upValue);
+
+/**
+ * 改写按值捕获的上值
+ * 读取上值的指令改成读取复制的值，内层闭包从这个上值捕获的也一起改成复制
+ * @param function 已经编译完成
+ * @param upValue
+ */
+static void rewriteCopiedUpValue(ObjectFunction *function, uint8_t upValue) {
+    Chunk *chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->size; offset += getInstructionLength(chunk, offset, NULL)) {
+        uint8_t *code = &chunk->code[offset];
+        if (code[0] == OP_GET_UP_VALUE && code[1] == upValue) {
+            code[0] = OP_GET_COPIED;
+        } else if (code[0] == OP_CLOSURE) {
+            ObjectFunction *inner = AS_FUNCTION(chunk->constants.values[code[1]]);
+            for (int i = 0; i < inner->upValueCount; i++) {
+                if (code[2 + i * 2] == CAPTURE_UP_VALUE && code[3 + i * 2] == upValue) {
+                    code[2 + i * 2] = CAPTURE_COPIED;
+                    copyUpValue(inner, (uint8_t) i);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * 函数的上值改成按值捕获
+ * @param function
+ * @param upValue
+ */
+static void copyUpValue(ObjectFunction *function, uint8_t upValue) {
+    function->copiedCount++;
+    // 还没有编译的函数先记下来，编译之后再改写
+    if (function->lazy != NULL) {
+        function->lazy->copied[upValue] = true;
+        return;
+    }
+    rewriteCopiedUpValue(function, upValue);
+}
+
+/**
+ * 局部变量离开作用域，决定捕获它的闭包怎么捕获
+ * 没有被赋值过的变量复制进闭包，否则保持按引用捕获
+ * @param local
+ * @return 是否还有闭包按引用捕获这个变量，这时需要关闭上值
+ */
+static bool releaseCaptures(int local) {
+    Local *variable = &currentCompiler->locals[local];
+    if (!variable->isCaptured) {
+        return false;
+    }
+    for (int i = currentCompiler->captureCount - 1; i >= 0; i--) {
+        Capture *capture = &currentCompiler->captures[i];
+        if (capture->local != local) {
+            continue;
+        }
+        if (!variable->isAssigned) {
+            getCurrentChunk()->code[capture->offset] = CAPTURE_LOCAL_COPY;
+            copyUpValue(capture->function, capture->upValue);
+        }
+        *capture = currentCompiler->captures[--currentCompiler->captureCount];
+    }
+    return variable->isAssigned;
+}
+
 /**
  * 结束编译
  * @return 编译的函数
@@ -298,7 +380,26 @@ static void emitLoop(int loopStart) {
 static ObjectFunction *endCompiler() {
     emitReturn();
     ObjectFunction *function = currentCompiler->function;
+    // 函数的参数和最外层的局部变量没有结束作用域，在这里处理它们的捕获
+    for (int i = currentCompiler->localCount - 1; i >= 0; i--) {
+        releaseCaptures(i);
+    }
+    // 有错误的时候跳转可能没有回填，不做优化
+    if (!parser.hadError) {
+        optimizeChunk(getCurrentChunk());
+    }
+    shrinkChunk(getCurrentChunk());
+    // 延迟编译的函数，外层变量离开作用域时已经决定了哪些上值按值捕获
+    if (function->lazy != NULL && !parser.hadError) {
+        for (int i = 0; i < function->upValueCount; i++) {
+            if (function->lazy->copied[i]) {
+                rewriteCopiedUpValue(function, (uint8_t) i);
+            }
+        }
+    }
     dbgChunk(getCurrentChunk(), function->name != NULL ? function->name->chars : "<script>");
+    // 编译过程中写入常量没有经过写屏障
+    writeBarrierAll((Object *) function);
     currentCompiler = currentCompiler->enclosing;
     return function;
 }
@@ -560,6 +661,32 @@ static uint8_t identifierConstant(Token *name) {
     return makeConstant(OBJECT_VAL(copyString(name->start, name->length)));
 }
 
+/**
+ * 全局变量的槽位
+ * 槽位在编译的时候确定，之后才定义的全局变量也可以先分配槽位
+ * @param name
+ * @return
+ */
+static int globalVariable(Token *name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        errorAtPrevious("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
+/**
+ * 输出带两个字节全局变量槽位的字节码
+ * @param op
+ * @param slot
+ */
+static void emitGlobal(uint8_t op, int slot) {
+    emitByte(op);
+    emitByte((slot >> 8) & 0xff);
+    emitByte(slot & 0xff);
+}
+
 /**
  * 添加局部变量
  * @param name
@@ -575,6 +702,7 @@ static void addLocal(Token name) {
     // 避免 var a = a; 这样的语句，因为错误的变量遮蔽找不到变量
     local->depth = -1;
     local->isCaptured = false;
+    local->isAssigned = false;
 }
 
 /**
@@ -616,19 +744,19 @@ static void declareVariable() {
 }
 
 /**
- * 解析一个变量名，将变量加入字节码块中，返回变量在字节码块中的位置
+ * 解析一个变量名，全局变量返回变量的槽位
  * @param errorMessage
  * @return
  */
-static uint8_t parseVariable(const char *errorMessage) {
+static int parseVariable(const char *errorMessage) {
     consumeAndNext(TOKEN_IDENTIFIER, errorMessage);
     // 如果是局部变量，在这里声明局部变量
     declareVariable();
-    // 如果是局部变量，说明变量已经在栈中，返回一个假的表索引，不将其添加到常量表中
+    // 如果是局部变量，说明变量已经在栈中，返回一个假的槽位
     if (currentCompiler->scopeDepth > 0) {
         return 0;
     }
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 /**
@@ -646,13 +774,13 @@ static void markInitialized() {
  * 定义一个变量
  * @param global
  */
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (currentCompiler->scopeDepth > 0) {
         // 声明变量的时候，变量的深度为-1 这里要将深度还原为正确的作用域深度
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 /**
@@ -695,6 +823,26 @@ static int resolveLocal(Compiler *compiler, Token *name) {
     return -1;
 }
 
+/**
+ * 延迟编译的函数没有外层编译器，外层变量只能是略读函数体时找到的上值
+ * @param function
+ * @param name
+ * @return 不是延迟编译的函数或者没有找到时返回 -1
+ */
+static int resolveLazyUpValue(ObjectFunction *function, Token *name) {
+    if (function->lazy == NULL) {
+        return -1;
+    }
+    ValueArray *names = &function->lazy->upValueNames;
+    for (int i = 0; i < names->size; i++) {
+        ObjectString *upValueName = AS_STRING(names->values[i]);
+        if (upValueName->length == name->length && memcmp(upValueName->chars, name->start, name->length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 /**
  * 查询上值，添加引用
  * @param compiler
@@ -728,7 +876,7 @@ static int addUpValue(Compiler *compiler, uint8_t index, bool isLocal) {
  */
 static int resolveUpValue(Compiler *compiler, Token *name) {
     if (compiler->enclosing == NULL) {
-        return -1;
+        return resolveLazyUpValue(compiler->function, name);
     }
 
     int local = resolveLocal(compiler->enclosing, name);
@@ -745,6 +893,24 @@ static int resolveUpValue(Compiler *compiler, Token *name) {
     return -1;
 }
 
+/**
+ * 上值被赋值，最终捕获的局部变量不能按值捕获
+ * @param compiler
+ * @param upValue
+ */
+static void markUpValueAssigned(Compiler *compiler, int upValue) {
+    // 延迟编译的函数略读时已经标记过
+    if (compiler->enclosing == NULL) {
+        return;
+    }
+    UpValue *captured = &compiler->upValues[upValue];
+    if (captured->isLocal) {
+        compiler->enclosing->locals[captured->index].isAssigned = true;
+    } else {
+        markUpValueAssigned(compiler->enclosing, captured->index);
+    }
+}
+
 /**
  * 开启一个作用域
  */
@@ -762,7 +928,7 @@ static void endScope() {
     // 临时变量用过之后都pop了，应该是的
     while (currentCompiler->localCount > 0 &&
            currentCompiler->locals[currentCompiler->localCount - 1].depth > currentCompiler->scopeDepth) {
-        if (currentCompiler->locals[currentCompiler->localCount - 1].isCaptured) {
+        if (releaseCaptures(currentCompiler->localCount - 1)) {
             emitByte(OP_CLOSE_UP_VALUE);
         } else {
             emitByte(OP_POP);
@@ -786,16 +952,25 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UP_VALUE;
         setOp = OP_SET_UP_VALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = globalVariable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     // canAssign 标志避免变量表达式错误的处理等号
+    uint8_t op = getOp;
     if (canAssign && matchAndNext(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t) arg);
+        op = setOp;
+        if (op == OP_SET_LOCAL) {
+            currentCompiler->locals[arg].isAssigned = true;
+        } else if (op == OP_SET_UP_VALUE) {
+            markUpValueAssigned(currentCompiler, arg);
+        }
+    }
+    if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+        emitGlobal(op, arg);
     } else {
-        emitBytes(getOp, (uint8_t) arg);
+        emitBytes(op, (uint8_t) arg);
     }
 }
 
@@ -923,12 +1098,63 @@ static void dot(bool canAssign) {
         emitByte(argCount);
     } else {
         emitBytes(OP_GET_PROPERTY, name);
+        currentCompiler->propertyGet = getCurrentChunk()->size;
     }
 }
 
+/**
+ * 从 start 开始的指令是否都只是压入常量或者读取变量，执行它们没有副作用，也不会出错
+ * @param chunk
+ * @param start
+ * @return
+ */
+static bool isPureCode(Chunk *chunk, int start) {
+    for (int offset = start; offset < chunk->size; offset += getInstructionLength(chunk, offset, NULL)) {
+        switch (chunk->code[offset]) {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_GET_LOCAL:
+            case OP_GET_UP_VALUE:
+            case OP_GET_COPIED:
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
 static void grouping(bool canAssign) {
     expression();
     consumeAndNext(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+
+    Chunk *chunk = getCurrentChunk();
+    int get = currentCompiler->propertyGet;
+    if (get != chunk->size || !matchAndNext(TOKEN_LEFT_PAREN)) {
+        return;
+    }
+    currentCompiler->propertyGet = -1;
+    uint8_t argCount = argumentList();
+    if (!isPureCode(chunk, get)) {
+        // 参数可能有副作用，属性必须在参数之前读取
+        emitBytes(OP_CALL, argCount);
+        return;
+    }
+
+    // (a.b)(...) 的参数只是常量和变量时，和 a.b(...) 一样编译成方法调用，不用创建绑定的方法
+    // 接收者不是实例时仍然按照读取属性报错
+    uint8_t name = chunk->code[get - 1];
+    int length = chunk->size - get;
+    uint8_t arguments[UINT8_COUNT * 3];
+    memcpy(arguments, &chunk->code[get], length);
+    truncateChunk(chunk, get - 2);
+    for (int i = 0; i < length; i++) {
+        emitByte(arguments[i]);
+    }
+    emitBytes(OP_INVOKE_PROPERTY, name);
+    emitByte(argCount);
 }
 
 static void literal(bool canAssign) {
@@ -1118,11 +1344,29 @@ static void blockStatement() {
     consumeAndNext(TOKEN_RIGHT_BRACE, "Expect '}' after blockStatement.");
 }
 
-static void functionStatement(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+/**
+ * 记录闭包对局部变量的捕获，之后输出的字节是这个上值的来源
+ * 记录不下的时候这个变量只能按引用捕获
+ * @param function
+ * @param upValue
+ * @param local
+ */
+static void recordCapture(ObjectFunction *function, int upValue, int local) {
+    if (currentCompiler->captureCount == UINT8_COUNT) {
+        currentCompiler->locals[local].isAssigned = true;
+        return;
+    }
+    Capture *capture = &currentCompiler->captures[currentCompiler->captureCount++];
+    capture->local = local;
+    capture->function = function;
+    capture->upValue = (uint8_t) upValue;
+    capture->offset = getCurrentChunk()->size;
+}
 
+/**
+ * 参数列表和函数体的左括号
+ */
+static void parameterList() {
     consumeAndNext(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
     // 参数
     if (!check(TOKEN_RIGHT_PAREN)) {
@@ -1131,21 +1375,149 @@ static void functionStatement(FunctionType type) {
             if (currentCompiler->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (matchAndNext(TOKEN_COMMA));
     }
     consumeAndNext(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     consumeAndNext(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    blockStatement();
-    // 没必要，因为整个栈帧都要弹出了
-    // endScope();
+}
 
-    ObjectFunction *function = endCompiler();
-    // 闭包
+/**
+ * 略读函数体中的一个变量，用到外层的变量时添加上值
+ * 函数体中声明的同名局部变量也会被当成外层变量，多捕获一个上值不影响结果
+ * @param name
+ * @param isAssignment 后面紧跟着等号，外层变量被赋值，不能按值捕获
+ */
+static void skimVariable(Token name, bool isAssignment) {
+    if (resolveLocal(currentCompiler, &name) != -1) {
+        return;
+    }
+    int upValue = resolveUpValue(currentCompiler, &name);
+    if (upValue == -1) {
+        return;
+    }
+    // 新的上值，记下变量名，编译函数体时按照变量名找到上值
+    ValueArray *names = &currentCompiler->function->lazy->upValueNames;
+    if (upValue == names->size) {
+        Value upValueName = OBJECT_VAL(copyString(name.start, name.length));
+        push(upValueName);
+        writeValueArray(names, upValueName);
+        pop();
+    }
+    if (isAssignment) {
+        markUpValueAssigned(currentCompiler, upValue);
+    }
+}
+
+/**
+ * 略读函数体，只检查括号是否配对和找出用到的外层变量，记下函数在源代码中的位置
+ * 属性名和声明的变量名不会引用外层变量，跳过
+ * @param start 参数列表在源代码中的位置
+ * @param line 参数列表所在的行
+ * @param type
+ */
+static void skimFunctionBody(const char *start, int line, FunctionType type) {
+    ObjectFunction *function = currentCompiler->function;
+    LazyFunction *lazy = ALLOCATE(LazyFunction, 1);
+    lazy->source = NULL;
+    lazy->start = 0;
+    lazy->line = line;
+    lazy->type = type;
+    lazy->inClass = currentClass != NULL;
+    lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+    initValueArray(&lazy->upValueNames);
+    lazy->copied = NULL;
+    function->lazy = lazy;
+
+    if (lazySource == NULL) {
+        lazySource = copyString(sourceStart, (int) strlen(sourceStart));
+    }
+    lazy->source = lazySource;
+    lazy->start = (int) (start - sourceStart);
+
+    int depth = 1;
+    // 表达式里不会出现花括号，所以遇到花括号时圆括号必须都已经闭合
+    int parens = 0;
+    TokenType before = TOKEN_LEFT_BRACE;
+    while (depth > 0 && !check(TOKEN_EOF)) {
+        next();
+        switch (parser.previous.type) {
+            case TOKEN_LEFT_PAREN:
+                parens++;
+                break;
+            case TOKEN_RIGHT_PAREN:
+                if (parens == 0) {
+                    errorAtPrevious("Expect expression.");
+                } else {
+                    parens--;
+                }
+                break;
+            case TOKEN_LEFT_BRACE:
+            case TOKEN_RIGHT_BRACE:
+                if (parens > 0) {
+                    errorAtPrevious("Expect ')' after expression.");
+                    parens = 0;
+                }
+                depth += parser.previous.type == TOKEN_LEFT_BRACE ? 1 : -1;
+                break;
+            case TOKEN_IDENTIFIER:
+                if (before != TOKEN_DOT && before != TOKEN_VAR && before != TOKEN_FUN && before != TOKEN_CLASS) {
+                    skimVariable(parser.previous, check(TOKEN_EQUAL));
+                }
+                break;
+            case TOKEN_THIS:
+                skimVariable(syntheticToken("this"), false);
+                break;
+            case TOKEN_SUPER:
+                // super 表达式还会读取 this
+                skimVariable(syntheticToken("this"), false);
+                skimVariable(syntheticToken("super"), false);
+                break;
+            default:
+                break;
+        }
+        before = parser.previous.type;
+    }
+    if (depth > 0) {
+        errorAtCurrent("Expect '}' after blockStatement.");
+    }
+
+    lazy->copied = ALLOCATE(bool, function->upValueCount);
+    for (int i = 0; i < function->upValueCount; i++) {
+        lazy->copied[i] = false;
+    }
+    writeBarrierAll((Object *) function);
+    currentCompiler = currentCompiler->enclosing;
+}
+
+static void functionStatement(FunctionType type) {
+    Compiler compiler;
+    initCompiler(&compiler, newFunction(), type);
+    beginScope();
+
+    const char *start = parser.current.start;
+    int line = parser.current.line;
+    parameterList();
+
+    ObjectFunction *function = compiler.function;
+    if (lazyCompile) {
+        skimFunctionBody(start, line, type);
+    } else {
+        blockStatement();
+        // 没必要，因为整个栈帧都要弹出了
+        // endScope();
+        endCompiler();
+    }
+    // 闭包，先都按引用捕获，局部变量离开作用域时再决定能不能复制
     emitBytes(OP_CLOSURE, makeConstant(OBJECT_VAL(function)));
     for (int i = 0; i < function->upValueCount; i++) {
-        emitByte(compiler.upValues[i].isLocal ? 1 : 0);
+        if (compiler.upValues[i].isLocal) {
+            recordCapture(function, i, compiler.upValues[i].index);
+            emitByte(CAPTURE_LOCAL);
+        } else {
+            emitByte(CAPTURE_UP_VALUE);
+        }
         emitByte(compiler.upValues[i].index);
     }
 }
@@ -1173,7 +1545,7 @@ static void classDeclaration() {
     declareVariable();
 
     emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(currentCompiler->scopeDepth > 0 ? 0 : globalVariable(&className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -1232,14 +1604,14 @@ static void methodDeclaration() {
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect functionStatement name.");
+    int global = parseVariable("Expect functionStatement name.");
     markInitialized();
     functionStatement(TYPE_FUNCTION);
     defineVariable(global);
 }
 
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (matchAndNext(TOKEN_EQUAL)) {
         expression();
@@ -1253,9 +1625,11 @@ static void varDeclaration() {
 
 ObjectFunction *compile(const char *source) {
     initScanner(source);
+    sourceStart = source;
+    lazySource = NULL;
 
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&compiler, newFunction(), TYPE_SCRIPT);
 
     parser.hadError = false;
     parser.panicMode = false;
@@ -1266,14 +1640,77 @@ ObjectFunction *compile(const char *source) {
     }
 
     ObjectFunction *function = endCompiler();
+    lazySource = NULL;
     return parser.hadError ? NULL : function;
 }
 
+void enableLazyCompile() {
+    lazyCompile = true;
+}
+
+bool compileLazyFunction(ObjectFunction *function) {
+    LazyFunction *lazy = function->lazy;
+    // 只需要知道能不能使用 this 和 super，外层的类不会再用到
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = NULL;
+    classCompiler.hasSuperclass = lazy->hasSuperclass;
+    currentClass = lazy->inClass ? &classCompiler : NULL;
+
+    sourceStart = lazy->source->chars;
+    lazySource = lazy->source;
+    initScannerAt(sourceStart + lazy->start, lazy->line);
+    parser.hadError = false;
+    parser.panicMode = false;
+    next();
+
+    // 没有外层编译器，外层变量按照略读时记下的变量名找到上值
+    Compiler compiler;
+    initCompiler(&compiler, function, lazy->type);
+    beginScope();
+    int arity = function->arity;
+    function->arity = 0;
+    parameterList();
+    blockStatement();
+    endCompiler();
+
+    currentClass = NULL;
+    lazySource = NULL;
+    if (parser.hadError) {
+        freeChunk(&function->chunk);
+        function->arity = arity;
+        return false;
+    }
+    freeLazyFunction(function);
+    return true;
+}
+
+void markLazyFunction(LazyFunction *lazy) {
+    if (lazy == NULL) {
+        return;
+    }
+    markObject((Object *) lazy->source);
+    for (int i = 0; i < lazy->upValueNames.size; i++) {
+        markValue(lazy->upValueNames.values[i]);
+    }
+}
+
+void freeLazyFunction(ObjectFunction *function) {
+    LazyFunction *lazy = function->lazy;
+    if (lazy == NULL) {
+        return;
+    }
+    freeValueArray(&lazy->upValueNames);
+    FREE_ARRAY(bool, lazy->copied, function->upValueCount);
+    FREE(LazyFunction, lazy);
+    function->lazy = NULL;
+}
+
 void markCompilerRoots() {
     Compiler *compiler = currentCompiler;
     // 所有函数
     while (compiler != NULL) {
-        markObject((Object *) compiler->function);
+        markUnbarriered((Object *) compiler->function);
         compiler = compiler->enclosing;
     }
+    markObject((Object *) lazySource);
 }
@@ -26,6 +26,7 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured; // 是否被捕捉
+    bool isAssigned; // 声明之后是否被赋值过，没有的话闭包可以按值捕获
 } Local;
 
 /**
@@ -36,6 +37,17 @@ typedef struct {
     bool isLocal;
 } UpValue;
 
+/**
+ * 闭包对局部变量的一次捕获
+ * 局部变量离开作用域时才知道它有没有被赋值过，那时再决定按值还是按引用捕获
+ */
+typedef struct {
+    int local;                  // 被捕获的局部变量
+    ObjectFunction *function;   // 捕获它的函数
+    uint8_t upValue;            // 在这个函数中的上值下标
+    int offset;                 // OP_CLOSURE 中这个上值来源的位置
+} Capture;
+
 /**
  * 函数类型
  */
@@ -46,6 +58,21 @@ typedef enum {
     TYPE_INITIALIZER,
 } FunctionType;
 
+/**
+ * 延迟编译的函数
+ * 第一遍编译只略读函数体，找出用到的外层变量，记下编译需要的信息，第一次调用时再编译
+ */
+typedef struct LazyFunction {
+    ObjectString *source;       // 函数所在的整段源代码
+    int start;                  // 参数列表的 '(' 在源代码中的位置
+    int line;                   // 参数列表所在的行
+    FunctionType type;
+    bool inClass;               // 是否定义在类中，可以使用 this
+    bool hasSuperclass;         // 所在的类是否有超类，可以使用 super
+    ValueArray upValueNames;    // 函数体用到的外层变量名，按照上值下标排列
+    bool *copied;               // 每个上值是否按值捕获，编译之后改写读取这些上值的指令
+} LazyFunction;
+
 /**
  * 编译器
  */
@@ -59,6 +86,11 @@ typedef struct Compiler {
     Local locals[UINT8_COUNT];
     int localCount;
     int scopeDepth;
+
+    Capture captures[UINT8_COUNT];  // 还在作用域中的局部变量被闭包捕获的记录
+    int captureCount;
+
+    int propertyGet;    // 最后一条 OP_GET_PROPERTY 之后的位置，之后有跳转落到这里时为 -1
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -109,4 +141,29 @@ ObjectFunction *compile(const char *source);
  */
 void markCompilerRoots();
 
+/**
+ * 打开延迟编译，之后编译的函数体在第一次调用时才编译
+ * 函数体中的编译错误也推迟到第一次调用时报告
+ */
+void enableLazyCompile();
+
+/**
+ * 编译延迟编译的函数
+ * @param function
+ * @return 函数体有编译错误时返回 false，函数保持未编译的状态
+ */
+bool compileLazyFunction(ObjectFunction *function);
+
+/**
+ * 标记延迟编译的函数引用的源代码和变量名
+ * @param lazy 可以为 NULL
+ */
+void markLazyFunction(LazyFunction *lazy);
+
+/**
+ * 释放函数的延迟编译信息
+ * @param function
+ */
+void freeLazyFunction(ObjectFunction *function);
+
 #endif //CLOX_COMPILER_H
@@ -3,10 +3,12 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int simpleInstruction(const char *name, int offset) {
     printf("%s\n", name);
@@ -34,6 +36,12 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+    int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4d '%s'\n", name, slot, globalName(slot)->chars);
+    return offset + 3;
+}
+
 static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
@@ -43,6 +51,22 @@ static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
     return offset + 3;
 }
 
+static int localsInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int localPropertyInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
 void disassembleChunk(Chunk *chunk, const char *name) {
     printf("== %s ==\n", name);
 
@@ -53,10 +77,11 @@ void disassembleChunk(Chunk *chunk, const char *name) {
 
 int disassembleInstruction(Chunk *chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
@@ -73,11 +98,11 @@ int disassembleInstruction(Chunk *chunk, int offset) {
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
@@ -86,6 +111,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return byteInstruction("OP_GET_UP_VALUE", chunk, offset);
         case OP_SET_UP_VALUE:
             return byteInstruction("OP_SET_UP_VALUE", chunk, offset);
+        case OP_GET_COPIED:
+            return byteInstruction("OP_GET_COPIED", chunk, offset);
         case OP_GET_PROPERTY:
             return constantInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
@@ -122,10 +149,16 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_INVOKE_PROPERTY:
+            return invokeInstruction("OP_INVOKE_PROPERTY", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -133,10 +166,16 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             printValue(chunk->constants.values[constant]);
             printf("\n");
             ObjectFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+            static const char *captureNames[] = {
+                    [CAPTURE_UP_VALUE]   = "upValue",
+                    [CAPTURE_LOCAL]      = "local",
+                    [CAPTURE_COPIED]     = "copied upValue",
+                    [CAPTURE_LOCAL_COPY] = "copied local",
+            };
             for (int j = 0; j < function->upValueCount; j++) {
-                int isLocal = chunk->code[offset++];
+                int kind = chunk->code[offset++];
                 int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upValue", index);
+                printf("%04d      |                     %s %d\n", offset - 2, captureNames[kind], index);
             }
             return offset;
         }
@@ -148,8 +187,174 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_ADD_LOCALS:
+            return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
+
+#ifdef DEBUG_PROFILE_OPCODES
+
+#define PROFILE_TOP 20
+
+static const char *opcodeNames[OP_COUNT] = {
+        [OP_CONSTANT] = "OP_CONSTANT",
+        [OP_NIL] = "OP_NIL",
+        [OP_TRUE] = "OP_TRUE",
+        [OP_FALSE] = "OP_FALSE",
+        [OP_POP] = "OP_POP",
+        [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+        [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+        [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+        [OP_GET_LOCAL] = "OP_GET_LOCAL",
+        [OP_SET_LOCAL] = "OP_SET_LOCAL",
+        [OP_GET_UP_VALUE] = "OP_GET_UP_VALUE",
+        [OP_SET_UP_VALUE] = "OP_SET_UP_VALUE",
+        [OP_GET_COPIED] = "OP_GET_COPIED",
+        [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+        [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+        [OP_GET_SUPER] = "OP_GET_SUPER",
+        [OP_EQUAL] = "OP_EQUAL",
+        [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+        [OP_GREATER] = "OP_GREATER",
+        [OP_LESS] = "OP_LESS",
+        [OP_ADD] = "OP_ADD",
+        [OP_SUBTRACT] = "OP_SUBTRACT",
+        [OP_MULTIPLY] = "OP_MULTIPLY",
+        [OP_DIVIDE] = "OP_DIVIDE",
+        [OP_NOT] = "OP_NOT",
+        [OP_NEGATE] = "OP_NEGATE",
+        [OP_PRINT] = "OP_PRINT",
+        [OP_JUMP] = "OP_JUMP",
+        [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+        [OP_LOOP] = "OP_LOOP",
+        [OP_CALL] = "OP_CALL",
+        [OP_INVOKE] = "OP_INVOKE",
+        [OP_INVOKE_PROPERTY] = "OP_INVOKE_PROPERTY",
+        [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+        [OP_CLOSURE] = "OP_CLOSURE",
+        [OP_CLOSE_UP_VALUE] = "OP_CLOSE_UP_VALUE",
+        [OP_CLASS] = "OP_CLASS",
+        [OP_INHERIT] = "OP_INHERIT",
+        [OP_METHOD] = "OP_METHOD",
+        [OP_RETURN] = "OP_RETURN",
+        [OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+        [OP_GET_LOCAL] = "OP_GET_LOCAL",
+        [OP_GET_LOCAL] = "OP_GET_LOCAL",
+        [OP_ADD] = "OP_ADD",
+        [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+        [OP_LESS] = "OP_LESS",
+        [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+        [OP_POP] = "OP_POP",
+        [OP_GET_LOCAL_PROPERTY] = "OP_GET_LOCAL_PROPERTY",
+        [OP_TAIL_CALL] = "OP_TAIL_CALL",
+        [OP_TAIL_INVOKE] = "OP_TAIL_INVOKE",
+        [OP_ADD_NUM] = "OP_ADD_NUM",
+        [OP_ADD_STR] = "OP_ADD_STR",
+        [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+        [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+        [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+        [OP_GREATER_NUM] = "OP_GREATER_NUM",
+        [OP_LESS_NUM] = "OP_LESS_NUM",
+        [OP_CALL_NATIVE] = "OP_CALL_NATIVE",
+        [OP_GUARD_NUMBER] = "OP_GUARD_NUMBER",
+        [OP_GUARD_STRING] = "OP_GUARD_STRING",
+        [OP_INVOKE_INLINE] = "OP_INVOKE_INLINE",
+        [OP_INLINE_RETURN] = "OP_INLINE_RETURN",
+        [OP_CALL_INLINE] = "OP_CALL_INLINE",
+        [OP_GUARD_SHAPE] = "OP_GUARD_SHAPE",
+        [OP_GET_FIELD] = "OP_GET_FIELD",
+        [OP_GET_LOCAL_FIELD] = "OP_GET_LOCAL_FIELD",
+        [OP_SET_FIELD] = "OP_SET_FIELD",
+        [OP_GET_HOISTED] = "OP_GET_HOISTED",
+        [OP_SET_HOISTED] = "OP_SET_HOISTED",
+        [OP_GET_LOCAL] = "OP_GET_LOCAL",
+        [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+};
+
+typedef struct {
+    uint64_t count;
+    int sequence[3];
+} ProfileEntry;
+
+static uint64_t pairCounts[OP_COUNT][OP_COUNT];
+static uint64_t tripleCounts[OP_COUNT][OP_COUNT][OP_COUNT];
+// 最近执行的两条指令，-1 表示还没有
+static int previous[2] = {-1, -1};
+
+void profileOpcode(uint8_t opcode) {
+    if (previous[1] >= 0) {
+        pairCounts[previous[1]][opcode]++;
+        if (previous[0] >= 0) {
+            tripleCounts[previous[0]][previous[1]][opcode]++;
+        }
+    }
+    previous[0] = previous[1];
+    previous[1] = opcode;
+}
+
+static int compareEntry(const void *a, const void *b) {
+    uint64_t x = ((const ProfileEntry *) a)->count;
+    uint64_t y = ((const ProfileEntry *) b)->count;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/**
+ * 输出出现次数最多的序列
+ * @param title
+ * @param entries
+ * @param count
+ * @param length 序列长度
+ */
+static void printTopSequences(const char *title, ProfileEntry *entries, int count, int length) {
+    qsort(entries, count, sizeof(ProfileEntry), compareEntry);
+    fprintf(stderr, "== %s ==\n", title);
+    for (int i = 0; i < count && i < PROFILE_TOP; i++) {
+        fprintf(stderr, "%12llu ", (unsigned long long) entries[i].count);
+        for (int j = 0; j < length; j++) {
+            fprintf(stderr, j == 0 ? "%s" : " -> %s", opcodeNames[entries[i].sequence[j]]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+void printOpcodeProfile() {
+    ProfileEntry *entries = malloc(sizeof(ProfileEntry) * OP_COUNT * OP_COUNT * OP_COUNT);
+    if (entries == NULL) {
+        return;
+    }
+
+    int count = 0;
+    for (int a = 0; a < OP_COUNT; a++) {
+        for (int b = 0; b < OP_COUNT; b++) {
+            if (pairCounts[a][b] > 0) {
+                entries[count++] = (ProfileEntry) {pairCounts[a][b], {a, b, 0}};
+            }
+        }
+    }
+    printTopSequences("opcode pairs", entries, count, 2);
+
+    count = 0;
+    for (int a = 0; a < OP_COUNT; a++) {
+        for (int b = 0; b < OP_COUNT; b++) {
+            for (int c = 0; c < OP_COUNT; c++) {
+                if (tripleCounts[a][b][c] > 0) {
+                    entries[count++] = (ProfileEntry) {tripleCounts[a][b][c], {a, b, c}};
+                }
+            }
+        }
+    }
+    printTopSequences("opcode triples", entries, count, 3);
+
+    free(entries);
+}
+
+#undef PROFILE_TOP
+
+#endif
@@ -9,14 +9,28 @@
 
 #include "chunk.h"
 
+#ifndef CLOX_NO_LOG
 #define debug
+#endif
+
+// 标记线程和清除线程也会打印日志，一条日志分几次输出时锁住 stdout，不和其他线程的输出交错
+// flockfile 是 POSIX 的函数，严格的 -std=c11 下 glibc 不声明它，这时不加锁
+#if defined(__APPLE__) || (defined(__unix__) && defined(_POSIX_C_SOURCE))
+#define LOCK_LOG() flockfile(stdout)
+#define UNLOCK_LOG() funlockfile(stdout)
+#else
+#define LOCK_LOG()
+#define UNLOCK_LOG()
+#endif
 
 #ifdef debug
 #define dbg(format, ...) \
 do {                                                                                \
+    LOCK_LOG();                                                                     \
     printf("%s %s FILE [%s] LINE [%d] : ", __DATE__, __TIME__, __FILE__, __LINE__); \
     printf(format, ##__VA_ARGS__);                                                  \
     printf("\r\n");                                                                 \
+    UNLOCK_LOG();                                                                   \
 } while(false)
 #else
 #define dbg(format, ...)
@@ -58,10 +72,12 @@ do {                                                            \
 #ifdef debug
 #define dbgValue(value, format, ...) \
 do {                                                                                \
+    LOCK_LOG();                                                                     \
     printf("%s %s FILE [%s] LINE [%d] : ", __DATE__, __TIME__, __FILE__, __LINE__); \
     printf(format, ##__VA_ARGS__);                                                  \
     printValue(value);                                                              \
     printf("\r\n");                                                                 \
+    UNLOCK_LOG();                                                                   \
 } while(false)
 #else
 #define dbgValue(value, format, ...)
@@ -82,4 +98,17 @@ void disassembleChunk(Chunk *chunk, const char *name);
  */
 int disassembleInstruction(Chunk *chunk, int offset);
 
+#ifdef DEBUG_PROFILE_OPCODES
+/**
+ * 记录一条执行的指令
+ * @param opcode
+ */
+void profileOpcode(uint8_t opcode);
+
+/**
+ * 输出出现最多的指令对和三元组
+ */
+void printOpcodeProfile();
+#endif
+
 #endif //CLOX_DEBUG_H
\ No newline at end of file
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "debug.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#define HEAP_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define HEAP_ASAN
+#endif
+#endif
+
+#ifdef HEAP_ASAN
+#include <sanitizer/asan_interface.h>
+// 空闲格子除了链表指针都不能访问，AddressSanitizer 仍然可以发现释放之后的使用
+#define POISON_CELL(cell, size) \
+        ASAN_POISON_MEMORY_REGION((char *) (cell) + sizeof(Cell), (size) - sizeof(Cell))
+#define UNPOISON_CELL(cell, size) ASAN_UNPOISON_MEMORY_REGION(cell, size)
+#define UNPOISON_PAGE(page) ASAN_UNPOISON_MEMORY_REGION(page, HEAP_PAGE_SIZE)
+#else
+#define POISON_CELL(cell, size)
+#define UNPOISON_CELL(cell, size)
+#define UNPOISON_PAGE(page)
+#endif
+
+/**
+ * 一个类别的页和空闲格子，只由执行程序的线程使用
+ */
+typedef struct {
+    Page *pages;
+    Cell *free;
+} SizeClass;
+
+static SizeClass classes[HEAP_CLASSES];
+// 等待清除的页
+static Page *sweepPages[HEAP_CLASSES];
+
+static inline Page *pageOf(Object *object) {
+    return (Page *) ((uintptr_t) object & ~(uintptr_t) (HEAP_PAGE_SIZE - 1));
+}
+
+static inline int cellIndex(Page *page, Object *object) {
+    return (int) (((char *) object - page->cells) / page->cellSize);
+}
+
+static inline bool isAllocated(Page *page, int index) {
+    return (page->allocated[index / 64] >> (index % 64)) & 1;
+}
+
+/**
+ * 新建一页，所有格子按地址顺序接到类别的空闲链表上
+ * @param sizeClass
+ * @param cellSize
+ */
+static void newPage(int sizeClass, int cellSize) {
+    Page *page = (Page *) aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+    if (page == NULL) {
+        dbg("Error when alloc heap page");
+        exit(1);
+    }
+    page->sizeClass = sizeClass;
+    page->cellSize = cellSize;
+    page->cells = (char *) page + sizeof(Page);
+    page->cellCount = (int) ((HEAP_PAGE_SIZE - sizeof(Page)) / cellSize);
+    page->free = NULL;
+    page->freeTail = NULL;
+    memset(page->allocated, 0, sizeof(page->allocated));
+
+    SizeClass *klass = &classes[sizeClass];
+    for (int i = page->cellCount - 1; i >= 0; i--) {
+        Cell *cell = (Cell *) (page->cells + (size_t) i * cellSize);
+        cell->next = klass->free;
+        klass->free = cell;
+        POISON_CELL(cell, cellSize);
+    }
+    page->next = klass->pages;
+    klass->pages = page;
+}
+
+Object *heapAllocate(size_t size, ObjectType type) {
+    if (size > HEAP_MAX_CELL) {
+        dbg("Error when alloc object of %zu bytes", size);
+        exit(1);
+    }
+    int cellSize = (int) ((size + HEAP_CELL_ALIGN - 1) / HEAP_CELL_ALIGN * HEAP_CELL_ALIGN);
+    int sizeClass = type == OBJECT_STRING ? HEAP_STRING_CLASS : cellSize / HEAP_CELL_ALIGN - 1;
+    SizeClass *klass = &classes[sizeClass];
+    if (klass->free == NULL) {
+        newPage(sizeClass, cellSize);
+    }
+
+    Cell *cell = klass->free;
+    klass->free = cell->next;
+    Object *object = (Object *) cell;
+    Page *page = pageOf(object);
+    UNPOISON_CELL(cell, page->cellSize);
+    int index = cellIndex(page, object);
+    page->allocated[index / 64] |= (uint64_t) 1 << (index % 64);
+    return object;
+}
+
+void heapFree(Object *object) {
+    Page *page = pageOf(object);
+    int index = cellIndex(page, object);
+    page->allocated[index / 64] &= ~((uint64_t) 1 << (index % 64));
+
+    SizeClass *klass = &classes[page->sizeClass];
+    Cell *cell = (Cell *) object;
+    cell->next = klass->free;
+    klass->free = cell;
+    POISON_CELL(cell, page->cellSize);
+}
+
+void detachPages() {
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        sweepPages[i] = classes[i].pages;
+        classes[i].pages = NULL;
+        classes[i].free = NULL;
+    }
+}
+
+bool takeObjectPages(Page *pages[HEAP_CLASSES]) {
+    bool found = false;
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        if (i == HEAP_STRING_CLASS) {
+            pages[i] = NULL;
+            continue;
+        }
+        pages[i] = sweepPages[i];
+        sweepPages[i] = NULL;
+        found = found || pages[i] != NULL;
+    }
+    return found;
+}
+
+Page *takeSweepPage() {
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        Page *page = sweepPages[i];
+        if (page != NULL) {
+            sweepPages[i] = page->next;
+            return page;
+        }
+    }
+    return NULL;
+}
+
+bool sweepPage(Page *page, void (*release)(Object *object)) {
+    // 从后往前扫描，空闲链表按地址从小到大排列
+    Cell *free = NULL;
+    Cell *freeTail = NULL;
+    bool live = false;
+    for (int i = page->cellCount - 1; i >= 0; i--) {
+        Object *object = (Object *) (page->cells + (size_t) i * page->cellSize);
+        if (isAllocated(page, i)) {
+            if (object->isMarked) {
+                object->isMarked = false;
+                live = true;
+                continue;
+            }
+            release(object);
+            page->allocated[i / 64] &= ~((uint64_t) 1 << (i % 64));
+            POISON_CELL(object, page->cellSize);
+        }
+        Cell *cell = (Cell *) object;
+        cell->next = free;
+        free = cell;
+        if (freeTail == NULL) {
+            freeTail = cell;
+        }
+    }
+    page->free = free;
+    page->freeTail = freeTail;
+    return live;
+}
+
+/**
+ * 把一页和它的空闲格子接到链表的前面
+ * @param pages
+ * @param pagesTail 为 NULL 时不维护
+ * @param free
+ * @param freeTail 为 NULL 时不维护
+ * @param page
+ */
+static void linkPage(Page **pages, Page **pagesTail, Cell **free, Cell **freeTail, Page *page) {
+    page->next = *pages;
+    *pages = page;
+    if (pagesTail != NULL && *pagesTail == NULL) {
+        *pagesTail = page;
+    }
+    if (page->free != NULL) {
+        page->freeTail->next = *free;
+        *free = page->free;
+        if (freeTail != NULL && *freeTail == NULL) {
+            *freeTail = page->freeTail;
+        }
+    }
+    page->free = NULL;
+    page->freeTail = NULL;
+}
+
+void returnPage(Page *page) {
+    SizeClass *klass = &classes[page->sizeClass];
+    linkPage(&klass->pages, NULL, &klass->free, NULL, page);
+}
+
+void addSweptPage(SweptPages *swept, Page *page) {
+    int i = page->sizeClass;
+    linkPage(&swept->pages[i], &swept->pagesTail[i], &swept->free[i], &swept->freeTail[i], page);
+}
+
+void returnSweptPages(SweptPages *swept) {
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        if (swept->pages[i] != NULL) {
+            swept->pagesTail[i]->next = classes[i].pages;
+            classes[i].pages = swept->pages[i];
+        }
+        if (swept->free[i] != NULL) {
+            swept->freeTail[i]->next = classes[i].free;
+            classes[i].free = swept->free[i];
+        }
+    }
+    memset(swept, 0, sizeof(SweptPages));
+}
+
+void freePage(Page *page) {
+    UNPOISON_PAGE(page);
+    free(page);
+}
+
+/**
+ * 释放链表上的页和页里的对象
+ * @param page
+ * @param release
+ */
+static void freePageList(Page *page, void (*release)(Object *object)) {
+    while (page != NULL) {
+        Page *next = page->next;
+        for (int i = 0; i < page->cellCount; i++) {
+            if (isAllocated(page, i)) {
+                release((Object *) (page->cells + (size_t) i * page->cellSize));
+            }
+        }
+        freePage(page);
+        page = next;
+    }
+}
+
+void freeHeap(void (*release)(Object *object)) {
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        freePageList(classes[i].pages, release);
+        freePageList(sweepPages[i], release);
+        classes[i].pages = NULL;
+        classes[i].free = NULL;
+        sweepPages[i] = NULL;
+    }
+}
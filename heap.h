@@ -0,0 +1,124 @@
+#ifndef CLOX_HEAP_H
+#define CLOX_HEAP_H
+
+#include "common.h"
+#include "object.h"
+
+// 页的大小，页按自己的大小对齐，对象的地址去掉低位就是所在的页
+#define HEAP_PAGE_SIZE (32 * 1024)
+// 格子的大小按这个值对齐，每个对齐后的大小是一个类别
+#define HEAP_CELL_ALIGN 8
+// 最大的格子，所有对象都不超过这个大小
+#define HEAP_MAX_CELL 256
+#define HEAP_SIZE_CLASSES (HEAP_MAX_CELL / HEAP_CELL_ALIGN)
+// 字符串单独放在一类页里：死掉的字符串要先从常量池删除，这些页只由执行程序的线程清除
+#define HEAP_STRING_CLASS HEAP_SIZE_CLASSES
+#define HEAP_CLASSES (HEAP_SIZE_CLASSES + 1)
+// 一页最多的格子数量
+#define HEAP_PAGE_CELLS (HEAP_PAGE_SIZE / HEAP_CELL_ALIGN)
+
+/**
+ * 空闲的格子，开头存放空闲链表的下一个格子
+ */
+typedef struct Cell {
+    struct Cell *next;
+} Cell;
+
+/**
+ * 页，开头是页头，后面是同样大小的格子
+ * 分配位图记录哪些格子里有对象，清除时按顺序扫描整页
+ */
+typedef struct Page {
+    struct Page *next;          // 同一类别的下一页
+    Cell *free;                 // 清除之后页里的空闲格子，交回堆时接到类别的空闲链表上
+    Cell *freeTail;
+    int sizeClass;
+    int cellSize;
+    int cellCount;
+    char *cells;
+    uint64_t allocated[HEAP_PAGE_CELLS / 64];
+} Page;
+
+/**
+ * 清除完的页，按类别接好页和空闲格子，交回堆时每个类别只接一次
+ */
+typedef struct {
+    Page *pages[HEAP_CLASSES];
+    Page *pagesTail[HEAP_CLASSES];
+    Cell *free[HEAP_CLASSES];
+    Cell *freeTail[HEAP_CLASSES];
+} SweptPages;
+
+/**
+ * 从对象的类别的空闲链表取一个格子，没有空闲格子时新建一页
+ * @param size 对象的大小
+ * @param type 字符串放在单独的页里
+ * @return
+ */
+Object *heapAllocate(size_t size, ObjectType type);
+
+/**
+ * 把格子放回类别的空闲链表，对象所在的页不能正在清除
+ * @param object
+ */
+void heapFree(Object *object);
+
+/**
+ * 开始清除：所有页都等待清除，空闲链表清空，清除过程中分配的对象都在新的页里
+ */
+void detachPages();
+
+/**
+ * 取出所有等待清除的页，字符串的页除外，交给后台清除线程
+ * @param pages 每个类别的页链表
+ * @return 是否有页
+ */
+bool takeObjectPages(Page *pages[HEAP_CLASSES]);
+
+/**
+ * 取出一页等待清除的页
+ * @return 都清除完时返回 NULL
+ */
+Page *takeSweepPage();
+
+/**
+ * 清除一页：没有标记的对象交给 release 释放，格子放回页的空闲链表；有标记的对象清掉标记
+ * 只有拥有这一页的线程可以调用
+ * @param page
+ * @param release
+ * @return 页里是否还有对象
+ */
+bool sweepPage(Page *page, void (*release)(Object *object));
+
+/**
+ * 清除完的页交回堆
+ * @param page
+ */
+void returnPage(Page *page);
+
+/**
+ * 清除完的页先放在 swept 里，之后由执行程序的线程用 returnSweptPages 一起交回堆
+ * @param swept
+ * @param page
+ */
+void addSweptPage(SweptPages *swept, Page *page);
+
+/**
+ * 把 swept 里的页交回堆
+ * @param swept
+ */
+void returnSweptPages(SweptPages *swept);
+
+/**
+ * 把没有对象的页还给系统
+ * @param page
+ */
+void freePage(Page *page);
+
+/**
+ * 释放所有页，页里的对象先交给 release
+ * @param release
+ */
+void freeHeap(void (*release)(Object *object));
+
+#endif //CLOX_HEAP_H
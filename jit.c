@@ -0,0 +1,777 @@
+// MAP_ANONYMOUS 不在 POSIX 里，严格的 -std=c11 下要在包含系统头文件之前打开
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "jit.h"
+#include "debug.h"
+#include "memory.h"
+
+#ifdef JIT_SUPPORTED
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * 机器码和解释器之间交换的状态
+ */
+typedef struct {
+    Value *stackTop;
+    Value *slots;
+    ObjectUpValue **upValues;
+    Value *copies;              // 闭包按值捕获的上值
+    int exit;                   // 退出时解释器继续执行的指令在指令流中的下标
+} JitState;
+
+/**
+ * 机器码的入口，先保存寄存器，再跳到 entry 开始执行
+ */
+typedef void (*JitFunction)(JitState *state, void *entry);
+
+/**
+ * x86-64 寄存器
+ * 机器码中 rbx 指向 JitState，r12 是栈顶，r13 是栈帧的槽位，r14 固定为 QNAN，r15 是闭包的上值
+ */
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+/**
+ * 条件码
+ */
+typedef enum {
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+} Condition;
+
+/**
+ * 需要回填的跳转
+ */
+typedef struct {
+    int position;               // rel32 在机器码中的位置
+    int target;                 // 跳转目标在指令流中的下标
+} Patch;
+
+/**
+ * 机器码汇编器
+ */
+typedef struct {
+    uint8_t *code;
+    int size;
+    int capacity;
+
+    int *offsets;               // 指令流下标到机器码偏移，-1 表示没有入口
+    Patch *jumps;               // 跳到其他指令的跳转
+    int jumpCount;
+    int jumpCapacity;
+    Patch *exits;               // 退回解释器的跳转
+    int exitCount;
+    int exitCapacity;
+} Assembler;
+
+// ==================== 指令编码 ====================
+
+static void emitByte(Assembler *as, uint8_t byte) {
+    if (as->capacity < as->size + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->size++] = byte;
+}
+
+static void emitInt32(Assembler *as, int32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emitByte(as, (value >> (i * 8)) & 0xff);
+    }
+}
+
+static void emitInt64(Assembler *as, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emitByte(as, (value >> (i * 8)) & 0xff);
+    }
+}
+
+/**
+ * 寄存器和内存 [base + disp] 之间的操作，统一使用 32 位偏移
+ * @param as
+ * @param wide 是否为 64 位操作
+ * @param opcode
+ * @param reg
+ * @param base
+ * @param disp
+ */
+static void emitMemory(Assembler *as, bool wide, uint8_t opcode, Register reg, Register base, int32_t disp) {
+    emitByte(as, 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0));
+    emitByte(as, opcode);
+    emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        // rsp 和 r12 作为基址需要 SIB
+        emitByte(as, 0x24);
+    }
+    emitInt32(as, disp);
+}
+
+/**
+ * 两个 64 位寄存器之间的操作，rm 是目的操作数
+ */
+static void emitRegister(Assembler *as, uint8_t opcode, Register rm, Register reg) {
+    emitByte(as, 0x48 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+    emitByte(as, opcode);
+    emitByte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// mov reg, [base + disp]
+static void emitLoad(Assembler *as, Register reg, Register base, int32_t disp) {
+    emitMemory(as, true, 0x8b, reg, base, disp);
+}
+
+// mov [base + disp], reg
+static void emitStore(Assembler *as, Register base, int32_t disp, Register reg) {
+    emitMemory(as, true, 0x89, reg, base, disp);
+}
+
+// mov reg, imm64
+static void emitMoveImmediate(Assembler *as, Register reg, uint64_t value) {
+    emitByte(as, 0x48 | ((reg & 8) ? 1 : 0));
+    emitByte(as, 0xb8 + (reg & 7));
+    emitInt64(as, value);
+}
+
+// add/sub reg, imm8
+static void emitAddImmediate(Assembler *as, Register reg, int8_t value) {
+    emitByte(as, 0x48 | ((reg & 8) ? 1 : 0));
+    emitByte(as, 0x83);
+    emitByte(as, 0xc0 | (reg & 7));
+    emitByte(as, (uint8_t) value);
+}
+
+static void emitPushRegister(Assembler *as, Register reg) {
+    if (reg & 8) {
+        emitByte(as, 0x41);
+    }
+    emitByte(as, 0x50 + (reg & 7));
+}
+
+static void emitPopRegister(Assembler *as, Register reg) {
+    if (reg & 8) {
+        emitByte(as, 0x41);
+    }
+    emitByte(as, 0x58 + (reg & 7));
+}
+
+// movq xmm, reg
+static void emitToDouble(Assembler *as, int xmm, Register reg) {
+    emitByte(as, 0x66);
+    emitByte(as, 0x48 | ((reg & 8) ? 1 : 0));
+    emitByte(as, 0x0f);
+    emitByte(as, 0x6e);
+    emitByte(as, 0xc0 | (xmm << 3) | (reg & 7));
+}
+
+// movq reg, xmm
+static void emitFromDouble(Assembler *as, Register reg, int xmm) {
+    emitByte(as, 0x66);
+    emitByte(as, 0x48 | ((reg & 8) ? 1 : 0));
+    emitByte(as, 0x0f);
+    emitByte(as, 0x7e);
+    emitByte(as, 0xc0 | (xmm << 3) | (reg & 7));
+}
+
+// addsd/subsd/mulsd/divsd xmm0, xmm1
+static void emitDoubleOperation(Assembler *as, uint8_t opcode) {
+    emitByte(as, 0xf2);
+    emitByte(as, 0x0f);
+    emitByte(as, opcode);
+    emitByte(as, 0xc1);
+}
+
+// ucomisd xmmA, xmmB
+static void emitDoubleCompare(Assembler *as, int a, int b) {
+    emitByte(as, 0x66);
+    emitByte(as, 0x0f);
+    emitByte(as, 0x2e);
+    emitByte(as, 0xc0 | (a << 3) | b);
+}
+
+/**
+ * 把条件码转成布尔值放在 rax
+ * @param as
+ * @param condition
+ */
+static void emitConditionToBool(Assembler *as, Condition condition) {
+    // setcc al; movzx eax, al; rax += FALSE_VAL
+    emitByte(as, 0x0f);
+    emitByte(as, 0x90 | condition);
+    emitByte(as, 0xc0);
+    emitByte(as, 0x0f);
+    emitByte(as, 0xb6);
+    emitByte(as, 0xc0);
+    emitMoveImmediate(as, RDX, FALSE_VAL);
+    emitRegister(as, 0x01, RAX, RDX);
+}
+
+/**
+ * 调用 C 函数，调用前后同步虚拟机的栈顶
+ * @param as
+ * @param function
+ */
+static void emitCall(Assembler *as, void *function) {
+    emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) &vm.stackTop);
+    emitStore(as, RAX, 0, R12);
+    emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) function);
+    emitByte(as, 0xff);
+    emitByte(as, 0xd0);
+    // 返回值在 al 中，先保存到 rcx
+    emitByte(as, 0x0f);
+    emitByte(as, 0xb6);
+    emitByte(as, 0xc8);
+    emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) &vm.stackTop);
+    emitLoad(as, R12, RAX, 0);
+}
+
+// ==================== 跳转 ====================
+
+static void addPatch(Patch **patches, int *count, int *capacity, int position, int target) {
+    if (*capacity < *count + 1) {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *patches = GROW_ARRAY(Patch, *patches, oldCapacity, *capacity);
+    }
+    (*patches)[*count].position = position;
+    (*patches)[*count].target = target;
+    (*count)++;
+}
+
+/**
+ * 跳到另一条指令
+ */
+static void emitJump(Assembler *as, int target) {
+    emitByte(as, 0xe9);
+    addPatch(&as->jumps, &as->jumpCount, &as->jumpCapacity, as->size, target);
+    emitInt32(as, 0);
+}
+
+/**
+ * 条件满足时跳到另一条指令
+ */
+static void emitJumpIf(Assembler *as, Condition condition, int target) {
+    emitByte(as, 0x0f);
+    emitByte(as, 0x80 | condition);
+    addPatch(&as->jumps, &as->jumpCount, &as->jumpCapacity, as->size, target);
+    emitInt32(as, 0);
+}
+
+/**
+ * 条件满足时退回解释器，从指令 index 开始重新执行
+ */
+static void emitExitIf(Assembler *as, Condition condition, int index) {
+    emitByte(as, 0x0f);
+    emitByte(as, 0x80 | condition);
+    addPatch(&as->exits, &as->exitCount, &as->exitCapacity, as->size, index);
+    emitInt32(as, 0);
+}
+
+/**
+ * 退回解释器
+ */
+static void emitExit(Assembler *as, int index) {
+    emitByte(as, 0xe9);
+    addPatch(&as->exits, &as->exitCount, &as->exitCapacity, as->size, index);
+    emitInt32(as, 0);
+}
+
+static void patchRel32(Assembler *as, int position, int target) {
+    int32_t rel = target - (position + 4);
+    memcpy(&as->code[position], &rel, sizeof(int32_t));
+}
+
+// ==================== 栈操作 ====================
+
+static void emitPush(Assembler *as, Register reg) {
+    emitStore(as, R12, 0, reg);
+    emitAddImmediate(as, R12, 8);
+}
+
+static void emitPeek(Assembler *as, Register reg, int distance) {
+    emitLoad(as, reg, R12, -8 * (distance + 1));
+}
+
+/**
+ * 值不是数字的时候退回解释器
+ */
+static void emitNumberGuard(Assembler *as, Register reg, int index) {
+    // (value & QNAN) == QNAN 就不是数字
+    emitRegister(as, 0x89, RDX, reg);
+    emitRegister(as, 0x21, RDX, R14);
+    emitRegister(as, 0x39, RDX, R14);
+    emitExitIf(as, CC_E, index);
+}
+
+/**
+ * 栈顶两个数字放入 xmm0 和 xmm1，不是数字的时候退回解释器
+ */
+static void emitNumberOperands(Assembler *as, int index) {
+    emitPeek(as, RAX, 1);
+    emitPeek(as, RCX, 0);
+    emitNumberGuard(as, RAX, index);
+    emitNumberGuard(as, RCX, index);
+    emitToDouble(as, 0, RAX);
+    emitToDouble(as, 1, RCX);
+}
+
+/**
+ * rax 是假值时跳转
+ */
+static void emitJumpIfFalse(Assembler *as, int target) {
+    emitMoveImmediate(as, RDX, NIL_VAL);
+    emitRegister(as, 0x39, RAX, RDX);
+    emitJumpIf(as, CC_E, target);
+    emitMoveImmediate(as, RDX, FALSE_VAL);
+    emitRegister(as, 0x39, RAX, RDX);
+    emitJumpIf(as, CC_E, target);
+}
+
+/**
+ * 全局变量槽位的地址放到 rax，数组可能扩容，所以每次都重新读取
+ */
+static void emitGlobalAddress(Assembler *as, int slot) {
+    emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) &vm.globalValues.values);
+    emitLoad(as, RAX, RAX, 0);
+    emitMemory(as, true, 0x8d, RAX, RAX, slot * (int32_t) sizeof(Value));
+}
+
+/**
+ * 上值指向的位置放到 rax
+ */
+static void emitUpValueAddress(Assembler *as, int index) {
+    emitLoad(as, RAX, R15, index * (int32_t) sizeof(ObjectUpValue *));
+    emitLoad(as, RAX, RAX, (int32_t) offsetof(ObjectUpValue, location));
+}
+
+// ==================== 运行时辅助函数 ====================
+
+static void jitPrint(Value value) {
+    printValue(value);
+    printf("\n");
+}
+
+static void jitUpValueBarrier(ObjectUpValue *upValue, Value value) {
+    writeBarrier((Object *) upValue, value);
+}
+
+// ==================== 编译 ====================
+
+/**
+ * 编译一条指令
+ * @param as
+ * @param chunk
+ * @param offset 字节码偏移
+ * @param index 指令流下标
+ * @return 这条指令是否有机器码入口
+ */
+static bool compileInstruction(Assembler *as, Chunk *chunk, int offset, int index, int *positions) {
+    Instruction *instruction = &chunk->instructions[index];
+    uint8_t *code = &chunk->code[offset];
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            emitMoveImmediate(as, RAX, instruction[1].value);
+            emitPush(as, RAX);
+            return true;
+        case OP_NIL:
+            emitMoveImmediate(as, RAX, NIL_VAL);
+            emitPush(as, RAX);
+            return true;
+        case OP_TRUE:
+            emitMoveImmediate(as, RAX, TRUE_VAL);
+            emitPush(as, RAX);
+            return true;
+        case OP_FALSE:
+            emitMoveImmediate(as, RAX, FALSE_VAL);
+            emitPush(as, RAX);
+            return true;
+        case OP_POP:
+            emitAddImmediate(as, R12, -8);
+            return true;
+        case OP_GET_LOCAL:
+            emitLoad(as, RAX, R13, instruction[1].operand * (int32_t) sizeof(Value));
+            emitPush(as, RAX);
+            return true;
+        case OP_SET_LOCAL:
+            emitPeek(as, RAX, 0);
+            emitStore(as, R13, instruction[1].operand * (int32_t) sizeof(Value), RAX);
+            return true;
+        case OP_DEFINE_GLOBAL:
+            emitGlobalAddress(as, instruction[1].operand);
+            emitPeek(as, RCX, 0);
+            emitStore(as, RAX, 0, RCX);
+            emitAddImmediate(as, R12, -8);
+            return true;
+        case OP_GET_GLOBAL:
+            // 没有定义的全局变量交给解释器报错
+            emitGlobalAddress(as, instruction[1].operand);
+            emitLoad(as, RCX, RAX, 0);
+            emitMoveImmediate(as, RDX, UNDEFINED_VAL);
+            emitRegister(as, 0x39, RCX, RDX);
+            emitExitIf(as, CC_E, index);
+            emitPush(as, RCX);
+            return true;
+        case OP_SET_GLOBAL:
+            emitGlobalAddress(as, instruction[1].operand);
+            emitLoad(as, RCX, RAX, 0);
+            emitMoveImmediate(as, RDX, UNDEFINED_VAL);
+            emitRegister(as, 0x39, RCX, RDX);
+            emitExitIf(as, CC_E, index);
+            emitPeek(as, RCX, 0);
+            emitStore(as, RAX, 0, RCX);
+            return true;
+        case OP_GET_UP_VALUE:
+            emitUpValueAddress(as, instruction[1].operand);
+            emitLoad(as, RAX, RAX, 0);
+            emitPush(as, RAX);
+            return true;
+        case OP_SET_UP_VALUE:
+            emitUpValueAddress(as, instruction[1].operand);
+            emitPeek(as, RCX, 0);
+            emitStore(as, RAX, 0, RCX);
+            // jitUpValueBarrier(upValues[n], PEEK(0))
+            emitLoad(as, RDI, R15, instruction[1].operand * (int32_t) sizeof(ObjectUpValue *));
+            emitPeek(as, RSI, 0);
+            emitCall(as, (void *) jitUpValueBarrier);
+            return true;
+        case OP_GET_COPIED:
+            emitLoad(as, RAX, RBX, (int32_t) offsetof(JitState, copies));
+            emitLoad(as, RAX, RAX, instruction[1].operand * (int32_t) sizeof(Value));
+            emitPush(as, RAX);
+            return true;
+        case OP_GET_PROPERTY:
+            // getPropertyFast(receiver, name, cache, &PEEK(0))
+            emitPeek(as, RDI, 0);
+            emitMoveImmediate(as, RSI, (uint64_t) (uintptr_t) instruction[1].string);
+            emitMoveImmediate(as, RDX, (uint64_t) (uintptr_t) instruction[2].cache);
+            emitMemory(as, true, 0x8d, RCX, R12, -8);
+            emitCall(as, (void *) getPropertyFast);
+            emitRegister(as, 0x85, RCX, RCX);
+            emitExitIf(as, CC_E, index);
+            return true;
+        case OP_GET_LOCAL_PROPERTY:
+            // getPropertyFast(slots[n], name, cache, &stackTop[0])
+            emitLoad(as, RDI, R13, instruction[1].operand * (int32_t) sizeof(Value));
+            emitMoveImmediate(as, RSI, (uint64_t) (uintptr_t) instruction[2].string);
+            emitMoveImmediate(as, RDX, (uint64_t) (uintptr_t) instruction[3].cache);
+            emitMemory(as, true, 0x8d, RCX, R12, 0);
+            emitCall(as, (void *) getPropertyFast);
+            emitRegister(as, 0x85, RCX, RCX);
+            emitExitIf(as, CC_E, index);
+            emitAddImmediate(as, R12, 8);
+            return true;
+        case OP_SET_PROPERTY:
+            // setPropertyFast(PEEK(1), name, cache, PEEK(0))
+            emitPeek(as, RDI, 1);
+            emitMoveImmediate(as, RSI, (uint64_t) (uintptr_t) instruction[1].string);
+            emitMoveImmediate(as, RDX, (uint64_t) (uintptr_t) instruction[2].cache);
+            emitPeek(as, RCX, 0);
+            emitCall(as, (void *) setPropertyFast);
+            emitRegister(as, 0x85, RCX, RCX);
+            emitExitIf(as, CC_E, index);
+            emitPeek(as, RAX, 0);
+            emitAddImmediate(as, R12, -8);
+            emitStore(as, R12, -8, RAX);
+            return true;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            // 绑定的方法按照接收者和方法比较，不能只比较位，结果在 rcx
+            emitPeek(as, RDI, 1);
+            emitPeek(as, RSI, 0);
+            emitCall(as, (void *) valuesEqual);
+            emitRegister(as, 0x85, RCX, RCX);
+            emitConditionToBool(as, code[0] == OP_EQUAL ? CC_NE : CC_E);
+            emitAddImmediate(as, R12, -8);
+            emitStore(as, R12, -8, RAX);
+            return true;
+        case OP_GREATER:
+        case OP_LESS:
+            emitNumberOperands(as, index);
+            if (code[0] == OP_GREATER) {
+                emitDoubleCompare(as, 0, 1);
+            } else {
+                emitDoubleCompare(as, 1, 0);
+            }
+            emitConditionToBool(as, CC_A);
+            emitAddImmediate(as, R12, -8);
+            emitStore(as, R12, -8, RAX);
+            return true;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            // 字符串拼接交给解释器
+            static const uint8_t operations[] = {
+                    [OP_ADD] = 0x58, [OP_SUBTRACT] = 0x5c, [OP_MULTIPLY] = 0x59, [OP_DIVIDE] = 0x5e,
+            };
+            emitNumberOperands(as, index);
+            emitDoubleOperation(as, operations[code[0]]);
+            emitFromDouble(as, RAX, 0);
+            emitAddImmediate(as, R12, -8);
+            emitStore(as, R12, -8, RAX);
+            return true;
+        }
+        case OP_NOT:
+            // nil 和 false 是假值
+            emitPeek(as, RAX, 0);
+            emitMoveImmediate(as, RDX, NIL_VAL);
+            emitRegister(as, 0x39, RAX, RDX);
+            emitByte(as, 0x0f);
+            emitByte(as, 0x94);
+            emitByte(as, 0xc1);
+            emitMoveImmediate(as, RDX, FALSE_VAL);
+            emitRegister(as, 0x39, RAX, RDX);
+            emitByte(as, 0x0f);
+            emitByte(as, 0x94);
+            emitByte(as, 0xc0);
+            // or al, cl; test al, al
+            emitByte(as, 0x08);
+            emitByte(as, 0xc8);
+            emitByte(as, 0x84);
+            emitByte(as, 0xc0);
+            emitConditionToBool(as, CC_NE);
+            emitStore(as, R12, -8, RAX);
+            return true;
+        case OP_NEGATE:
+            emitPeek(as, RAX, 0);
+            emitNumberGuard(as, RAX, index);
+            emitMoveImmediate(as, RDX, SIGN_BIT);
+            emitRegister(as, 0x31, RAX, RDX);
+            emitStore(as, R12, -8, RAX);
+            return true;
+        case OP_PRINT:
+            emitAddImmediate(as, R12, -8);
+            emitLoad(as, RDI, R12, 0);
+            emitCall(as, (void *) jitPrint);
+            return true;
+        case OP_JUMP:
+        case OP_LOOP:
+            emitJump(as, (int) (instruction[1].target - chunk->instructions));
+            return true;
+        case OP_JUMP_IF_FALSE:
+            emitPeek(as, RAX, 0);
+            emitJumpIfFalse(as, (int) (instruction[1].target - chunk->instructions));
+            return true;
+        case OP_JUMP_IF_NOT_LESS: {
+            emitNumberOperands(as, index);
+            emitAddImmediate(as, R12, -16);
+            emitDoubleCompare(as, 1, 0);
+            // a < b 时继续执行下一条指令
+            emitJumpIf(as, CC_A, positions[offset + 3]);
+            emitMoveImmediate(as, RAX, FALSE_VAL);
+            emitPush(as, RAX);
+            emitJump(as, (int) (instruction[1].target - chunk->instructions));
+            return true;
+        }
+        case OP_ADD_LOCALS:
+            emitLoad(as, RAX, R13, instruction[1].operand * (int32_t) sizeof(Value));
+            emitLoad(as, RCX, R13, instruction[2].operand * (int32_t) sizeof(Value));
+            emitNumberGuard(as, RAX, index);
+            emitNumberGuard(as, RCX, index);
+            emitToDouble(as, 0, RAX);
+            emitToDouble(as, 1, RCX);
+            emitDoubleOperation(as, 0x58);
+            emitFromDouble(as, RAX, 0);
+            emitPush(as, RAX);
+            return true;
+        default:
+            // 调用、返回、闭包、类等指令交给解释器
+            emitExit(as, index);
+            return false;
+    }
+}
+
+/**
+ * 保存寄存器，加载状态，然后跳到入口
+ */
+static void emitPrologue(Assembler *as) {
+    emitPushRegister(as, RBX);
+    emitPushRegister(as, RBP);
+    emitPushRegister(as, R12);
+    emitPushRegister(as, R13);
+    emitPushRegister(as, R14);
+    emitPushRegister(as, R15);
+    // 保持调用 C 函数时栈 16 字节对齐
+    emitAddImmediate(as, RSP, -8);
+
+    emitRegister(as, 0x89, RBX, RDI);
+    emitLoad(as, R12, RBX, (int32_t) offsetof(JitState, stackTop));
+    emitLoad(as, R13, RBX, (int32_t) offsetof(JitState, slots));
+    emitLoad(as, R15, RBX, (int32_t) offsetof(JitState, upValues));
+    emitMoveImmediate(as, R14, QNAN);
+    // jmp rsi
+    emitByte(as, 0xff);
+    emitByte(as, 0xe6);
+}
+
+/**
+ * 写回状态，恢复寄存器并返回，退出的指令下标在 eax
+ */
+static void emitEpilogue(Assembler *as) {
+    emitStore(as, RBX, (int32_t) offsetof(JitState, stackTop), R12);
+    emitMemory(as, false, 0x89, RAX, RBX, (int32_t) offsetof(JitState, exit));
+    emitAddImmediate(as, RSP, 8);
+    emitPopRegister(as, R15);
+    emitPopRegister(as, R14);
+    emitPopRegister(as, R13);
+    emitPopRegister(as, R12);
+    emitPopRegister(as, RBP);
+    emitPopRegister(as, RBX);
+    emitByte(as, 0xc3);
+}
+
+void jitCompile(ObjectFunction *function) {
+    Chunk *chunk = &function->chunk;
+    if (function->jit != NULL || chunk->instructions == NULL) {
+        return;
+    }
+
+    Assembler as = {0};
+    int count = chunk->instructionCount;
+    as.offsets = ALLOCATE(int, count);
+    // 从每条指令开始，退回解释器之前能连续执行的机器码指令数
+    int *runs = ALLOCATE(int, count);
+    // 字节码偏移到指令流下标
+    int *positions = ALLOCATE(int, chunk->size + 1);
+    for (int i = 0; i < count; i++) {
+        as.offsets[i] = -1;
+    }
+    for (int offset = 0, index = 0; offset < chunk->size;) {
+        int words;
+        int length = getInstructionLength(chunk, offset, &words);
+        positions[offset] = index;
+        index += words;
+        offset += length;
+    }
+    positions[chunk->size] = count;
+
+    emitPrologue(&as);
+    for (int offset = 0; offset < chunk->size;) {
+        int index = positions[offset];
+        int start = as.size;
+        if (compileInstruction(&as, chunk, offset, index, positions)) {
+            as.offsets[index] = start;
+            // 到达循环回边就可以一直留在机器码里
+            runs[index] = chunk->code[offset] == OP_LOOP ? JIT_MIN_RUN : 1;
+        } else {
+            runs[index] = 0;
+            // 只能退出的指令没有入口，但是跳转到这里时仍然需要退出
+            as.offsets[index] = -2 - start;
+        }
+        offset += getInstructionLength(chunk, offset, NULL);
+    }
+
+    for (int i = count - 1, next = -1; i >= 0; i--) {
+        if (as.offsets[i] == -1) {
+            continue;
+        }
+        if (runs[i] == 1 && next >= 0) {
+            runs[i] += runs[next];
+        }
+        next = i;
+    }
+
+    // 退出：mov eax, index; 然后跳到公共的收尾代码
+    int *exitStubs = ALLOCATE(int, as.exitCount);
+    int epilogueJumps = as.exitCount;
+    for (int i = 0; i < as.exitCount; i++) {
+        exitStubs[i] = as.size;
+        emitByte(&as, 0xb8);
+        emitInt32(&as, as.exits[i].target);
+        emitByte(&as, 0xe9);
+        emitInt32(&as, 0);
+    }
+    int epilogue = as.size;
+    emitEpilogue(&as);
+
+    for (int i = 0; i < epilogueJumps; i++) {
+        patchRel32(&as, as.exits[i].position, exitStubs[i]);
+        patchRel32(&as, exitStubs[i] + 6, epilogue);
+    }
+    for (int i = 0; i < as.jumpCount; i++) {
+        int target = as.offsets[as.jumps[i].target];
+        patchRel32(&as, as.jumps[i].position, target >= 0 ? target : -2 - target);
+    }
+
+    // 复制到可执行内存
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t) as.size + pageSize - 1) / pageSize * pageSize;
+    uint8_t *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+        memcpy(memory, as.code, as.size);
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) == 0) {
+            JitCode *jit = ALLOCATE(JitCode, 1);
+            jit->code = memory;
+            jit->size = size;
+            jit->entryCount = count;
+            jit->entries = ALLOCATE(void *, count);
+            for (int i = 0; i < count; i++) {
+                // 进出机器码有固定开销，太短的片段留给解释器执行
+                bool worth = as.offsets[i] >= 0 && runs[i] >= JIT_MIN_RUN;
+                jit->entries[i] = worth ? memory + as.offsets[i] : NULL;
+            }
+            function->jit = jit;
+            dbg("JIT Compile Function [%s] To [%d] Bytes",
+                function->name == NULL ? "script" : function->name->chars, as.size);
+        } else {
+            munmap(memory, size);
+        }
+    }
+
+    FREE_ARRAY(int, exitStubs, epilogueJumps);
+    FREE_ARRAY(int, positions, chunk->size + 1);
+    FREE_ARRAY(int, runs, count);
+    FREE_ARRAY(int, as.offsets, count);
+    FREE_ARRAY(Patch, as.jumps, as.jumpCapacity);
+    FREE_ARRAY(Patch, as.exits, as.exitCapacity);
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+}
+
+void jitRun(CallFrame *frame) {
+    ObjectFunction *function = frame->closure->function;
+    Chunk *chunk = &function->chunk;
+    void *entry = function->jit->entries[frame->ip - chunk->instructions];
+
+    JitState state;
+    state.stackTop = vm.stackTop;
+    state.slots = frame->slots;
+    state.upValues = frame->closure->upValues;
+    state.copies = frame->closure->copies;
+    state.exit = 0;
+    ((JitFunction) function->jit->code)(&state, entry);
+
+    vm.stackTop = state.stackTop;
+    frame->ip = chunk->instructions + state.exit;
+}
+
+void jitFree(JitCode *code) {
+    if (code == NULL) {
+        return;
+    }
+    munmap(code->code, code->size);
+    FREE_ARRAY(void *, code->entries, code->entryCount);
+    FREE(JitCode, code);
+}
+
+#else
+
+void jitCompile(ObjectFunction *function) {
+}
+
+void jitRun(CallFrame *frame) {
+}
+
+void jitFree(JitCode *code) {
+}
+
+#endif
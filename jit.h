@@ -0,0 +1,44 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// 函数调用和循环回边的次数达到这个值时 JIT 编译
+#define JIT_THRESHOLD 1000
+// 从一条指令开始至少能连续执行这么多条机器码指令时，解释器才会进入机器码
+#define JIT_MIN_RUN 8
+
+/**
+ * JIT 编译出来的机器码
+ */
+typedef struct JitCode {
+    uint8_t *code;
+    size_t size;
+    void **entries;             // 指令流下标到机器码地址，解释器只从不为 NULL 的指令进入机器码
+    int entryCount;
+} JitCode;
+
+/**
+ * 把函数编译成机器码
+ * 机器码和解释器共用虚拟机栈和栈帧，遇到不支持的指令、类型不对或者需要报错的时候退回解释器
+ * 平台不支持时什么都不做，函数继续由解释器执行
+ * @param function
+ */
+void jitCompile(ObjectFunction *function);
+
+/**
+ * 从栈帧当前的指令开始执行机器码，当前指令必须有入口，退出时栈帧的 ip 指向解释器要继续执行的指令
+ * 机器码不会创建或者弹出栈帧
+ * @param frame
+ */
+void jitRun(CallFrame *frame);
+
+/**
+ * 释放机器码
+ * @param code
+ */
+void jitFree(JitCode *code);
+
+#endif //CLOX_JIT_H
@@ -4,10 +4,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "vm.h"
+#include "memory.h"
+#include "marker.h"
 #include "trie.h"
+#include "optimizer.h"
+#include "compiler.h"
+#include "bytecode.h"
+#include "snapshot.h"
+
+/**
+ * 脚本文件的执行方式
+ */
+typedef enum {
+    MODE_RUN,           // 有和源代码一致的字节码文件时直接加载，否则编译后执行
+    MODE_EMIT,          // 编译并写入字节码文件，然后执行
+    MODE_COMPILE_ONLY,  // 只编译并写入字节码文件
+} RunMode;
 
 /**
  * 交互执行
@@ -59,14 +75,73 @@ static char *readFile(const char *path) {
     return buffer;
 }
 
+/**
+ * 是否为字节码文件
+ * @param path
+ * @return
+ */
+static bool isBytecodePath(const char *path) {
+    size_t length = strlen(path);
+    size_t extension = strlen(BYTECODE_EXTENSION);
+    return length > extension && strcmp(path + length - extension, BYTECODE_EXTENSION) == 0;
+}
+
+/**
+ * 源文件对应的字节码文件路径，script.lox 对应 script.loxc
+ * @param path
+ * @return 需要调用者释放
+ */
+static char *bytecodePath(const char *path) {
+    size_t length = strlen(path);
+    char *result = (char *) malloc(length + strlen(BYTECODE_EXTENSION) + 1);
+    if (result == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        exit(74);
+    }
+    strcpy(result, path);
+    if (length > 4 && strcmp(path + length - 4, ".lox") == 0) {
+        strcpy(result + length, "c");
+    } else {
+        strcpy(result + length, BYTECODE_EXTENSION);
+    }
+    return result;
+}
+
 /**
  * 执行脚本文件
+ * 源代码和字节码文件一致时跳过扫描和编译，直接加载字节码
  */
-static void run(const char *path) {
-    char *source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+static void run(const char *path, RunMode mode) {
+    ObjectFunction *function;
+    if (isBytecodePath(path)) {
+        function = readBytecode(path, 0, false);
+        if (function == NULL) {
+            fprintf(stderr, "Could not load bytecode \"%s\".\n", path);
+            exit(65);
+        }
+    } else {
+        char *source = readFile(path);
+        uint64_t hash = hashSource(source);
+        char *output = bytecodePath(path);
+        function = mode == MODE_RUN ? readBytecode(output, hash, true) : NULL;
+        if (function == NULL) {
+            function = compile(source);
+            if (function == NULL) {
+                exit(65);
+            }
+            if (mode != MODE_RUN && !writeBytecode(output, function, hash)) {
+                fprintf(stderr, "Could not write bytecode \"%s\".\n", output);
+                exit(74);
+            }
+        }
+        free(output);
+        free(source);
+    }
+    if (mode == MODE_COMPILE_ONLY) {
+        return;
+    }
 
+    InterpretResult result = interpretFunction(function);
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
@@ -74,12 +149,74 @@ static void run(const char *path) {
 int main(int argc, char *argv[]) {
     initKeyWordTrie();
     initVM();
-    if (argc == 1) {
+    RunMode mode = MODE_RUN;
+    // 脚本执行完之后写入的堆快照
+    const char *snapshot = NULL;
+    bool lazy = false;
+    // 选项写在脚本路径之前
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "--emit") == 0) {
+            mode = MODE_EMIT;
+        } else if (strcmp(argv[1], "--compile-only") == 0) {
+            mode = MODE_COMPILE_ONLY;
+        } else if (strcmp(argv[1], "--snapshot") == 0 && argc > 2) {
+            snapshot = argv[2];
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--image") == 0 && argc > 2) {
+            // 加载堆快照，脚本和交互执行都从快照中的全局变量开始
+            if (!readSnapshot(argv[2])) {
+                fprintf(stderr, "Could not load image \"%s\".\n", argv[2]);
+                exit(74);
+            }
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--gc-pause") == 0 && argc > 2) {
+            // 增量回收每一步暂停时间的目标，单位是微秒
+            setGcPauseTarget(atoi(argv[2]));
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--gc-threads") == 0 && argc > 2) {
+            // 并行标记的线程数量，默认按照处理器的数量
+#ifdef PARALLEL_MARK
+            setMarkerThreads(atoi(argv[2]));
+#else
+            fprintf(stderr, "Parallel marking is not supported on this platform, ignoring --gc-threads.\n");
+#endif
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--lazy") == 0) {
+            lazy = true;
+        } else if (strcmp(argv[1], "--jit") == 0) {
+            enableJit();
+        } else if (strcmp(argv[1], "-O0") == 0) {
+            setOptimizeLevel(0);
+        } else if (strcmp(argv[1], "-O1") == 0) {
+            setOptimizeLevel(1);
+        } else if (strcmp(argv[1], "-O2") == 0) {
+            setOptimizeLevel(1);
+            enableSsa();
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+    // 字节码文件和堆快照要保存完整的字节码，这时不延迟编译
+    if (lazy && mode == MODE_RUN && snapshot == NULL) {
+        enableLazyCompile();
+    }
+    if (argc == 1 && mode == MODE_RUN && snapshot == NULL) {
         repl();
-    } else if (argc == 2) {
-        run(argv[1]);
+    } else if (argc == 2 && (mode != MODE_COMPILE_ONLY || snapshot == NULL)) {
+        run(argv[1], mode);
+        if (snapshot != NULL && !writeSnapshot(snapshot)) {
+            fprintf(stderr, "Could not write image \"%s\".\n", snapshot);
+            exit(74);
+        }
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--emit|--compile-only] [--snapshot image] [--image image] "
+                        "[--gc-pause micros] [--gc-threads count] [--lazy] [--jit] [-O0|-O1|-O2] [path]\n");
         exit(64);
     }
     freeVM();
@@ -0,0 +1,334 @@
+#include <stdlib.h>
+
+#include "marker.h"
+#include "memory.h"
+#include "vm.h"
+#include "debug.h"
+
+#ifdef PARALLEL_MARK
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+/**
+ * 灰色队列的缓冲区，容量是 2 的幂，下标一直增长，取模得到位置
+ */
+typedef struct GrayBuffer {
+    int64_t capacity;
+    Object **items;
+    struct GrayBuffer *retired;     // 扩容之前的缓冲区，偷取的线程可能还在读，标记结束之后才释放
+} GrayBuffer;
+
+/**
+ * 每个线程的灰色队列（Chase-Lev 双端队列）
+ * 所有者在 bottom 一端压入和弹出，不需要加锁；其他线程在 top 一端用 CAS 偷取
+ * 只剩一个对象时所有者和偷取的线程通过 top 上的 CAS 决定谁拿到
+ */
+typedef struct {
+    _Alignas(64) int64_t top;       // 偷取的一端
+    _Alignas(64) int64_t bottom;    // 所有者的一端
+    GrayBuffer *buffer;
+} GrayDeque;
+
+// 标记线程的数量，包括执行程序的线程，0 表示还没有启动
+static int threadCount = 0;
+// 要求的标记线程数量，0 表示按照处理器的数量
+static int requestedThreads = 0;
+static pthread_t threads[MARKER_MAX_THREADS];
+static GrayDeque deques[MARKER_MAX_THREADS];
+
+// 唤醒标记线程和等待它们结束
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startCondition = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCondition = PTHREAD_COND_INITIALIZER;
+static unsigned int generation = 0;     // 每开始一次并行标记增加一次
+static int finishedCount = 0;           // 这一次已经结束的标记线程
+static bool stopping = false;
+
+// 手上还有灰色对象的线程数量，变成 0 时所有线程都结束
+static int activeCount = 0;
+
+// 当前线程的灰色队列，不在并行标记时为 NULL
+static _Thread_local GrayDeque *currentDeque = NULL;
+
+static GrayBuffer *newGrayBuffer(int64_t capacity) {
+    GrayBuffer *buffer = (GrayBuffer *) malloc(sizeof(GrayBuffer));
+    Object **items = (Object **) malloc(sizeof(Object *) * capacity);
+    if (buffer == NULL || items == NULL) {
+        dbg("Error when alloc gray buffer");
+        exit(1);
+    }
+    buffer->capacity = capacity;
+    buffer->items = items;
+    buffer->retired = NULL;
+    return buffer;
+}
+
+/**
+ * 释放扩容之前的缓冲区，只在没有线程偷取时调用
+ * @param buffer
+ */
+static void freeRetiredBuffers(GrayBuffer *buffer) {
+    GrayBuffer *retired = buffer->retired;
+    buffer->retired = NULL;
+    while (retired != NULL) {
+        GrayBuffer *next = retired->retired;
+        free(retired->items);
+        free(retired);
+        retired = next;
+    }
+}
+
+/**
+ * 所有者压入灰色对象，满了的时候扩容
+ * @param deque
+ * @param object
+ */
+static void pushDeque(GrayDeque *deque, Object *object) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    GrayBuffer *buffer = deque->buffer;
+    if (bottom - top >= buffer->capacity) {
+        GrayBuffer *grown = newGrayBuffer(buffer->capacity * 2);
+        for (int64_t i = top; i < bottom; i++) {
+            grown->items[i & (grown->capacity - 1)] = buffer->items[i & (buffer->capacity - 1)];
+        }
+        grown->retired = buffer;
+        __atomic_store_n(&deque->buffer, grown, __ATOMIC_RELEASE);
+        buffer = grown;
+    }
+    __atomic_store_n(&buffer->items[bottom & (buffer->capacity - 1)], object, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * 所有者弹出最近压入的灰色对象
+ * @param deque
+ * @return 队列为空时返回 NULL
+ */
+static Object *takeDeque(GrayDeque *deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    GrayBuffer *buffer = deque->buffer;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    Object *object = __atomic_load_n(&buffer->items[bottom & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // 最后一个对象，和偷取的线程竞争
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            object = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return object;
+}
+
+/**
+ * 从别的线程的队列偷取最早压入的灰色对象
+ * @param deque
+ * @return 队列为空或者被别的线程抢先时返回 NULL
+ */
+static Object *stealDeque(GrayDeque *deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return NULL;
+    }
+    GrayBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_ACQUIRE);
+    Object *object = __atomic_load_n(&buffer->items[top & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return object;
+}
+
+/**
+ * 依次尝试从其他线程的队列偷取
+ * @param id 当前线程
+ * @return
+ */
+static Object *stealGray(int id) {
+    for (int i = 1; i < threadCount; i++) {
+        Object *object = stealDeque(&deques[(id + i) % threadCount]);
+        if (object != NULL) {
+            return object;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 一个线程的标记工作：扫描分到的根，处理自己的队列，空了就去偷，所有线程都空了时结束
+ * 偷到对象的线程在处理之前才重新算作活跃，这时其他线程可能已经结束，它会自己处理完引出的对象
+ * @param id
+ */
+static void markerWork(int id) {
+    GrayDeque *deque = &deques[id];
+    currentDeque = deque;
+    markRootsPart(id, threadCount);
+    for (;;) {
+        Object *object;
+        while ((object = takeDeque(deque)) != NULL) {
+            blackenObject(object);
+        }
+        __atomic_sub_fetch(&activeCount, 1, __ATOMIC_SEQ_CST);
+        while ((object = stealGray(id)) == NULL) {
+            if (__atomic_load_n(&activeCount, __ATOMIC_SEQ_CST) == 0) {
+                currentDeque = NULL;
+                return;
+            }
+            sched_yield();
+        }
+        __atomic_add_fetch(&activeCount, 1, __ATOMIC_SEQ_CST);
+        blackenObject(object);
+    }
+}
+
+static void *markerThread(void *arg) {
+    int id = (int) (intptr_t) arg;
+    unsigned int seen = 0;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (generation == seen && !stopping) {
+            pthread_cond_wait(&startCondition, &lock);
+        }
+        if (stopping) {
+            break;
+        }
+        seen = generation;
+        pthread_mutex_unlock(&lock);
+
+        markerWork(id);
+
+        pthread_mutex_lock(&lock);
+        finishedCount++;
+        pthread_cond_signal(&doneCondition);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * 第一次标记时启动标记线程，启动失败时少用几个线程
+ */
+static void startMarkers() {
+    int count = requestedThreads;
+    if (count <= 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        count = processors < 1 ? 1 : (int) processors;
+    }
+    if (count > MARKER_MAX_THREADS) {
+        count = MARKER_MAX_THREADS;
+    }
+    for (int i = 0; i < count; i++) {
+        deques[i].top = 0;
+        deques[i].bottom = 0;
+        deques[i].buffer = newGrayBuffer(MARKER_DEQUE_INIT);
+    }
+    threadCount = 1;
+    while (threadCount < count
+           && pthread_create(&threads[threadCount], NULL, markerThread, (void *) (intptr_t) threadCount) == 0) {
+        threadCount++;
+    }
+    for (int i = threadCount; i < count; i++) {
+        free(deques[i].buffer->items);
+        free(deques[i].buffer);
+        deques[i].buffer = NULL;
+    }
+}
+
+void traceFromRoots() {
+    if (threadCount == 0) {
+        startMarkers();
+    }
+    if (threadCount == 1 || getBytesAllocated() < MARKER_MIN_HEAP) {
+        markRoots();
+        traceReferences();
+        return;
+    }
+
+    // 灰色栈里已有的对象平均分给各个线程，这时其他线程还没有开始，可以直接压入它们的队列
+    for (int i = 0; vm.grayCount > vm.grayBase; i++) {
+        pushDeque(&deques[i % threadCount], vm.grayStack[--vm.grayCount]);
+    }
+    activeCount = threadCount;
+
+    pthread_mutex_lock(&lock);
+    finishedCount = 0;
+    generation++;
+    pthread_cond_broadcast(&startCondition);
+    pthread_mutex_unlock(&lock);
+
+    markerWork(0);
+
+    pthread_mutex_lock(&lock);
+    while (finishedCount < threadCount - 1) {
+        pthread_cond_wait(&doneCondition, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < threadCount; i++) {
+        freeRetiredBuffers(deques[i].buffer);
+    }
+}
+
+bool pushMarkerGray(Object *object) {
+    if (currentDeque == NULL) {
+        return false;
+    }
+    pushDeque(currentDeque, object);
+    return true;
+}
+
+void setMarkerThreads(int count) {
+    requestedThreads = count;
+}
+
+void freeMarker() {
+    if (threadCount == 0) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&startCondition);
+    pthread_mutex_unlock(&lock);
+    for (int i = 1; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        freeRetiredBuffers(deques[i].buffer);
+        free(deques[i].buffer->items);
+        free(deques[i].buffer);
+        deques[i].buffer = NULL;
+    }
+    threadCount = 0;
+    stopping = false;
+}
+
+#else
+
+void traceFromRoots() {
+    markRoots();
+    traceReferences();
+}
+
+bool pushMarkerGray(Object *object) {
+    return false;
+}
+
+void setMarkerThreads(int count) {
+}
+
+void freeMarker() {
+}
+
+#endif
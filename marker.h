@@ -0,0 +1,41 @@
+#ifndef CLOX_MARKER_H
+#define CLOX_MARKER_H
+
+#include "common.h"
+#include "object.h"
+
+// 最多使用的标记线程数量，包括执行程序的线程
+#define MARKER_MAX_THREADS 16
+// 堆小于这个大小时唤醒线程的开销比并行省下的时间多，只用一个线程标记，测试时可以在构建时指定为 0
+#ifndef MARKER_MIN_HEAP
+#define MARKER_MIN_HEAP (4 * 1024 * 1024)
+#endif
+// 每个线程灰色队列的初始容量，必须是 2 的幂
+#define MARKER_DEQUE_INIT 1024
+
+/**
+ * 扫描根，标记所有能到达的对象，灰色栈里已有的对象也一起处理完
+ * 有多个处理器并且堆足够大时由多个线程并行标记：根按范围分给各个线程，灰色栈里的对象平均分给各个线程
+ * 每个线程有自己的灰色队列，自己的处理完之后从别的线程的队列偷取
+ */
+void traceFromRoots();
+
+/**
+ * 把灰色对象放进当前线程的灰色队列
+ * @param object
+ * @return 当前线程不在并行标记时返回 false，由调用者放进灰色栈
+ */
+bool pushMarkerGray(Object *object);
+
+/**
+ * 设置标记线程的数量，包括执行程序的线程，必须在第一次标记之前调用
+ * @param count 0 表示按照处理器的数量
+ */
+void setMarkerThreads(int count);
+
+/**
+ * 结束标记线程
+ */
+void freeMarker();
+
+#endif //CLOX_MARKER_H
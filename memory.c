@@ -4,21 +4,99 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <time.h>
 
 #include "memory.h"
 #include "debug.h"
 #include "vm.h"
+#include "jit.h"
+#include "compiler.h"
+#include "marker.h"
+#include "sweeper.h"
+#include "heap.h"
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+// 正在进行新生代回收，老年代对象都当作活的，不再标记
+static bool collectingYoung = false;
+// 增量回收每一步暂停时间的目标，单位是微秒
+static int pauseTarget = GC_PAUSE_TARGET;
+// 增量回收上一步之后分配的字节数
+static size_t stepBytes = 0;
+// 后台清除线程释放对象时累加释放的字节数，不为 NULL 时不修改虚拟机的统计
+static _Thread_local size_t *backgroundFreed = NULL;
+
+static void stepGarbage();
+
+/**
+ * 读取标记位，并行标记时其他线程可能同时在写
+ * @param object
+ * @return
+ */
+static inline bool isMarked(Object *object) {
+#ifdef PARALLEL_MARK
+    return __atomic_load_n(&object->isMarked, __ATOMIC_RELAXED);
+#else
+    return object->isMarked;
+#endif
+}
+
+/**
+ * 开始一轮老年代回收
+ * 先做一次新生代回收，活着的对象都进入老年代，然后标记根，之后的标记和程序穿插进行
+ */
+static void beginCollection() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+    collectYoungGarbage();
+    vm.gcPhase = GC_MARKING;
+    stepBytes = 0;
+    markRoots();
+}
+
+/**
+ * 统计分配的字节数，需要时进行回收
+ * @param oldSize
+ * @param newSize
+ */
+static void countAllocation(size_t oldSize, size_t newSize) {
     bool gc = addBytesAllocated(newSize - oldSize);
+    // 只在分配时回收，释放时回收会在清除的过程中再次进入回收
     if (newSize > oldSize) {
+        bool young = addYoungBytes(newSize - oldSize);
+        stepBytes += newSize - oldSize;
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        static int stressCount = 0;
+        gc = gc || ++stressCount % STRESS_FULL_GC_INTERVAL == 0;
+        young = true;
 #endif
+        if (vm.gcPhase == GC_IDLE) {
+            if (gc) {
+                beginCollection();
+            } else if (young) {
+                collectYoungGarbage();
+            }
+        } else {
+            if (young) {
+                collectYoungGarbage();
+            }
+            if (getBytesAllocated() > getNextGC() * GC_HEAP_GROW_FACTOR) {
+                // 分配比增量回收快，一次做完
+                collectGarbage();
+            } else if (stepBytes >= GC_STEP_BYTES) {
+                stepGarbage();
+            }
+        }
     }
-    if (gc) {
-        collectGarbage();
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+    if (backgroundFreed != NULL) {
+        *backgroundFreed += oldSize;
+        free(pointer);
+        return NULL;
     }
+    countAllocation(oldSize, newSize);
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -31,8 +109,26 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+Object *allocateCell(size_t size, ObjectType type) {
+    // 先回收再取格子，新对象不会被这次回收看到
+    countAllocation(0, size);
+    return heapAllocate(size, type);
+}
+
 /**
- * 释放对象
+ * 对象本身的格子由堆回收，这里只从统计里减去
+ * @param size
+ */
+static void releaseObjectBytes(size_t size) {
+    if (backgroundFreed != NULL) {
+        *backgroundFreed += size;
+    } else {
+        addBytesAllocated(-size);
+    }
+}
+
+/**
+ * 释放对象引用的内存，格子由调用者还给堆
  */
 void freeObject(Object *object) {
 #ifdef DEBUG_LOG_GC
@@ -40,69 +136,166 @@ void freeObject(Object *object) {
 #endif
     switch (object->type) {
         case OBJECT_BOUND_METHOD:
-            FREE(ObjectBoundMethod, object);
+            releaseObjectBytes(sizeof(ObjectBoundMethod));
             break;
         case OBJECT_INSTANCE: {
             ObjectInstance *instance = (ObjectInstance *) object;
+            FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
             freeTable(&instance->fields);
-            FREE(ObjectInstance, object);
+            releaseObjectBytes(sizeof(ObjectInstance));
             break;
         }
         case OBJECT_STRING: {
             ObjectString *string = (ObjectString *) object;
             dbg("Free Memory of Object String %s", string->chars);
             FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjectString, object);
+            releaseObjectBytes(sizeof(ObjectString));
             break;
         }
         case OBJECT_FUNCTION: {
             ObjectFunction *function = (ObjectFunction *) object;
             freeChunk(&function->chunk);
-            FREE(ObjectFunction, object);
+            jitFree(function->jit);
+            freeLazyFunction(function);
+            releaseObjectBytes(sizeof(ObjectFunction));
             break;
         }
         case OBJECT_NATIVE:
-            FREE(ObjectNative, object);
+            releaseObjectBytes(sizeof(ObjectNative));
             break;
         case OBJECT_CLOSURE: {
             ObjectClosure *closure = (ObjectClosure *) object;
-            FREE_ARRAY(ObjectUpValue *, closure->upValues, closure->upValueCount);
-            FREE(ObjectClosure, object);
+            if (closure->upValues != NULL) {
+                FREE_ARRAY(ObjectUpValue *, closure->upValues, closure->upValueCount);
+            }
+            if (closure->copies != NULL) {
+                FREE_ARRAY(Value, closure->copies, closure->upValueCount);
+            }
+            releaseObjectBytes(sizeof(ObjectClosure));
             break;
         }
         case OBJECT_UP_VALUE:
-            FREE(ObjectUpValue, object);
+            releaseObjectBytes(sizeof(ObjectUpValue));
             break;
         case OBJECT_CLASS: {
             ObjectClass *klass = (ObjectClass *) object;
             freeTable(&klass->methods);
-            FREE(ObjectClass, object);
+            releaseObjectBytes(sizeof(ObjectClass));
+            break;
+        }
+        case OBJECT_SHAPE: {
+            ObjectShape *shape = (ObjectShape *) object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
+            releaseObjectBytes(sizeof(ObjectShape));
+            // 内联缓存里可能还记着这个形状和它的类的方法，换个版本保证缓存里的对象都还活着
+            // 后台清除时由程序的线程在收回结果时统一失效
+            if (backgroundFreed == NULL) {
+                invalidateInlineCaches();
+            }
             break;
         }
     }
 }
 
+void freeObjectInBackground(Object *object, size_t *freed) {
+    backgroundFreed = freed;
+    freeObject(object);
+    backgroundFreed = NULL;
+}
+
+/**
+ * 结束标记，这一步不和程序穿插
+ * 新生代回收让活着的新生代对象晋升并变灰，根的写入没有写屏障，所以再标记一遍，剩下的标记由多个线程并行完成
+ * 之后记忆集是空的，清除过程中不会有记忆集里的对象被释放
+ * 常量池里死掉的字符串在清除时才删除，暂停里只有标记
+ */
+static void finishMarking() {
+    collectYoungGarbage();
+    traceFromRoots();
+    beginSweep();
+}
+
+/**
+ * 清除完成，结束这一轮回收
+ */
+static void finishCollection() {
+    vm.gcPhase = GC_IDLE;
+    freshNextGC();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   %zu bytes in use, next at %zu\n", getBytesAllocated(), getNextGC());
+#endif
+}
+
+/**
+ * 增量回收的一步，一批一批地标记对象或者清除页，用完暂停时间的目标时停下
+ * 后台线程清除其他页的同时，程序的线程清除字符串的页，都清除完才结束这一轮
+ */
+static void stepGarbage() {
+    stepBytes = 0;
+    clock_t deadline = clock() + (clock_t) pauseTarget * CLOCKS_PER_SEC / 1000000;
+    do {
+        if (vm.gcPhase == GC_MARKING) {
+            if (traceReferencesStep(GC_STEP_WORK)) {
+                finishMarking();
+            }
+        } else if (sweepStep(GC_STEP_WORK)) {
+            if (backgroundSweepDone()) {
+                finishCollection();
+            }
+            return;
+        }
+    } while (clock() < deadline);
+}
+
 void collectGarbage() {
+    if (vm.gcPhase == GC_IDLE) {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+        printf("-- gc begin\n");
+#endif
+        // 一次做完的回收，根在结束标记时由标记线程一起扫描
+        vm.gcPhase = GC_MARKING;
+    }
+    if (vm.gcPhase == GC_MARKING) {
+        finishMarking();
+    }
+    sweepStep(INT_MAX);
+    waitBackgroundSweep();
+    finishCollection();
+}
+
+void collectYoungGarbage() {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
 #endif
 
     size_t before = getBytesAllocated();
 
+    // 增量标记留在灰色栈里的对象不属于这次回收
+    collectingYoung = true;
+    vm.grayBase = vm.grayCount;
     markRoots();
+    markRememberedSet();
     traceReferences();
-    sweepStrings();
-    sweep();
-    freshNextGC();
+    vm.grayBase = 0;
+    collectingYoung = false;
+    // 新生代里死掉的字符串在清除时从常量池删除
+    sweepYoung();
 
     size_t after = getBytesAllocated();
 
 #ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
+    printf("-- minor gc end\n");
     printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - after, before, after, getNextGC());
 #endif
 }
 
+void setGcPauseTarget(int micros) {
+    pauseTarget = micros;
+}
+
 void markValue(Value value) {
     if (IS_OBJECT(value)) {
         markObject(AS_OBJECT(value));
@@ -113,18 +306,37 @@ void markObject(Object *object) {
     if (object == NULL) {
         return;
     }
-    if (object->isMarked) {
+    // 新生代回收只标记新生代对象，老年代回收只标记老年代对象，新生代对象由新生代回收处理
+    // 先看代再看标记，新生代回收时后台清除线程可能正在清掉老年代对象的标记
+    if (object->isOld == collectingYoung || isMarked(object)) {
         return;
     }
 #ifdef DEBUG_LOG_GC
+    LOCK_LOG();
     printf("%p mark ", (void *) object);
     printValue(OBJECT_VAL(object));
     printf("\n");
+    UNLOCK_LOG();
 #endif
+#ifdef PARALLEL_MARK
+    // 并行标记时多个线程可能同时标记同一个对象，只有一个线程把它变灰
+    if (__atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED)) {
+        return;
+    }
+#else
     object->isMarked = true;
+#endif
     addGray(object);
 }
 
+void markUnbarriered(Object *object) {
+    if (object != NULL && object->isOld && (collectingYoung || isMarked(object))) {
+        blackenObject(object);
+        return;
+    }
+    markObject(object);
+}
+
 static void markArray(ValueArray *array) {
     for (int i = 0; i < array->size; i++) {
         markValue(array->values[i]);
@@ -133,9 +345,11 @@ static void markArray(ValueArray *array) {
 
 void blackenObject(Object *object) {
 #ifdef DEBUG_LOG_GC
+    LOCK_LOG();
     printf("%p blacken ", (void *) object);
     printValue(OBJECT_VAL(object));
     printf("\n");
+    UNLOCK_LOG();
 #endif
     switch (object->type) {
         case OBJECT_BOUND_METHOD: {
@@ -147,20 +361,40 @@ void blackenObject(Object *object) {
         case OBJECT_INSTANCE: {
             ObjectInstance *instance = (ObjectInstance *) object;
             markObject((Object *) instance->klass);
+            if (instance->shape != NULL) {
+                markObject((Object *) instance->shape);
+                for (int i = 0; i < instance->shape->slotCount; i++) {
+                    markValue(instance->slots[i]);
+                }
+            }
             markTable(&instance->fields);
+            markObject((Object *) instance->bound);
             break;
         }
         case OBJECT_CLASS: {
             ObjectClass *klass = (ObjectClass *) object;
             markObject((Object *) klass->name);
             markTable(&klass->methods);
+            markObject((Object *) klass->rootShape);
+            break;
+        }
+        case OBJECT_SHAPE: {
+            ObjectShape *shape = (ObjectShape *) object;
+            markObject((Object *) shape->klass);
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
             break;
         }
         case OBJECT_CLOSURE: {
             ObjectClosure *closure = (ObjectClosure *) object;
             markObject((Object *) closure->function);
             for (int i = 0; i < closure->upValueCount; i++) {
-                markObject((Object *) closure->upValues[i]);
+                if (closure->upValues != NULL) {
+                    markObject((Object *) closure->upValues[i]);
+                }
+                if (closure->copies != NULL) {
+                    markValue(closure->copies[i]);
+                }
             }
             break;
         }
@@ -168,6 +402,16 @@ void blackenObject(Object *object) {
             ObjectFunction *function = (ObjectFunction *) object;
             markObject((Object *) function->name);
             markArray(&function->chunk.constants);
+            markLazyFunction(function->lazy);
+            // 内联进优化代码的方法和检查用到的形状
+            for (OptimizedCode *code = function->chunk.optimized; code != NULL; code = code->previous) {
+                for (int i = 0; i < code->callCount; i++) {
+                    markObject((Object *) code->calls[i].method);
+                }
+                for (int i = 0; i < code->shapeCount; i++) {
+                    markObject((Object *) code->shapes[i]);
+                }
+            }
             break;
         }
         case OBJECT_UP_VALUE:
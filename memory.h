@@ -7,9 +7,43 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define GC_HEAP_GROW_FACTOR 2
 
+// 第一次老年代回收之前堆的上限，之后是存活大小的 GC_HEAP_GROW_FACTOR 倍
+#ifndef GC_INITIAL_HEAP
+#define GC_INITIAL_HEAP (1024 * 1024)
+#endif
+
+// 新生代分配的字节数超过这个值时进行一次新生代回收
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (256 * 1024)
+#endif
+
+#ifdef DEBUG_STRESS_GC
+// 压力测试时每次分配都进行新生代回收和一小步增量回收，让标记和清除穿插在尽可能多的分配之间
+#define GC_STEP_BYTES 1
+#define GC_STEP_WORK 8
+#define GC_PAUSE_TARGET 0
+#else
+// 增量回收时每分配这么多字节做一步标记或者清除，每一步按 GC_STEP_WORK 个对象一批处理，直到用完暂停时间
+// 这几个值和新生代的大小都可以在构建时指定，测试时调小，让回收穿插在更多的分配之间
+#ifndef GC_STEP_BYTES
+#define GC_STEP_BYTES (64 * 1024)
+#endif
+#ifndef GC_STEP_WORK
+#define GC_STEP_WORK 256
+#endif
+// 增量回收每一步暂停时间的默认目标，单位是微秒
+#ifndef GC_PAUSE_TARGET
+#define GC_PAUSE_TARGET 500
+#endif
+#endif
+
+// 压力测试时每隔这么多次分配开始一轮新的老年代回收
+#define STRESS_FULL_GC_INTERVAL 64
+
 #define ALLOCATE(type, count) \
         (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -27,15 +61,41 @@
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
 /**
- * 释放对象
+ * 为对象分配格子，和 reallocate 一样统计字节数，需要时先进行回收
+ * @param size
+ * @param type
+ * @return
+ */
+Object *allocateCell(size_t size, ObjectType type);
+
+/**
+ * 释放对象引用的内存，对象的格子由调用者还给堆
  */
 void freeObject(Object *object);
 
 /**
- * 垃圾回收
+ * 在后台清除线程释放对象，不修改虚拟机的字节统计，也不让内联缓存失效
+ * @param object
+ * @param freed 累加释放的字节数
+ */
+void freeObjectInBackground(Object *object, size_t *freed);
+
+/**
+ * 完整的垃圾回收，一次做完标记和清除，有进行中的增量回收时把它做完
  */
 void collectGarbage();
 
+/**
+ * 新生代垃圾回收，只从根和记忆集出发，老年代对象都当作活的
+ */
+void collectYoungGarbage();
+
+/**
+ * 设置增量回收每一步暂停时间的目标
+ * @param micros 微秒
+ */
+void setGcPauseTarget(int micros);
+
 /**
  * 标记值
  * @param value
@@ -48,9 +108,58 @@ void markValue(Value value);
  */
 void markObject(Object *object);
 
+/**
+ * 标记还在构造的对象，它们的字段写入没有经过写屏障
+ * 新生代回收时即使在老年代也要扫描它的引用，增量标记时已经标记过也要重新扫描
+ * @param object
+ */
+void markUnbarriered(Object *object);
+
 /**
  * 黑化对象
  */
 void blackenObject(Object *object);
 
+/**
+ * 写屏障，写入的是对象指针，可以为空
+ * 老年代对象引用了新生代对象时加入记忆集，否则新生代回收时看不到这个引用
+ * 增量标记时已经标记过的对象引用了白色对象，把白色对象变灰，否则标记结束时它还是白色的
+ * @param object 被写入的对象
+ * @param target 写入的对象
+ */
+static inline void writeBarrierObject(Object *object, Object *target) {
+    if (target == NULL) {
+        return;
+    }
+    if (object->isOld && !object->isRemembered && !target->isOld) {
+        rememberObject(object);
+    } else if (vm.gcPhase == GC_MARKING && object->isMarked && !target->isMarked) {
+        markObject(target);
+    }
+}
+
+/**
+ * 写屏障，对象的字段写入值之后调用
+ * @param object 被写入的对象
+ * @param value 写入的值
+ */
+static inline void writeBarrier(Object *object, Value value) {
+    if (IS_OBJECT(value)) {
+        writeBarrierObject(object, AS_OBJECT(value));
+    }
+}
+
+/**
+ * 写屏障，对象一次写入了很多字段（比如复制整个表），直接加入记忆集，增量标记时重新扫描
+ * @param object
+ */
+static inline void writeBarrierAll(Object *object) {
+    if (object->isOld && !object->isRemembered) {
+        rememberObject(object);
+    }
+    if (vm.gcPhase == GC_MARKING && object->isMarked) {
+        addGray(object);
+    }
+}
+
 #endif //CLOX_MEMORY_H
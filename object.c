@@ -20,9 +20,11 @@
  * @return
  */
 static Object *allocateObject(size_t size, ObjectType type) {
-    Object *object = (Object *) reallocate(NULL, 0, size);
+    Object *object = allocateCell(size, type);
     object->type = type;
     object->isMarked = false;
+    object->isOld = false;
+    object->isRemembered = false;
     addObject(object);
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void *) object, size, type);
@@ -120,6 +122,9 @@ void printObject(Value value) {
         case OBJECT_BOUND_METHOD:
             printFunction(AS_BOUND_METHOD(value)->method->function);
             break;
+        case OBJECT_SHAPE:
+            printf("%s shape", AS_SHAPE(value)->klass->name->chars);
+            break;
     }
 }
 
@@ -129,23 +134,42 @@ ObjectFunction *newFunction() {
     function->name = NULL;
     initChunk(&function->chunk);
     function->upValueCount = 0;
+    function->copiedCount = 0;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->lazy = NULL;
+    memset(function->argTypes, 0, sizeof(function->argTypes));
+    function->optimizeCount = 0;
     return function;
 }
 
-ObjectNative *newNative(NativeFn function) {
+ObjectNative *newNative(NativeFn function, int arity, bool pure) {
     ObjectNative *native = ALLOCATE_OBJECT(ObjectNative, OBJECT_NATIVE);
     native->function = function;
+    native->arity = arity;
+    native->pure = pure;
     return native;
 }
 
 ObjectClosure *newClosure(ObjectFunction *function) {
-    ObjectUpValue **upValues = ALLOCATE(ObjectUpValue*, function->upValueCount);
-    for (int i = 0; i < function->upValueCount; i++) {
-        upValues[i] = NULL;
+    ObjectUpValue **upValues = NULL;
+    if (function->copiedCount < function->upValueCount) {
+        upValues = ALLOCATE(ObjectUpValue*, function->upValueCount);
+        for (int i = 0; i < function->upValueCount; i++) {
+            upValues[i] = NULL;
+        }
+    }
+    Value *copies = NULL;
+    if (function->copiedCount > 0) {
+        copies = ALLOCATE(Value, function->upValueCount);
+        for (int i = 0; i < function->upValueCount; i++) {
+            copies[i] = NIL_VAL;
+        }
     }
     ObjectClosure *closure = ALLOCATE_OBJECT(ObjectClosure, OBJECT_CLOSURE);
     closure->function = function;
     closure->upValues = upValues;
+    closure->copies = copies;
     closure->upValueCount = function->upValueCount;
     return closure;
 }
@@ -158,20 +182,152 @@ ObjectUpValue *newUpValue(Value *slot) {
     return upValue;
 }
 
+/**
+ * 新建形状
+ * 已经释放的形状的地址可能被复用，所以新建形状的时候内联缓存都要失效
+ * @param klass
+ * @return
+ */
+static ObjectShape *newShape(ObjectClass *klass) {
+    ObjectShape *shape = ALLOCATE_OBJECT(ObjectShape, OBJECT_SHAPE);
+    shape->klass = klass;
+    shape->slotCount = 0;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    invalidateInlineCaches();
+    return shape;
+}
+
+/**
+ * 添加字段之后的形状，沿着转换树查找，没有的话新建
+ * @param shape
+ * @param name
+ * @return
+ */
+static ObjectShape *shapeTransition(ObjectShape *shape, ObjectString *name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) {
+        return AS_SHAPE(next);
+    }
+
+    ObjectShape *child = newShape(shape->klass);
+    push(OBJECT_VAL(child));
+    tableAddAll(&shape->slots, &child->slots);
+    tableSet(&child->slots, name, NUMBER_VAL(shape->slotCount));
+    child->slotCount = shape->slotCount + 1;
+    tableSet(&shape->transitions, name, OBJECT_VAL(child));
+    pop();
+    // 新建过程中可能已经晋升，表里的键值都没有经过写屏障
+    writeBarrierAll((Object *) child);
+    writeBarrierAll((Object *) shape);
+
+    if (child->slotCount > shape->klass->instanceSlots) {
+        shape->klass->instanceSlots = child->slotCount;
+    }
+    return child;
+}
+
 ObjectClass *newClass(ObjectString *name) {
     ObjectClass *klass = ALLOCATE_OBJECT(ObjectClass, OBJECT_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->rootShape = NULL;
+    klass->instanceSlots = 0;
+
+    push(OBJECT_VAL(klass));
+    klass->rootShape = newShape(klass);
+    pop();
+    writeBarrierObject((Object *) klass, (Object *) klass->rootShape);
     return klass;
 }
 
 ObjectInstance *newInstance(ObjectClass *klass) {
+    // 先分配槽位，这时实例还不在任何根上
+    Value *slots = ALLOCATE(Value, klass->instanceSlots);
     ObjectInstance *instance = ALLOCATE_OBJECT(ObjectInstance, OBJECT_INSTANCE);
     instance->klass = klass;
+    instance->shape = klass->rootShape;
+    instance->slots = slots;
+    instance->slotCapacity = klass->instanceSlots;
     initTable(&instance->fields);
+    instance->bound = NULL;
     return instance;
 }
 
+int shapeSlot(ObjectShape *shape, ObjectString *name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) {
+        return -1;
+    }
+    return (int) AS_NUMBER(slot);
+}
+
+bool getField(ObjectInstance *instance, ObjectString *name, Value *value) {
+    if (instance->shape == NULL) {
+        return tableGet(&instance->fields, name, value);
+    }
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot < 0) {
+        return false;
+    }
+    *value = instance->slots[slot];
+    return true;
+}
+
+/**
+ * 实例转为字典模式
+ * 字段先复制到字典里再丢掉形状，复制过程中GC仍然可以通过形状标记字段
+ * @param instance
+ */
+static void toDictionary(ObjectInstance *instance) {
+    Table *slots = &instance->shape->slots;
+    for (int i = 0; i < slots->capacity; i++) {
+        Entry *entry = &slots->entries[i];
+        if (entry->key != NULL) {
+            tableSet(&instance->fields, entry->key, instance->slots[(int) AS_NUMBER(entry->value)]);
+        }
+    }
+    writeBarrierAll((Object *) instance);
+    FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+    instance->shape = NULL;
+    instance->slots = NULL;
+    instance->slotCapacity = 0;
+}
+
+void setField(ObjectInstance *instance, ObjectString *name, Value value) {
+    if (instance->shape != NULL) {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot >= 0) {
+            instance->slots[slot] = value;
+            writeBarrier((Object *) instance, value);
+            return;
+        }
+        if (instance->shape->slotCount >= SHAPE_MAX_SLOTS) {
+            toDictionary(instance);
+        }
+    }
+    if (instance->shape == NULL) {
+        tableSet(&instance->fields, name, value);
+        writeBarrierObject((Object *) instance, (Object *) name);
+        writeBarrier((Object *) instance, value);
+        return;
+    }
+
+    ObjectShape *next = shapeTransition(instance->shape, name);
+    int slot = instance->shape->slotCount;
+    if (slot >= instance->slotCapacity) {
+        int oldCapacity = instance->slotCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        instance->slots = GROW_ARRAY(Value, instance->slots, oldCapacity, capacity);
+        instance->slotCapacity = capacity;
+    }
+    instance->slots[slot] = value;
+    instance->shape = next;
+    writeBarrier((Object *) instance, value);
+    writeBarrierObject((Object *) instance, (Object *) next);
+}
+
 ObjectBoundMethod *newBoundMethod(Value receiver, ObjectClosure *method) {
     ObjectBoundMethod *bound = ALLOCATE_OBJECT(ObjectBoundMethod, OBJECT_BOUND_METHOD);
     bound->receiver = receiver;
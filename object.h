@@ -19,15 +19,20 @@
 #define IS_CLASS(value)        isObjectType(value, OBJECT_CLASS)
 #define IS_INSTANCE(value)     isObjectType(value, OBJECT_INSTANCE)
 #define IS_BOUND_METHOD(value) isObjectType(value, OBJECT_BOUND_METHOD)
+#define IS_SHAPE(value)        isObjectType(value, OBJECT_SHAPE)
 
 #define AS_STRING(value)       ((ObjectString*)AS_OBJECT(value))
 #define AS_CSTRING(value)      (((ObjectString*)AS_OBJECT(value))->chars)
 #define AS_FUNCTION(value)     ((ObjectFunction*)AS_OBJECT(value))
-#define AS_NATIVE(value)       (((ObjectNative*)AS_OBJECT(value))->function)
+#define AS_NATIVE(value)       ((ObjectNative*)AS_OBJECT(value))
 #define AS_CLOSURE(value)      ((ObjectClosure*)AS_OBJECT(value))
 #define AS_CLASS(value)        ((ObjectClass*)AS_OBJECT(value))
 #define AS_INSTANCE(value)     ((ObjectInstance*)AS_OBJECT(value))
 #define AS_BOUND_METHOD(value) ((ObjectBoundMethod*)AS_OBJECT(value))
+#define AS_SHAPE(value)        ((ObjectShape*)AS_OBJECT(value))
+
+// 实例的字段超过这个数量就不再使用形状，改为字典模式
+#define SHAPE_MAX_SLOTS 32
 
 /**
  * 对象类型
@@ -41,19 +46,30 @@ typedef enum {
     OBJECT_CLASS,
     OBJECT_INSTANCE,
     OBJECT_BOUND_METHOD,
+    OBJECT_SHAPE,
 } ObjectType;
 
 struct Object {
     ObjectType type;
-    struct Object *next;    // 用于内存释放
     bool isMarked;          // 用于GC
+    bool isOld;             // 是否在老年代，新生代的对象活过一次回收之后晋升
+    bool isRemembered;      // 是否在记忆集里
 };
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+/**
+ * 本地函数，结果直接写入被调用者的槽位 args[-1]
+ * 出错时调用 nativeError 设置错误信息并返回 false，由虚拟机报告运行时错误
+ */
+typedef bool (*NativeFn)(int argCount, Value *args);
+
+// 本地函数接受任意数量的参数
+#define NATIVE_VARIADIC (-1)
 
 typedef struct {
     Object object;
     NativeFn function;
+    int arity;              // 参数数量，NATIVE_VARIADIC 表示不检查
+    bool pure;              // 不分配内存，调用前后不需要同步栈顶
 } ObjectNative;
 
 struct ObjectString {
@@ -63,12 +79,24 @@ struct ObjectString {
     uint32_t hash;
 };
 
+// 记录前几个参数见过的类型
+#define PROFILED_ARGS 8
+#define PROFILE_NUMBER 1
+#define PROFILE_STRING 2
+#define PROFILE_OTHER 4
+
 typedef struct {
     Object object;
     int arity;
     Chunk chunk;
     ObjectString *name;
     int upValueCount;
+    int copiedCount;        // 按值捕获的上值数量，这些上值不会再被赋值，创建闭包时直接复制
+    int hotness;            // 调用和循环回边的次数，达到阈值时 JIT 编译或者 SSA 优化
+    struct JitCode *jit;    // JIT 编译出来的机器码，没有编译时为 NULL
+    struct LazyFunction *lazy;  // 还没有编译的函数体，已经编译时为 NULL
+    uint8_t argTypes[PROFILED_ARGS];    // 参数见过的类型，SSA 优化层据此推测参数类型
+    int optimizeCount;      // SSA 优化的次数
 } ObjectFunction;
 
 typedef struct ObjectUpValue {
@@ -78,26 +106,46 @@ typedef struct ObjectUpValue {
     struct ObjectUpValue *next;
 } ObjectUpValue;
 
-typedef struct {
+struct ObjectClosure {
     Object object;
     ObjectFunction *function;
-    ObjectUpValue **upValues;
+    ObjectUpValue **upValues;   // 按引用捕获的上值，全部按值捕获时为 NULL
+    Value *copies;              // 按值捕获的上值，和 upValues 使用同一套下标，没有按值捕获时为 NULL
     int upValueCount;
-} ObjectClosure;
+};
 
-typedef struct {
+struct ObjectClass {
     Object obj;
     ObjectString *name;
     Table methods;
-} ObjectClass;
+    ObjectShape *rootShape; // 没有字段的实例的形状
+    int instanceSlots;      // 实例最多用到的槽位数量，新建实例时按照这个数量预先分配
+};
+
+/**
+ * 形状（隐藏类）
+ * 按照相同顺序添加字段的实例共享同一个形状，字段按照形状中的槽位存放
+ * 每个形状属于一个类，添加字段时沿着转换树走到下一个形状
+ */
+struct ObjectShape {
+    Object obj;
+    ObjectClass *klass;     // 形状所属的类
+    int slotCount;          // 字段数量
+    Table slots;            // 字段名到槽位
+    Table transitions;      // 新增的字段名到下一个形状
+};
 
 typedef struct {
     Object obj;
     ObjectClass *klass;
-    Table fields;
+    ObjectShape *shape;     // 字段的形状，为 NULL 时是字典模式
+    Value *slots;           // 按照形状中的槽位存放的字段
+    int slotCapacity;
+    Table fields;           // 字典模式下的字段
+    struct ObjectBoundMethod *bound;    // 最近一次绑定的方法，再取同一个方法时复用，不用每次都分配
 } ObjectInstance;
 
-typedef struct {
+typedef struct ObjectBoundMethod {
     Object obj;
     Value receiver;
     ObjectClosure *method;
@@ -153,9 +201,11 @@ ObjectFunction *newFunction();
 /**
  * 新建本地函数对象
  * @param function
+ * @param arity
+ * @param pure
  * @return
  */
-ObjectNative *newNative(NativeFn function);
+ObjectNative *newNative(NativeFn function, int arity, bool pure);
 
 /**
  * 新建闭包对象
@@ -185,6 +235,32 @@ ObjectClass *newClass(ObjectString *name);
  */
 ObjectInstance *newInstance(ObjectClass *klass);
 
+/**
+ * 字段在形状中的槽位
+ * @param shape
+ * @param name
+ * @return 没有这个字段时返回 -1
+ */
+int shapeSlot(ObjectShape *shape, ObjectString *name);
+
+/**
+ * 读取实例的字段
+ * @param instance
+ * @param name
+ * @param value
+ * @return
+ */
+bool getField(ObjectInstance *instance, ObjectString *name, Value *value);
+
+/**
+ * 设置实例的字段，新的字段会让实例转换到下一个形状
+ * 调用前实例和值都要在栈上，避免被GC回收
+ * @param instance
+ * @param name
+ * @param value
+ */
+void setField(ObjectInstance *instance, ObjectString *name, Value value);
+
 /**
  * 新建一个绑定好的方法
  * @param receiver
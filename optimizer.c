@@ -0,0 +1,599 @@
+#include <string.h>
+
+#include "optimizer.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+
+static int optimizeLevel = OPTIMIZE_DEFAULT;
+
+void setOptimizeLevel(int level) {
+    optimizeLevel = level;
+}
+
+int getOptimizeLevel() {
+    return optimizeLevel;
+}
+
+/**
+ * 是否为跳转指令
+ * @param opcode
+ * @return
+ */
+static bool isJump(uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_JUMP_IF_FALSE || opcode == OP_LOOP || opcode == OP_JUMP_IF_NOT_LESS;
+}
+
+/**
+ * 把字节码解码成指令数组，并找出所有的跳转目标
+ * @param optimizer
+ * @param chunk
+ */
+static void decode(Optimizer *optimizer, Chunk *chunk) {
+    optimizer->chunk = chunk;
+    optimizer->count = 0;
+    optimizer->capacity = chunk->size;
+    optimizer->codes = ALLOCATE(PeepholeCode, optimizer->capacity);
+
+    // 字节码偏移到指令下标
+    int *indexes = ALLOCATE(int, chunk->size + 1);
+    for (int offset = 0; offset < chunk->size;) {
+        PeepholeCode *code = &optimizer->codes[optimizer->count];
+        code->opcode = chunk->code[offset];
+        code->offset = offset;
+        code->length = getInstructionLength(chunk, offset, NULL);
+        code->line = getLine(chunk, offset);
+        code->target = -1;
+        code->isJumpTarget = false;
+        code->isRemoved = false;
+        code->operands[0] = code->length > 1 ? chunk->code[offset + 1] : 0;
+        code->operands[1] = code->length > 2 ? chunk->code[offset + 2] : 0;
+
+        indexes[offset] = optimizer->count++;
+        offset += code->length;
+    }
+    indexes[chunk->size] = optimizer->count;
+
+    for (int i = 0; i < optimizer->count; i++) {
+        PeepholeCode *code = &optimizer->codes[i];
+        if (!isJump(code->opcode)) {
+            continue;
+        }
+        int jump = (code->operands[0] << 8) | code->operands[1];
+        int target = code->opcode == OP_LOOP ? code->offset + 3 - jump : code->offset + 3 + jump;
+        code->target = indexes[target];
+        if (code->target < optimizer->count) {
+            optimizer->codes[code->target].isJumpTarget = true;
+        }
+    }
+
+    FREE_ARRAY(int, indexes, chunk->size + 1);
+}
+
+/**
+ * 下一条没有被删除的指令
+ * @param optimizer
+ * @param index
+ * @return 没有下一条指令时返回 -1
+ */
+static int nextCode(Optimizer *optimizer, int index) {
+    for (int i = index + 1; i < optimizer->count; i++) {
+        if (!optimizer->codes[i].isRemoved) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * 上一条没有被删除的指令
+ * @param optimizer
+ * @param index
+ * @return 没有上一条指令时返回 -1
+ */
+static int previousCode(Optimizer *optimizer, int index) {
+    for (int i = index - 1; i >= 0; i--) {
+        if (!optimizer->codes[i].isRemoved) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * 从 index 开始第一条没有被删除的指令，跳到被删除的指令实际上会落在这里
+ * @param optimizer
+ * @param index
+ * @return 后面没有指令时返回 count
+ */
+static int liveCode(Optimizer *optimizer, int index) {
+    while (index < optimizer->count && optimizer->codes[index].isRemoved) {
+        index++;
+    }
+    return index;
+}
+
+/**
+ * 重新计算跳转目标，跳到被删除的指令时改为跳到它后面的指令
+ * 每一遍优化之前调用，保证 isJumpTarget 和当前的指令一致
+ * @param optimizer
+ */
+static void markJumpTargets(Optimizer *optimizer) {
+    for (int i = 0; i < optimizer->count; i++) {
+        optimizer->codes[i].isJumpTarget = false;
+    }
+    for (int i = 0; i < optimizer->count; i++) {
+        PeepholeCode *code = &optimizer->codes[i];
+        if (code->isRemoved || !isJump(code->opcode)) {
+            continue;
+        }
+        code->target = liveCode(optimizer, code->target);
+        if (code->target < optimizer->count) {
+            optimizer->codes[code->target].isJumpTarget = true;
+        }
+    }
+}
+
+/**
+ * 从 index 开始匹配一个指令序列
+ * 序列中除了第一条指令以外都不能是跳转目标，否则合并之后跳转会落在超级指令中间
+ * @param optimizer
+ * @param index
+ * @param sequence 匹配到的指令下标
+ * @param opcodes
+ * @param length
+ * @return
+ */
+static bool matchSequence(Optimizer *optimizer, int index, int *sequence, const uint8_t *opcodes, int length) {
+    for (int i = 0; i < length; i++) {
+        if (index == -1 || optimizer->codes[index].opcode != opcodes[i]) {
+            return false;
+        }
+        if (i > 0 && optimizer->codes[index].isJumpTarget) {
+            return false;
+        }
+        sequence[i] = index;
+        index = nextCode(optimizer, index);
+    }
+    return true;
+}
+
+/**
+ * 把常见的指令序列合并成超级指令
+ * @param optimizer
+ */
+static void fuseSuperInstructions(Optimizer *optimizer) {
+    static const uint8_t addLocals[] = {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD};
+    static const uint8_t jumpIfNotLess[] = {OP_LESS, OP_JUMP_IF_FALSE, OP_POP};
+    static const uint8_t getLocalProperty[] = {OP_GET_LOCAL, OP_GET_PROPERTY};
+
+    int sequence[3];
+    for (int i = 0; i != -1 && i < optimizer->count; i = nextCode(optimizer, i)) {
+        PeepholeCode *code = &optimizer->codes[i];
+        if (code->isRemoved) {
+            continue;
+        }
+
+        if (matchSequence(optimizer, i, sequence, addLocals, 3)) {
+            // a + b
+            code->opcode = OP_ADD_LOCALS;
+            code->operands[1] = optimizer->codes[sequence[1]].operands[0];
+            code->line = optimizer->codes[sequence[2]].line;
+            optimizer->codes[sequence[1]].isRemoved = true;
+            optimizer->codes[sequence[2]].isRemoved = true;
+        } else if (matchSequence(optimizer, i, sequence, jumpIfNotLess, 3)) {
+            // 循环和分支的条件 a < b
+            code->opcode = OP_JUMP_IF_NOT_LESS;
+            code->target = optimizer->codes[sequence[1]].target;
+            optimizer->codes[sequence[1]].isRemoved = true;
+            optimizer->codes[sequence[2]].isRemoved = true;
+        } else if (matchSequence(optimizer, i, sequence, getLocalProperty, 2)) {
+            // this.x
+            code->opcode = OP_GET_LOCAL_PROPERTY;
+            code->operands[1] = optimizer->codes[sequence[1]].operands[0];
+            code->line = optimizer->codes[sequence[1]].line;
+            optimizer->codes[sequence[1]].isRemoved = true;
+        }
+    }
+}
+
+/**
+ * 把紧跟在 OP_RETURN 前面的调用改写成尾调用
+ * OP_RETURN 保留下来，跳到它的分支和不能复用栈帧的本地函数调用仍然由它返回
+ * @param optimizer
+ */
+static void rewriteTailCalls(Optimizer *optimizer) {
+    for (int i = 0; i != -1 && i < optimizer->count; i = nextCode(optimizer, i)) {
+        PeepholeCode *code = &optimizer->codes[i];
+        int next = nextCode(optimizer, i);
+        if (code->isRemoved || next == -1 || optimizer->codes[next].opcode != OP_RETURN) {
+            continue;
+        }
+        if (code->opcode == OP_CALL) {
+            code->opcode = OP_TAIL_CALL;
+        } else if (code->opcode == OP_INVOKE) {
+            code->opcode = OP_TAIL_INVOKE;
+        }
+    }
+}
+
+/**
+ * 是否为把常量压栈的指令
+ * @param code
+ * @return
+ */
+static bool isConstantCode(PeepholeCode *code) {
+    return code->opcode == OP_CONSTANT || code->opcode == OP_NIL
+           || code->opcode == OP_TRUE || code->opcode == OP_FALSE;
+}
+
+/**
+ * 常量指令压栈的值
+ * @param optimizer
+ * @param code
+ * @return
+ */
+static Value constantValue(Optimizer *optimizer, PeepholeCode *code) {
+    switch (code->opcode) {
+        case OP_NIL:
+            return NIL_VAL;
+        case OP_TRUE:
+            return BOOL_VAL(true);
+        case OP_FALSE:
+            return BOOL_VAL(false);
+        default:
+            return optimizer->chunk->constants.values[code->operands[0]];
+    }
+}
+
+/**
+ * 把指令改成压入 value 的常量指令，能复用的常量不重复添加
+ * @param optimizer
+ * @param code
+ * @param value
+ * @return 常量表已满时返回 false，指令保持不变
+ */
+static bool setConstant(Optimizer *optimizer, PeepholeCode *code, Value value) {
+    if (IS_NIL(value)) {
+        code->opcode = OP_NIL;
+        return true;
+    }
+    if (IS_BOOL(value)) {
+        code->opcode = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+        return true;
+    }
+
+    ValueArray *constants = &optimizer->chunk->constants;
+    int index = -1;
+    for (int i = 0; i < constants->size; i++) {
+        if (valuesEqual(constants->values[i], value)) {
+            index = i;
+            break;
+        }
+    }
+    if (index == -1) {
+        if (constants->size >= UINT8_COUNT) {
+            return false;
+        }
+        index = addConstant(optimizer->chunk, value);
+    }
+    code->opcode = OP_CONSTANT;
+    code->operands[0] = (uint8_t) index;
+    return true;
+}
+
+/**
+ * 计算两个常量的二元运算
+ * @param opcode
+ * @param a
+ * @param b
+ * @param result
+ * @return 运行时会报错或者不是常量运算时返回 false
+ */
+static bool foldBinary(uint8_t opcode, Value a, Value b, Value *result) {
+    if (opcode == OP_EQUAL || opcode == OP_NOT_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b) == (opcode == OP_EQUAL));
+        return true;
+    }
+    if (opcode == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        ObjectString *left = AS_STRING(a);
+        ObjectString *right = AS_STRING(b);
+        int length = left->length + right->length;
+        char *chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJECT_VAL(takeString(chars, length));
+        return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        return false;
+    }
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (opcode) {
+        case OP_ADD:
+            *result = NUMBER_VAL(x + y);
+            return true;
+        case OP_SUBTRACT:
+            *result = NUMBER_VAL(x - y);
+            return true;
+        case OP_MULTIPLY:
+            *result = NUMBER_VAL(x * y);
+            return true;
+        case OP_DIVIDE:
+            *result = NUMBER_VAL(x / y);
+            return true;
+        case OP_GREATER:
+            *result = BOOL_VAL(x > y);
+            return true;
+        case OP_LESS:
+            *result = BOOL_VAL(x < y);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * 常量折叠，运算结果替换掉第一个操作数，删除其余的指令
+ * 从前往后扫描，操作数已经折叠过，所以 1 + 2 * 3 一遍就可以折叠完
+ * @param optimizer
+ */
+static void foldConstants(Optimizer *optimizer) {
+    markJumpTargets(optimizer);
+    for (int i = 0; i < optimizer->count; i++) {
+        PeepholeCode *code = &optimizer->codes[i];
+        if (code->isRemoved || code->isJumpTarget) {
+            continue;
+        }
+
+        int b = previousCode(optimizer, i);
+        if (b == -1 || !isConstantCode(&optimizer->codes[b])) {
+            continue;
+        }
+        PeepholeCode *right = &optimizer->codes[b];
+
+        // 一元运算
+        if (code->opcode == OP_NOT || code->opcode == OP_NEGATE) {
+            Value value = constantValue(optimizer, right);
+            if (code->opcode == OP_NOT) {
+                value = BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)));
+            } else if (IS_NUMBER(value)) {
+                value = NUMBER_VAL(-AS_NUMBER(value));
+            } else {
+                continue;
+            }
+            if (setConstant(optimizer, right, value)) {
+                code->isRemoved = true;
+            }
+            continue;
+        }
+
+        // 二元运算
+        int a = previousCode(optimizer, b);
+        if (a == -1 || right->isJumpTarget || !isConstantCode(&optimizer->codes[a])) {
+            continue;
+        }
+        PeepholeCode *left = &optimizer->codes[a];
+        Value result;
+        if (foldBinary(code->opcode, constantValue(optimizer, left), constantValue(optimizer, right), &result)
+            && setConstant(optimizer, left, result)) {
+            right->isRemoved = true;
+            code->isRemoved = true;
+        }
+    }
+}
+
+/**
+ * 删除没有作用的指令
+ * 结果马上被弹出的压栈指令连同 OP_POP 一起删除，结果马上被弹出的 OP_NOT 直接删除
+ * 条件语句中的 OP_NOT; OP_NOT 不改变真假，两个分支都会弹出条件，可以一起删除
+ * @param optimizer
+ */
+static void removeRedundantCodes(Optimizer *optimizer) {
+    static const uint8_t doubleNot[] = {OP_NOT, OP_NOT, OP_JUMP_IF_FALSE, OP_POP};
+
+    markJumpTargets(optimizer);
+    int sequence[4];
+    for (int i = 0; i < optimizer->count; i++) {
+        PeepholeCode *code = &optimizer->codes[i];
+        if (code->isRemoved) {
+            continue;
+        }
+
+        int next = nextCode(optimizer, i);
+        if (next != -1 && optimizer->codes[next].opcode == OP_POP && !optimizer->codes[next].isJumpTarget) {
+            switch (code->opcode) {
+                case OP_CONSTANT:
+                case OP_NIL:
+                case OP_TRUE:
+                case OP_FALSE:
+                case OP_GET_LOCAL:
+                case OP_GET_UP_VALUE:
+                    code->isRemoved = true;
+                    optimizer->codes[next].isRemoved = true;
+                    continue;
+                case OP_NOT:
+                    code->isRemoved = true;
+                    continue;
+                default:
+                    break;
+            }
+        }
+
+        if (matchSequence(optimizer, i, sequence, doubleNot, 4)) {
+            PeepholeCode *target = &optimizer->codes[optimizer->codes[sequence[2]].target];
+            if (target->opcode == OP_POP) {
+                code->isRemoved = true;
+                optimizer->codes[sequence[1]].isRemoved = true;
+            }
+        }
+    }
+}
+
+/**
+ * 跳转线程化：跳到无条件跳转的改为直接跳到最终的目标
+ * 条件跳转跳到另一个条件跳转时，栈顶的条件不变，第二个跳转一定也会跳
+ * 无条件跳转到 OP_RETURN 直接改成返回，跳到下一条指令的无条件跳转直接删除
+ * @param optimizer
+ */
+static void threadJumps(Optimizer *optimizer) {
+    markJumpTargets(optimizer);
+    for (int i = 0; i < optimizer->count; i++) {
+        PeepholeCode *code = &optimizer->codes[i];
+        if (code->isRemoved || (code->opcode != OP_JUMP && code->opcode != OP_JUMP_IF_FALSE)) {
+            continue;
+        }
+
+        // 只会向前跳，不会出现环
+        int target = code->target;
+        while (target < optimizer->count) {
+            PeepholeCode *next = &optimizer->codes[target];
+            if (next->opcode != OP_JUMP && (code->opcode != OP_JUMP_IF_FALSE || next->opcode != OP_JUMP_IF_FALSE)) {
+                break;
+            }
+            target = liveCode(optimizer, next->target);
+        }
+        code->target = target;
+
+        if (code->opcode != OP_JUMP) {
+            continue;
+        }
+        if (target < optimizer->count && optimizer->codes[target].opcode == OP_RETURN) {
+            code->opcode = OP_RETURN;
+            code->target = -1;
+        } else if (target == liveCode(optimizer, i + 1)) {
+            code->isRemoved = true;
+        }
+    }
+}
+
+/**
+ * 删除不可达的指令：无条件跳转和返回之后，直到下一个跳转目标之前的指令
+ * 被删除的跳转原来的目标可能也变得不可达，所以重复到没有变化为止
+ * @param optimizer
+ */
+static void removeDeadCode(Optimizer *optimizer) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        markJumpTargets(optimizer);
+        bool dead = false;
+        for (int i = 0; i < optimizer->count; i++) {
+            PeepholeCode *code = &optimizer->codes[i];
+            if (code->isRemoved) {
+                continue;
+            }
+            if (code->isJumpTarget) {
+                dead = false;
+            }
+            if (dead) {
+                code->isRemoved = true;
+                changed = true;
+                continue;
+            }
+            dead = code->opcode == OP_RETURN || code->opcode == OP_JUMP || code->opcode == OP_LOOP;
+        }
+    }
+}
+
+/**
+ * 指令重新编码之后的长度
+ * @param code
+ * @return
+ */
+static int encodedLength(PeepholeCode *code) {
+    if (code->isRemoved) {
+        return 0;
+    }
+    switch (code->opcode) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_RETURN:
+            return 1;
+        case OP_CONSTANT:
+            return 2;
+        case OP_ADD_LOCALS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_GET_LOCAL_PROPERTY:
+            return 3;
+        default:
+            return code->length;
+    }
+}
+
+/**
+ * 把指令数组重新编码回字节码，并重新计算跳转偏移
+ * @param optimizer
+ */
+static void encode(Optimizer *optimizer) {
+    Chunk *chunk = optimizer->chunk;
+
+    // 被删除的指令的新偏移就是下一条指令的偏移
+    int *offsets = ALLOCATE(int, optimizer->count + 1);
+    int size = 0;
+    for (int i = 0; i < optimizer->count; i++) {
+        offsets[i] = size;
+        size += encodedLength(&optimizer->codes[i]);
+    }
+    offsets[optimizer->count] = size;
+
+    uint8_t *code = ALLOCATE(uint8_t, size);
+    chunk->lineCount = 0;
+    for (int i = 0; i < optimizer->count; i++) {
+        PeepholeCode *peephole = &optimizer->codes[i];
+        int length = encodedLength(peephole);
+        if (length == 0) {
+            continue;
+        }
+
+        int offset = offsets[i];
+        code[offset] = peephole->opcode;
+        if (isJump(peephole->opcode)) {
+            int jump = peephole->opcode == OP_LOOP
+                       ? offset + 3 - offsets[peephole->target]
+                       : offsets[peephole->target] - offset - 3;
+            code[offset + 1] = (jump >> 8) & 0xff;
+            code[offset + 2] = jump & 0xff;
+        } else if (peephole->opcode == OP_CLOSURE) {
+            // 闭包的上值描述原样复制
+            memcpy(&code[offset + 1], &chunk->code[peephole->offset + 1], length - 1);
+        } else {
+            for (int j = 1; j < length; j++) {
+                code[offset + j] = peephole->operands[j - 1];
+            }
+        }
+        addLine(chunk, offset, peephole->line);
+    }
+
+    FREE_ARRAY(int, offsets, optimizer->count + 1);
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    chunk->code = code;
+    chunk->size = size;
+    chunk->capacity = size;
+}
+
+void optimizeChunk(Chunk *chunk) {
+    if (chunk->size == 0) {
+        return;
+    }
+
+    Optimizer optimizer;
+    decode(&optimizer, chunk);
+    if (optimizeLevel > 0) {
+        foldConstants(&optimizer);
+        removeRedundantCodes(&optimizer);
+        threadJumps(&optimizer);
+        removeDeadCode(&optimizer);
+        markJumpTargets(&optimizer);
+        fuseSuperInstructions(&optimizer);
+    }
+    // 尾调用决定了递归能有多深，不属于可以关掉的优化
+    rewriteTailCalls(&optimizer);
+    encode(&optimizer);
+    FREE_ARRAY(PeepholeCode, optimizer.codes, optimizer.capacity);
+    dbg("Optimize Chunk From [%d] Instructions To [%d] Bytes", optimizer.count, chunk->size);
+}
@@ -0,0 +1,53 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "chunk.h"
+
+// 默认的优化级别
+#define OPTIMIZE_DEFAULT 1
+
+/**
+ * 窥孔优化中的一条指令
+ */
+typedef struct {
+    uint8_t opcode;
+    uint8_t operands[2];    // 除跳转和闭包以外的操作数
+    int offset;             // 在原字节码中的偏移
+    int length;             // 在原字节码中的长度
+    int line;
+    int target;             // 跳转目标指令的下标，不是跳转指令时为 -1
+    bool isJumpTarget;      // 是否有跳转指令跳到这里
+    bool isRemoved;         // 是否已经被删除
+} PeepholeCode;
+
+/**
+ * 窥孔优化器
+ */
+typedef struct {
+    Chunk *chunk;
+    PeepholeCode *codes;
+    int count;
+    int capacity;
+} Optimizer;
+
+/**
+ * 设置优化级别，0 只保留尾调用改写，方便对照调试
+ * @param level
+ */
+void setOptimizeLevel(int level);
+
+/**
+ * 当前的优化级别，不同级别编译出来的字节码不同
+ * @return
+ */
+int getOptimizeLevel();
+
+/**
+ * 优化编译好的字节码块
+ * 在函数编译结束之后调用，依次做常量折叠、删除冗余指令、跳转线程化、删除不可达代码，
+ * 最后把常见的指令序列合并成超级指令
+ * @param chunk
+ */
+void optimizeChunk(Chunk *chunk);
+
+#endif //CLOX_OPTIMIZER_H
@@ -196,9 +196,13 @@ static Token identifier() {
 }
 
 void initScanner(const char *source) {
+    initScannerAt(source, 1);
+}
+
+void initScannerAt(const char *source, int line) {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
 }
 
 Token scanToken() {
@@ -78,6 +78,13 @@ typedef struct {
  */
 void initScanner(const char *source);
 
+/**
+ * 从源代码中间开始扫描，延迟编译函数体时使用
+ * @param source
+ * @param line source 所在的行
+ */
+void initScannerAt(const char *source, int line);
+
 /**
  * 扫描一个Token
  * @return
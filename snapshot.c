@@ -0,0 +1,740 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "bytecode.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/**
+ * 值在快照中的种类
+ */
+typedef enum {
+    SNAPSHOT_RAW,       // 不是对象的值，原样保存
+    SNAPSHOT_OBJECT,    // 对象，保存编号
+} SnapshotTag;
+
+/**
+ * 写入快照时收集到的对象
+ * 对象地址到编号用开放寻址的哈希表查找
+ */
+typedef struct {
+    Object **objects;       // 按照编号排列的对象
+    int count;
+    int capacity;
+    Object **keys;          // 哈希表的键，空位为 NULL
+    int *indexes;           // 哈希表的值，对象的编号
+    int tableCapacity;
+} SnapshotWriter;
+
+/**
+ * 加载快照时已经创建的对象，垃圾回收时作为根
+ */
+static Object **loadedObjects = NULL;
+static int loadedCount = 0;
+
+/**
+ * 对象类型在快照中的顺序，创建对象时依赖的对象排在前面
+ * 本地函数和类依赖名字，闭包依赖函数，实例依赖类，绑定的方法依赖闭包
+ */
+static const ObjectType snapshotOrder[] = {
+        OBJECT_STRING,
+        OBJECT_NATIVE,
+        OBJECT_FUNCTION,
+        OBJECT_UP_VALUE,
+        OBJECT_CLASS,
+        OBJECT_CLOSURE,
+        OBJECT_INSTANCE,
+        OBJECT_BOUND_METHOD,
+};
+
+#define SNAPSHOT_TYPES ((int) (sizeof(snapshotOrder) / sizeof(snapshotOrder[0])))
+
+// ========================== 写入 ==========================
+
+static uint32_t hashPointer(Object *object) {
+    uintptr_t key = (uintptr_t) object;
+    key ^= key >> 17;
+    key *= 0x9e3779b97f4a7c15u;
+    return (uint32_t) (key >> 32);
+}
+
+/**
+ * 对象在哈希表中的位置，不存在时是应该插入的空位
+ * @param writer
+ * @param object
+ * @return
+ */
+static int findSlot(SnapshotWriter *writer, Object *object) {
+    int mask = writer->tableCapacity - 1;
+    int slot = (int) (hashPointer(object) & mask);
+    while (writer->keys[slot] != NULL && writer->keys[slot] != object) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void growTable(SnapshotWriter *writer) {
+    int oldCapacity = writer->tableCapacity;
+    Object **oldKeys = writer->keys;
+    int *oldIndexes = writer->indexes;
+
+    writer->tableCapacity = GROW_CAPACITY(oldCapacity) * 2;
+    writer->keys = ALLOCATE(Object *, writer->tableCapacity);
+    writer->indexes = ALLOCATE(int, writer->tableCapacity);
+    for (int i = 0; i < writer->tableCapacity; i++) {
+        writer->keys[i] = NULL;
+    }
+    for (int i = 0; i < oldCapacity; i++) {
+        if (oldKeys[i] != NULL) {
+            int slot = findSlot(writer, oldKeys[i]);
+            writer->keys[slot] = oldKeys[i];
+            writer->indexes[slot] = oldIndexes[i];
+        }
+    }
+    FREE_ARRAY(Object *, oldKeys, oldCapacity);
+    FREE_ARRAY(int, oldIndexes, oldCapacity);
+}
+
+static int objectIndex(SnapshotWriter *writer, Object *object) {
+    return writer->indexes[findSlot(writer, object)];
+}
+
+/**
+ * 收集一个对象，已经收集过的忽略
+ * @param writer
+ * @param object
+ */
+static void visitObject(SnapshotWriter *writer, Object *object) {
+    if (object == NULL) {
+        return;
+    }
+    // 负载不超过一半
+    if ((writer->count + 1) * 2 > writer->tableCapacity) {
+        growTable(writer);
+    }
+    int slot = findSlot(writer, object);
+    if (writer->keys[slot] != NULL) {
+        return;
+    }
+    if (writer->count + 1 > writer->capacity) {
+        int oldCapacity = writer->capacity;
+        writer->capacity = GROW_CAPACITY(oldCapacity);
+        writer->objects = GROW_ARRAY(Object *, writer->objects, oldCapacity, writer->capacity);
+    }
+    writer->keys[slot] = object;
+    writer->indexes[slot] = writer->count;
+    writer->objects[writer->count++] = object;
+}
+
+static void visitValue(SnapshotWriter *writer, Value value) {
+    if (IS_OBJECT(value)) {
+        visitObject(writer, AS_OBJECT(value));
+    }
+}
+
+static void visitTable(SnapshotWriter *writer, Table *table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key != NULL) {
+            visitObject(writer, (Object *) entry->key);
+            visitValue(writer, entry->value);
+        }
+    }
+}
+
+/**
+ * 本地函数保存为绑定它的全局变量名，加载时找新虚拟机中同名的本地函数
+ * @param native
+ * @return 没有绑定到全局变量时返回 NULL
+ */
+static ObjectString *nativeName(ObjectNative *native) {
+    for (int i = 0; i < vm.globalValues.size; i++) {
+        Value value = vm.globalValues.values[i];
+        if (IS_OBJECT(value) && AS_OBJECT(value) == (Object *) native) {
+            return globalName(i);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 实例的字段按照槽位顺序排列，加载时按同样的顺序添加，得到同样的形状
+ * @param instance
+ * @param names 长度至少为字段数量
+ * @return 字段数量
+ */
+static int instanceFields(ObjectInstance *instance, ObjectString **names, Value *values) {
+    Table *table = instance->shape != NULL ? &instance->shape->slots : &instance->fields;
+    int count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key == NULL) {
+            continue;
+        }
+        if (instance->shape != NULL) {
+            int slot = (int) AS_NUMBER(entry->value);
+            names[slot] = entry->key;
+            values[slot] = instance->slots[slot];
+        } else {
+            names[count] = entry->key;
+            values[count] = entry->value;
+        }
+        count++;
+    }
+    return count;
+}
+
+static int fieldCount(ObjectInstance *instance) {
+    return instance->shape != NULL ? instance->shape->slotCount : instance->fields.count;
+}
+
+/**
+ * 收集对象引用的对象
+ * @param writer
+ * @param object
+ * @return 对象是否可以保存
+ */
+static bool traceObject(SnapshotWriter *writer, Object *object) {
+    switch (object->type) {
+        case OBJECT_STRING:
+            return true;
+        case OBJECT_NATIVE: {
+            ObjectString *name = nativeName((ObjectNative *) object);
+            visitObject(writer, (Object *) name);
+            return name != NULL;
+        }
+        case OBJECT_FUNCTION: {
+            ObjectFunction *function = (ObjectFunction *) object;
+            visitObject(writer, (Object *) function->name);
+            for (int i = 0; i < function->chunk.constants.size; i++) {
+                visitValue(writer, function->chunk.constants.values[i]);
+            }
+            // 还没有编译的函数没有字节码
+            return function->lazy == NULL;
+        }
+        case OBJECT_UP_VALUE: {
+            ObjectUpValue *upValue = (ObjectUpValue *) object;
+            visitValue(writer, upValue->closed);
+            // 还没有关闭的上值指向虚拟机栈
+            return upValue->location == &upValue->closed;
+        }
+        case OBJECT_CLASS: {
+            ObjectClass *klass = (ObjectClass *) object;
+            visitObject(writer, (Object *) klass->name);
+            visitTable(writer, &klass->methods);
+            return true;
+        }
+        case OBJECT_CLOSURE: {
+            ObjectClosure *closure = (ObjectClosure *) object;
+            visitObject(writer, (Object *) closure->function);
+            for (int i = 0; i < closure->upValueCount; i++) {
+                if (closure->upValues != NULL) {
+                    visitObject(writer, (Object *) closure->upValues[i]);
+                }
+                if (closure->copies != NULL) {
+                    visitValue(writer, closure->copies[i]);
+                }
+            }
+            return true;
+        }
+        case OBJECT_INSTANCE: {
+            ObjectInstance *instance = (ObjectInstance *) object;
+            visitObject(writer, (Object *) instance->klass);
+            if (instance->shape != NULL) {
+                visitTable(writer, &instance->shape->slots);
+                for (int i = 0; i < instance->shape->slotCount; i++) {
+                    visitValue(writer, instance->slots[i]);
+                }
+            } else {
+                visitTable(writer, &instance->fields);
+            }
+            return true;
+        }
+        case OBJECT_BOUND_METHOD: {
+            ObjectBoundMethod *bound = (ObjectBoundMethod *) object;
+            visitValue(writer, bound->receiver);
+            visitObject(writer, (Object *) bound->method);
+            return true;
+        }
+        case OBJECT_SHAPE:
+            // 只通过实例到达，实例的字段单独保存
+            return false;
+    }
+    return false;
+}
+
+/**
+ * 按照类型的顺序重新编号
+ * @param writer
+ */
+static void sortObjects(SnapshotWriter *writer) {
+    Object **sorted = ALLOCATE(Object *, writer->capacity);
+    int count = 0;
+    for (int type = 0; type < SNAPSHOT_TYPES; type++) {
+        for (int i = 0; i < writer->count; i++) {
+            if (writer->objects[i]->type == snapshotOrder[type]) {
+                writer->indexes[findSlot(writer, writer->objects[i])] = count;
+                sorted[count++] = writer->objects[i];
+            }
+        }
+    }
+    FREE_ARRAY(Object *, writer->objects, writer->capacity);
+    writer->objects = sorted;
+}
+
+static void writeObjectIndex(FILE *file, SnapshotWriter *writer, Object *object) {
+    writeU32(file, (uint32_t) objectIndex(writer, object));
+}
+
+static void writeValue(FILE *file, SnapshotWriter *writer, Value value) {
+    if (IS_OBJECT(value)) {
+        fputc(SNAPSHOT_OBJECT, file);
+        writeObjectIndex(file, writer, AS_OBJECT(value));
+    } else {
+        fputc(SNAPSHOT_RAW, file);
+        fwrite(&value, sizeof(Value), 1, file);
+    }
+}
+
+/**
+ * 写入创建对象需要的信息，这些信息只引用排在前面的对象
+ * @param file
+ * @param writer
+ * @param object
+ */
+static void writeHeader(FILE *file, SnapshotWriter *writer, Object *object) {
+    fputc(object->type, file);
+    switch (object->type) {
+        case OBJECT_STRING:
+            writeString(file, (ObjectString *) object);
+            break;
+        case OBJECT_NATIVE:
+            writeObjectIndex(file, writer, (Object *) nativeName((ObjectNative *) object));
+            break;
+        case OBJECT_FUNCTION: {
+            ObjectFunction *function = (ObjectFunction *) object;
+            writeU32(file, (uint32_t) function->arity);
+            writeU32(file, (uint32_t) function->upValueCount);
+            writeU32(file, (uint32_t) function->copiedCount);
+            break;
+        }
+        case OBJECT_CLASS: {
+            ObjectClass *klass = (ObjectClass *) object;
+            writeObjectIndex(file, writer, (Object *) klass->name);
+            writeU32(file, (uint32_t) klass->instanceSlots);
+            break;
+        }
+        case OBJECT_CLOSURE:
+            writeObjectIndex(file, writer, (Object *) ((ObjectClosure *) object)->function);
+            break;
+        case OBJECT_INSTANCE:
+            writeObjectIndex(file, writer, (Object *) ((ObjectInstance *) object)->klass);
+            break;
+        case OBJECT_BOUND_METHOD:
+            writeObjectIndex(file, writer, (Object *) ((ObjectBoundMethod *) object)->method);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * 写入对象的内容，这时所有的对象都已经创建，可以引用任意对象
+ * @param file
+ * @param writer
+ * @param object
+ */
+static void writeBody(FILE *file, SnapshotWriter *writer, Object *object) {
+    switch (object->type) {
+        case OBJECT_FUNCTION: {
+            ObjectFunction *function = (ObjectFunction *) object;
+            Chunk *chunk = &function->chunk;
+            fputc(function->name != NULL, file);
+            if (function->name != NULL) {
+                writeObjectIndex(file, writer, (Object *) function->name);
+            }
+            writeU32(file, (uint32_t) chunk->size);
+            fwrite(chunk->code, sizeof(uint8_t), chunk->size, file);
+            writeLines(file, chunk);
+            writeU32(file, (uint32_t) chunk->constants.size);
+            for (int i = 0; i < chunk->constants.size; i++) {
+                writeValue(file, writer, chunk->constants.values[i]);
+            }
+            break;
+        }
+        case OBJECT_UP_VALUE:
+            writeValue(file, writer, ((ObjectUpValue *) object)->closed);
+            break;
+        case OBJECT_CLASS: {
+            Table *methods = &((ObjectClass *) object)->methods;
+            writeU32(file, (uint32_t) methods->count);
+            for (int i = 0; i < methods->capacity; i++) {
+                if (methods->entries[i].key != NULL) {
+                    writeObjectIndex(file, writer, (Object *) methods->entries[i].key);
+                    writeValue(file, writer, methods->entries[i].value);
+                }
+            }
+            break;
+        }
+        case OBJECT_CLOSURE: {
+            ObjectClosure *closure = (ObjectClosure *) object;
+            for (int i = 0; i < closure->upValueCount; i++) {
+                // 编号加一，0 表示这个上值是按值捕获的
+                ObjectUpValue *upValue = closure->upValues != NULL ? closure->upValues[i] : NULL;
+                writeU32(file, upValue != NULL ? (uint32_t) objectIndex(writer, (Object *) upValue) + 1 : 0);
+                writeValue(file, writer, closure->copies != NULL ? closure->copies[i] : NIL_VAL);
+            }
+            break;
+        }
+        case OBJECT_INSTANCE: {
+            ObjectInstance *instance = (ObjectInstance *) object;
+            int count = fieldCount(instance);
+            ObjectString **names = ALLOCATE(ObjectString *, count);
+            Value *values = ALLOCATE(Value, count);
+            instanceFields(instance, names, values);
+            writeU32(file, (uint32_t) count);
+            for (int i = 0; i < count; i++) {
+                writeObjectIndex(file, writer, (Object *) names[i]);
+                writeValue(file, writer, values[i]);
+            }
+            FREE_ARRAY(ObjectString *, names, count);
+            FREE_ARRAY(Value, values, count);
+            break;
+        }
+        case OBJECT_BOUND_METHOD:
+            writeValue(file, writer, ((ObjectBoundMethod *) object)->receiver);
+            break;
+        default:
+            break;
+    }
+}
+
+static void freeWriter(SnapshotWriter *writer) {
+    FREE_ARRAY(Object *, writer->objects, writer->capacity);
+    FREE_ARRAY(Object *, writer->keys, writer->tableCapacity);
+    FREE_ARRAY(int, writer->indexes, writer->tableCapacity);
+}
+
+bool writeSnapshot(const char *path) {
+    SnapshotWriter writer;
+    writer.objects = NULL;
+    writer.count = 0;
+    writer.capacity = 0;
+    writer.keys = NULL;
+    writer.indexes = NULL;
+    writer.tableCapacity = 0;
+
+    // 从全局变量出发收集所有能到达的对象，收集到的对象数组本身就是工作队列
+    for (int i = 0; i < vm.globalValues.size; i++) {
+        visitObject(&writer, (Object *) globalName(i));
+        visitValue(&writer, vm.globalValues.values[i]);
+    }
+    for (int i = 0; i < writer.count; i++) {
+        if (!traceObject(&writer, writer.objects[i])) {
+            freeWriter(&writer);
+            return false;
+        }
+    }
+    sortObjects(&writer);
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        freeWriter(&writer);
+        return false;
+    }
+    fwrite(SNAPSHOT_MAGIC, sizeof(char), 4, file);
+    writeU32(file, SNAPSHOT_VERSION);
+    writeU32(file, BYTECODE_VERSION);
+    writeU32(file, OP_COUNT);
+
+    // 全局变量名放在最前面，加载时先分配好槽位，再重定位函数中的槽位
+    writeU32(file, (uint32_t) vm.globalNames.size);
+    for (int i = 0; i < vm.globalNames.size; i++) {
+        writeString(file, globalName(i));
+    }
+
+    writeU32(file, (uint32_t) writer.count);
+    for (int i = 0; i < writer.count; i++) {
+        writeHeader(file, &writer, writer.objects[i]);
+    }
+    for (int i = 0; i < writer.count; i++) {
+        writeBody(file, &writer, writer.objects[i]);
+    }
+    for (int i = 0; i < vm.globalValues.size; i++) {
+        writeValue(file, &writer, vm.globalValues.values[i]);
+    }
+
+    freeWriter(&writer);
+    bool failed = ferror(file);
+    return fclose(file) == 0 && !failed;
+}
+
+// ========================== 读取 ==========================
+
+/**
+ * 读取编号，编号对应的对象必须已经创建并且是指定的类型
+ * @param reader
+ * @param type
+ * @return 不合法时返回 NULL 并标记失败
+ */
+static Object *readObject(Reader *reader, ObjectType type) {
+    uint32_t index = readU32(reader);
+    if (reader->failed || index >= (uint32_t) loadedCount || loadedObjects[index]->type != type) {
+        reader->failed = true;
+        return NULL;
+    }
+    return loadedObjects[index];
+}
+
+static Value readValue(Reader *reader) {
+    Value value = NIL_VAL;
+    if (readU8(reader) == SNAPSHOT_OBJECT) {
+        uint32_t index = readU32(reader);
+        if (index >= (uint32_t) loadedCount) {
+            reader->failed = true;
+            return NIL_VAL;
+        }
+        return OBJECT_VAL(loadedObjects[index]);
+    }
+    readBytes(reader, &value, sizeof(Value));
+    if (IS_OBJECT(value)) {
+        reader->failed = true;
+        return NIL_VAL;
+    }
+    return value;
+}
+
+/**
+ * 按照头部信息创建对象，对象的内容之后再填写
+ * @param reader
+ * @return 不合法时返回 NULL
+ */
+static Object *createObject(Reader *reader) {
+    switch (readU8(reader)) {
+        case OBJECT_STRING:
+            return (Object *) readString(reader);
+        case OBJECT_NATIVE: {
+            ObjectString *name = (ObjectString *) readObject(reader, OBJECT_STRING);
+            Value slot;
+            if (name == NULL || !tableGet(&vm.globalSlots, name, &slot)) {
+                return NULL;
+            }
+            Value native = vm.globalValues.values[(int) AS_NUMBER(slot)];
+            return IS_NATIVE(native) ? AS_OBJECT(native) : NULL;
+        }
+        case OBJECT_FUNCTION: {
+            int arity = (int) readU32(reader);
+            int upValueCount = (int) readU32(reader);
+            int copiedCount = (int) readU32(reader);
+            if (arity > UINT8_MAX || upValueCount > UINT8_COUNT || copiedCount > upValueCount) {
+                return NULL;
+            }
+            ObjectFunction *function = newFunction();
+            function->arity = arity;
+            function->upValueCount = upValueCount;
+            function->copiedCount = copiedCount;
+            return (Object *) function;
+        }
+        case OBJECT_UP_VALUE: {
+            ObjectUpValue *upValue = newUpValue(NULL);
+            upValue->location = &upValue->closed;
+            return (Object *) upValue;
+        }
+        case OBJECT_CLASS: {
+            ObjectString *name = (ObjectString *) readObject(reader, OBJECT_STRING);
+            int instanceSlots = (int) readU32(reader);
+            if (name == NULL || instanceSlots > UINT16_MAX) {
+                return NULL;
+            }
+            ObjectClass *klass = newClass(name);
+            klass->instanceSlots = instanceSlots;
+            return (Object *) klass;
+        }
+        case OBJECT_CLOSURE: {
+            ObjectFunction *function = (ObjectFunction *) readObject(reader, OBJECT_FUNCTION);
+            return function != NULL ? (Object *) newClosure(function) : NULL;
+        }
+        case OBJECT_INSTANCE: {
+            ObjectClass *klass = (ObjectClass *) readObject(reader, OBJECT_CLASS);
+            return klass != NULL ? (Object *) newInstance(klass) : NULL;
+        }
+        case OBJECT_BOUND_METHOD: {
+            ObjectClosure *method = (ObjectClosure *) readObject(reader, OBJECT_CLOSURE);
+            return method != NULL ? (Object *) newBoundMethod(NIL_VAL, method) : NULL;
+        }
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * 填写对象的内容
+ * @param reader
+ * @param object
+ * @param globalSlots 快照中的全局变量槽位到当前虚拟机中的槽位
+ * @param globalCount
+ */
+static void fillObject(Reader *reader, Object *object, const int *globalSlots, int globalCount) {
+    switch (object->type) {
+        case OBJECT_FUNCTION: {
+            ObjectFunction *function = (ObjectFunction *) object;
+            Chunk *chunk = &function->chunk;
+            if (readU8(reader)) {
+                function->name = (ObjectString *) readObject(reader, OBJECT_STRING);
+            }
+            int size = readCount(reader, sizeof(uint8_t));
+            if (reader->failed || size == 0) {
+                reader->failed = true;
+                return;
+            }
+            uint8_t *code = ALLOCATE(uint8_t, size);
+            readBytes(reader, code, size);
+            chunk->code = code;
+            chunk->capacity = size;
+            chunk->size = size;
+            if (!readLines(reader, chunk)) {
+                return;
+            }
+
+            int constantCount = readCount(reader, 1);
+            for (int i = 0; i < constantCount && !reader->failed; i++) {
+                addConstant(chunk, readValue(reader));
+            }
+            if (!reader->failed && !relocateChunk(chunk, globalSlots, globalCount)) {
+                reader->failed = true;
+            }
+            break;
+        }
+        case OBJECT_UP_VALUE:
+            ((ObjectUpValue *) object)->closed = readValue(reader);
+            break;
+        case OBJECT_CLASS: {
+            ObjectClass *klass = (ObjectClass *) object;
+            int count = readCount(reader, 1);
+            for (int i = 0; i < count && !reader->failed; i++) {
+                ObjectString *name = (ObjectString *) readObject(reader, OBJECT_STRING);
+                Value method = readValue(reader);
+                if (name != NULL && IS_CLOSURE(method)) {
+                    tableSet(&klass->methods, name, method);
+                } else {
+                    reader->failed = true;
+                }
+            }
+            break;
+        }
+        case OBJECT_CLOSURE: {
+            ObjectClosure *closure = (ObjectClosure *) object;
+            for (int i = 0; i < closure->upValueCount && !reader->failed; i++) {
+                uint32_t index = readU32(reader);
+                Value copy = readValue(reader);
+                if (index != 0) {
+                    if (closure->upValues == NULL || index > (uint32_t) loadedCount
+                        || loadedObjects[index - 1]->type != OBJECT_UP_VALUE) {
+                        reader->failed = true;
+                        return;
+                    }
+                    closure->upValues[i] = (ObjectUpValue *) loadedObjects[index - 1];
+                }
+                if (closure->copies != NULL) {
+                    closure->copies[i] = copy;
+                }
+            }
+            break;
+        }
+        case OBJECT_INSTANCE: {
+            ObjectInstance *instance = (ObjectInstance *) object;
+            int count = readCount(reader, 1);
+            for (int i = 0; i < count && !reader->failed; i++) {
+                ObjectString *name = (ObjectString *) readObject(reader, OBJECT_STRING);
+                Value value = readValue(reader);
+                if (name != NULL) {
+                    setField(instance, name, value);
+                }
+            }
+            break;
+        }
+        case OBJECT_BOUND_METHOD:
+            ((ObjectBoundMethod *) object)->receiver = readValue(reader);
+            break;
+        default:
+            break;
+    }
+}
+
+bool readSnapshot(const char *path) {
+    Reader reader;
+    if (!openReader(&reader, path)) {
+        return false;
+    }
+
+    char magic[4];
+    readBytes(&reader, magic, sizeof(magic));
+    uint32_t version = readU32(&reader);
+    uint32_t bytecodeVersion = readU32(&reader);
+    uint32_t opcodeCount = readU32(&reader);
+    if (reader.failed || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 || version != SNAPSHOT_VERSION
+        || bytecodeVersion != BYTECODE_VERSION || opcodeCount != OP_COUNT) {
+        closeReader(&reader);
+        return false;
+    }
+
+    // 全局变量名记在全局变量表里，不会被回收
+    int globalCount = readCount(&reader, sizeof(uint32_t));
+    int *globalSlots = ALLOCATE(int, globalCount);
+    for (int i = 0; i < globalCount && !reader.failed; i++) {
+        ObjectString *name = readString(&reader);
+        if (name != NULL) {
+            push(OBJECT_VAL(name));
+            globalSlots[i] = globalSlot(name);
+            pop();
+            if (globalSlots[i] > UINT16_MAX) {
+                reader.failed = true;
+            }
+        }
+    }
+
+    // 先创建所有对象，创建好的对象都是垃圾回收的根
+    int objectCount = readCount(&reader, 1);
+    loadedObjects = ALLOCATE(Object *, objectCount);
+    loadedCount = 0;
+    for (int i = 0; i < objectCount && !reader.failed; i++) {
+        Object *object = createObject(&reader);
+        if (object == NULL) {
+            reader.failed = true;
+            break;
+        }
+        loadedObjects[loadedCount++] = object;
+    }
+    for (int i = 0; i < loadedCount && !reader.failed; i++) {
+        fillObject(&reader, loadedObjects[i], globalSlots, globalCount);
+    }
+    // 闭包指令要和嵌套函数的字节码对照，所有函数都填写好之后再检查
+    for (int i = 0; i < loadedCount && !reader.failed; i++) {
+        if (loadedObjects[i]->type == OBJECT_FUNCTION && !verifyFunction((ObjectFunction *) loadedObjects[i])) {
+            reader.failed = true;
+        }
+    }
+    for (int i = 0; i < globalCount && !reader.failed; i++) {
+        vm.globalValues.values[globalSlots[i]] = readValue(&reader);
+    }
+    bool loaded = !reader.failed && reader.position == reader.size;
+    // 填充字段时没有经过写屏障，已经晋升的对象都要进入记忆集
+    for (int i = 0; i < loadedCount; i++) {
+        writeBarrierAll(loadedObjects[i]);
+    }
+
+    FREE_ARRAY(Object *, loadedObjects, objectCount);
+    loadedObjects = NULL;
+    loadedCount = 0;
+    FREE_ARRAY(int, globalSlots, globalCount);
+    closeReader(&reader);
+    return loaded;
+}
+
+void markSnapshotRoots() {
+    for (int i = 0; i < loadedCount; i++) {
+        markUnbarriered(loadedObjects[i]);
+    }
+}
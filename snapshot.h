@@ -0,0 +1,34 @@
+#ifndef CLOX_SNAPSHOT_H
+#define CLOX_SNAPSHOT_H
+
+#include "common.h"
+
+// 堆快照文件的魔数
+#define SNAPSHOT_MAGIC "LOXI"
+// 堆快照文件的格式版本，对象的保存方式变化时增加，函数的字节码还要和 BYTECODE_VERSION 一致
+#define SNAPSHOT_VERSION 1
+
+/**
+ * 把全局变量能够到达的整个堆写入快照文件
+ * 对象按照类型排好顺序依次编号，对象之间的引用保存为编号，和地址无关
+ * 形状、内联缓存、特化的指令和机器码都不保存，加载之后重新生成
+ * 必须在脚本执行完之后调用，这时所有的上值都已经关闭
+ * @param path
+ * @return 是否写入成功，有没有绑定到全局变量的本地函数时失败
+ */
+bool writeSnapshot(const char *path);
+
+/**
+ * 把快照文件加载进刚初始化的虚拟机
+ * 先按编号创建所有对象，再填写对象之间的引用，全局变量按照名字重新分配槽位
+ * @param path
+ * @return 文件不存在、格式不对或者版本不同时返回 false
+ */
+bool readSnapshot(const char *path);
+
+/**
+ * 标记正在加载的快照中已经创建的对象
+ */
+void markSnapshotRoots();
+
+#endif //CLOX_SNAPSHOT_H
@@ -0,0 +1,1902 @@
+#include <string.h>
+
+#include "ssa.h"
+#include "debug.h"
+#include "memory.h"
+#include "vm.h"
+
+/**
+ * 推导出来的类型，从 SSA_NONE 开始只会往 SSA_ANY 的方向变化
+ * 固定类型的值直接用类型作为编号
+ */
+typedef enum {
+    SSA_NONE,               // 还没有推导出来，或者所在的代码不可达
+    SSA_NUMBER,
+    SSA_STRING,
+    SSA_BOOL,
+    SSA_NIL,
+    SSA_ANY,                // 任意类型
+    SSA_TYPE_COUNT,
+} SsaType;
+
+/**
+ * 值的种类
+ */
+typedef enum {
+    VALUE_FIXED,            // 类型在创建时就确定了
+    VALUE_ADD,              // 加法，类型取决于两个操作数
+    VALUE_PHI,              // 基本块开头合并各个前驱的值
+} ValueKind;
+
+/**
+ * SSA 形式的值，每个值只定义一次
+ */
+typedef struct {
+    ValueKind kind;
+    SsaType type;
+    int left;               // 加法的操作数
+    int right;
+    int *inputs;            // phi 的输入
+    int inputCount;
+    int inputCapacity;
+} SsaValue;
+
+/**
+ * 一条字节码指令
+ */
+typedef struct {
+    uint8_t opcode;
+    int offset;             // 字节码偏移
+    int index;              // 基线指令流下标
+    int target;             // 跳转目标的指令编号，不是跳转时为 -1
+    int depth;              // 执行之前的栈深度
+    int left;               // 二元运算的操作数，没有记录时为 -1
+    int right;
+    int first;              // 结果从哪条指令开始计算，要用到基本块之前留在栈上的值时为 -1
+    int split;              // 弹出的第二个操作数从哪条指令开始计算，弹出不到两个操作数时是自己
+    int field;              // 按照形状直接读写的字段槽位，没有时为 -1
+    int hoisted;            // 外提到循环预备块的表达式的编号，没有外提时为 -1
+} SsaCode;
+
+/**
+ * 基本块
+ */
+typedef struct {
+    int first;              // 第一条指令
+    int last;               // 最后一条指令
+    int depth;              // 入口的栈深度，-1 表示不可达
+    int successors[2];
+    int successorCount;
+    int predecessorCount;
+    int predecessor;        // 只有一个前驱时的前驱
+    bool phi;               // 入口是否需要 phi
+    bool loopHeader;        // 是否为循环回边的目标
+    int *entry;             // 入口处每个槽位的值
+} SsaBlock;
+
+/**
+ * 自然循环，除了循环头之外，循环里的基本块都只能从循环里面进入
+ */
+typedef struct {
+    int header;             // 循环头的基本块
+    bool *body;             // 每个基本块是否在循环里
+    bool innermost;         // 循环里没有别的循环头
+    int move;               // 顺序执行进循环头之前要挪到预备块里的第一条指令，-1 表示不能建立预备块
+    ObjectShape **shapes;   // 循环开头每个槽位在预备块里检查的形状，不检查的槽位为 NULL
+    int guardCount;
+    int hoistedCount;
+    int words;              // 预备块的字数，没有预备块时为 0
+    int preheader;          // 预备块中挪过去的指令之后的位置，从循环外面跳进循环头和切换指令流时从这里开始
+} SsaLoop;
+
+typedef struct {
+    ObjectFunction *function;
+    Chunk *chunk;
+
+    SsaCode *codes;
+    int codeCount;
+    int *codeAt;            // 字节码偏移到指令编号
+
+    SsaBlock *blocks;
+    int blockCount;
+    int *blockOf;           // 指令编号到基本块
+
+    SsaValue *values;
+    int valueCount;
+    int valueCapacity;
+
+    bool captured[UINT8_COUNT];     // 被闭包捕获的槽位，闭包可以随时修改它们，类型总是 SSA_ANY
+    int *stack;             // 模拟执行时每个槽位的值
+    int stackSize;
+
+    SsaLoop *loops;         // 自然循环，每个循环头最多一个
+    int loopCount;
+    int hoistedCount;       // 外提的表达式数量
+    int guardCount;         // 预备块里的形状检查数量
+} Ssa;
+
+/**
+ * 读取两个字节的跳转偏移
+ * @param chunk
+ * @param offset
+ * @return
+ */
+static int readJump(Chunk *chunk, int offset) {
+    return (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+/**
+ * 写入指令流中的处理程序
+ * @param instruction
+ * @param opcode
+ * @param handlers
+ */
+static void setOpcode(Instruction *instruction, OpCode opcode, void *const *handlers) {
+    if (handlers != NULL) {
+        instruction->handler = handlers[opcode];
+    } else {
+        instruction->opcode = opcode;
+    }
+}
+
+/**
+ * 新建值
+ * @param ssa
+ * @param kind
+ * @param type
+ * @return
+ */
+static int newValue(Ssa *ssa, ValueKind kind, SsaType type) {
+    if (ssa->valueCount >= ssa->valueCapacity) {
+        int oldCapacity = ssa->valueCapacity;
+        ssa->valueCapacity = GROW_CAPACITY(oldCapacity);
+        ssa->values = GROW_ARRAY(SsaValue, ssa->values, oldCapacity, ssa->valueCapacity);
+    }
+    SsaValue *value = &ssa->values[ssa->valueCount];
+    value->kind = kind;
+    value->type = type;
+    value->left = -1;
+    value->right = -1;
+    value->inputs = NULL;
+    value->inputCount = 0;
+    value->inputCapacity = 0;
+    return ssa->valueCount++;
+}
+
+/**
+ * 新建加法
+ * @param ssa
+ * @param left
+ * @param right
+ * @return
+ */
+static int newAdd(Ssa *ssa, int left, int right) {
+    int add = newValue(ssa, VALUE_ADD, SSA_NONE);
+    ssa->values[add].left = left;
+    ssa->values[add].right = right;
+    return add;
+}
+
+/**
+ * 为 phi 添加输入
+ * @param ssa
+ * @param phi
+ * @param input
+ */
+static void addInput(Ssa *ssa, int phi, int input) {
+    SsaValue *value = &ssa->values[phi];
+    if (value->inputCount >= value->inputCapacity) {
+        int oldCapacity = value->inputCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        value->inputs = GROW_ARRAY(int, value->inputs, oldCapacity, capacity);
+        value->inputCapacity = capacity;
+    }
+    value->inputs[value->inputCount++] = input;
+}
+
+/**
+ * 常量的类型
+ * @param value
+ * @return
+ */
+static SsaType constantType(Value value) {
+    if (IS_NUMBER(value)) {
+        return SSA_NUMBER;
+    }
+    if (IS_STRING(value)) {
+        return SSA_STRING;
+    }
+    if (IS_BOOL(value)) {
+        return SSA_BOOL;
+    }
+    if (IS_NIL(value)) {
+        return SSA_NIL;
+    }
+    return SSA_ANY;
+}
+
+/**
+ * 指令的栈效果，只用来计算栈深度
+ * @param chunk
+ * @param code
+ * @param pops
+ * @param pushes
+ * @return 不认识的指令返回 false
+ */
+static bool stackEffect(Chunk *chunk, SsaCode *code, int *pops, int *pushes) {
+    uint8_t *bytes = &chunk->code[code->offset];
+    *pops = 0;
+    *pushes = 0;
+    switch (code->opcode) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UP_VALUE:
+        case OP_GET_COPIED:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_ADD_LOCALS:
+            *pushes = 1;
+            return true;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_CLOSE_UP_VALUE:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_RETURN:
+            *pops = 1;
+            return true;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_UP_VALUE:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            return true;
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+            *pops = 1;
+            *pushes = 1;
+            return true;
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            *pops = 2;
+            *pushes = 1;
+            return true;
+        case OP_JUMP_IF_NOT_LESS:
+            // 跳转的时候还会留下比较结果，由跳转边处理
+            *pops = 2;
+            return true;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            *pops = bytes[1] + 1;
+            *pushes = 1;
+            return true;
+        case OP_INVOKE:
+        case OP_INVOKE_PROPERTY:
+        case OP_TAIL_INVOKE:
+            *pops = bytes[2] + 1;
+            *pushes = 1;
+            return true;
+        case OP_SUPER_INVOKE:
+            *pops = bytes[2] + 2;
+            *pushes = 1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * 是否为跳转指令
+ * @param opcode
+ * @return
+ */
+static bool isJump(uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_JUMP_IF_FALSE || opcode == OP_LOOP || opcode == OP_JUMP_IF_NOT_LESS;
+}
+
+/**
+ * 解码字节码，找出跳转目标和被捕获的槽位
+ * @param ssa
+ */
+static void decode(Ssa *ssa) {
+    Chunk *chunk = ssa->chunk;
+    ssa->codes = ALLOCATE(SsaCode, chunk->size);
+    ssa->codeAt = ALLOCATE(int, chunk->size + 1);
+    memset(ssa->captured, 0, sizeof(ssa->captured));
+
+    int index = 0;
+    for (int offset = 0; offset < chunk->size;) {
+        int words;
+        int length = getInstructionLength(chunk, offset, &words);
+        SsaCode *code = &ssa->codes[ssa->codeCount];
+        code->opcode = chunk->code[offset];
+        code->offset = offset;
+        code->index = index;
+        code->target = -1;
+        code->depth = -1;
+        code->left = -1;
+        code->right = -1;
+        code->first = -1;
+        code->split = -1;
+        code->field = -1;
+        code->hoisted = -1;
+        ssa->codeAt[offset] = ssa->codeCount++;
+
+        if (code->opcode == OP_CLOSURE) {
+            for (int i = 2; i < length; i += 2) {
+                if (chunk->code[offset + i] == CAPTURE_LOCAL) {
+                    ssa->captured[chunk->code[offset + i + 1]] = true;
+                }
+            }
+        }
+        index += words;
+        offset += length;
+    }
+
+    for (int i = 0; i < ssa->codeCount; i++) {
+        SsaCode *code = &ssa->codes[i];
+        if (!isJump(code->opcode)) {
+            continue;
+        }
+        int next = code->offset + 3;
+        int target = code->opcode == OP_LOOP ? next - readJump(chunk, code->offset)
+                                              : next + readJump(chunk, code->offset);
+        code->target = ssa->codeAt[target];
+    }
+}
+
+/**
+ * 划分基本块，连接前驱和后继
+ * @param ssa
+ */
+static void buildBlocks(Ssa *ssa) {
+    bool *leaders = ALLOCATE(bool, ssa->codeCount + 1);
+    memset(leaders, 0, sizeof(bool) * (ssa->codeCount + 1));
+    leaders[0] = true;
+    for (int i = 0; i < ssa->codeCount; i++) {
+        SsaCode *code = &ssa->codes[i];
+        if (isJump(code->opcode)) {
+            leaders[code->target] = true;
+            leaders[i + 1] = true;
+        } else if (code->opcode == OP_RETURN) {
+            leaders[i + 1] = true;
+        }
+    }
+
+    int count = 0;
+    for (int i = 0; i < ssa->codeCount; i++) {
+        if (leaders[i]) {
+            count++;
+        }
+    }
+    ssa->blocks = ALLOCATE(SsaBlock, count);
+    ssa->blockOf = ALLOCATE(int, ssa->codeCount);
+    for (int i = 0; i < ssa->codeCount; i++) {
+        if (leaders[i]) {
+            SsaBlock *block = &ssa->blocks[ssa->blockCount++];
+            block->first = i;
+            block->depth = -1;
+            block->successorCount = 0;
+            block->predecessorCount = 0;
+            block->predecessor = -1;
+            block->phi = false;
+            block->loopHeader = false;
+            block->entry = NULL;
+        }
+        ssa->blockOf[i] = ssa->blockCount - 1;
+        ssa->blocks[ssa->blockCount - 1].last = i;
+    }
+    FREE_ARRAY(bool, leaders, ssa->codeCount + 1);
+
+    for (int b = 0; b < ssa->blockCount; b++) {
+        SsaBlock *block = &ssa->blocks[b];
+        SsaCode *last = &ssa->codes[block->last];
+        bool fallThrough = last->opcode != OP_JUMP && last->opcode != OP_LOOP && last->opcode != OP_RETURN;
+        if (fallThrough && block->last + 1 < ssa->codeCount) {
+            block->successors[block->successorCount++] = ssa->blockOf[block->last + 1];
+        }
+        if (isJump(last->opcode)) {
+            block->successors[block->successorCount++] = ssa->blockOf[last->target];
+            if (last->opcode == OP_LOOP) {
+                ssa->blocks[ssa->blockOf[last->target]].loopHeader = true;
+            }
+        }
+    }
+}
+
+/**
+ * 跳转边上的栈深度变化，OP_JUMP_IF_NOT_LESS 跳转的时候留下比较结果
+ * @param ssa
+ * @param block
+ * @param successor
+ * @return
+ */
+static int edgeDelta(Ssa *ssa, SsaBlock *block, int successor) {
+    SsaCode *last = &ssa->codes[block->last];
+    if (last->opcode == OP_JUMP_IF_NOT_LESS && successor == 1) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * 从入口开始计算每个基本块入口的栈深度，同时找出不可达的基本块
+ * @param ssa
+ * @return 栈深度不一致或者遇到不认识的指令时返回 false
+ */
+static bool computeDepths(Ssa *ssa) {
+    int *worklist = ALLOCATE(int, ssa->blockCount);
+    int count = 0;
+    bool ok = true;
+    ssa->blocks[0].depth = ssa->function->arity + 1;
+    ssa->stackSize = ssa->blocks[0].depth + 1;
+    worklist[count++] = 0;
+
+    while (ok && count > 0) {
+        SsaBlock *block = &ssa->blocks[worklist[--count]];
+        int depth = block->depth;
+        for (int i = block->first; i <= block->last && ok; i++) {
+            int pops;
+            int pushes;
+            ok = stackEffect(ssa->chunk, &ssa->codes[i], &pops, &pushes) && depth >= pops;
+            ssa->codes[i].depth = depth;
+            depth += pushes - pops;
+            if (depth + 1 > ssa->stackSize) {
+                ssa->stackSize = depth + 1;
+            }
+        }
+        for (int i = 0; i < block->successorCount && ok; i++) {
+            SsaBlock *successor = &ssa->blocks[block->successors[i]];
+            int successorDepth = depth + edgeDelta(ssa, block, i);
+            if (successor->depth < 0) {
+                successor->depth = successorDepth;
+                worklist[count++] = block->successors[i];
+            } else if (successor->depth != successorDepth) {
+                ok = false;
+            }
+        }
+    }
+    FREE_ARRAY(int, worklist, ssa->blockCount);
+    return ok;
+}
+
+/**
+ * 读取槽位，被捕获的槽位每次都是新的任意类型的值
+ * @param ssa
+ * @param slot
+ * @return
+ */
+static int readSlot(Ssa *ssa, int slot) {
+    return ssa->captured[slot] ? SSA_ANY : ssa->stack[slot];
+}
+
+/**
+ * 模拟执行一条指令
+ * @param ssa
+ * @param code
+ * @param depth
+ * @return 执行之后的栈深度
+ */
+static int lift(Ssa *ssa, SsaCode *code, int depth) {
+    uint8_t *bytes = &ssa->chunk->code[code->offset];
+    int *stack = ssa->stack;
+    switch (code->opcode) {
+        case OP_CONSTANT:
+            stack[depth] = (int) constantType(ssa->chunk->constants.values[bytes[1]]);
+            return depth + 1;
+        case OP_NIL:
+            stack[depth] = SSA_NIL;
+            return depth + 1;
+        case OP_TRUE:
+        case OP_FALSE:
+            stack[depth] = SSA_BOOL;
+            return depth + 1;
+        case OP_GET_LOCAL:
+            stack[depth] = readSlot(ssa, bytes[1]);
+            return depth + 1;
+        case OP_SET_LOCAL:
+            stack[bytes[1]] = ssa->captured[bytes[1]] ? SSA_ANY : stack[depth - 1];
+            return depth;
+        case OP_ADD_LOCALS:
+            code->left = readSlot(ssa, bytes[1]);
+            code->right = readSlot(ssa, bytes[2]);
+            stack[depth] = newAdd(ssa, code->left, code->right);
+            return depth + 1;
+        case OP_ADD:
+            code->left = stack[depth - 2];
+            code->right = stack[depth - 1];
+            stack[depth - 2] = newAdd(ssa, code->left, code->right);
+            return depth - 1;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            // 没有报错的话结果一定是数字
+            code->left = stack[depth - 2];
+            code->right = stack[depth - 1];
+            stack[depth - 2] = SSA_NUMBER;
+            return depth - 1;
+        case OP_GREATER:
+        case OP_LESS:
+            code->left = stack[depth - 2];
+            code->right = stack[depth - 1];
+            stack[depth - 2] = SSA_BOOL;
+            return depth - 1;
+        case OP_JUMP_IF_NOT_LESS:
+            code->left = stack[depth - 2];
+            code->right = stack[depth - 1];
+            return depth - 2;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            stack[depth - 2] = SSA_BOOL;
+            return depth - 1;
+        case OP_NOT:
+            stack[depth - 1] = SSA_BOOL;
+            return depth;
+        case OP_NEGATE:
+            stack[depth - 1] = SSA_NUMBER;
+            return depth;
+        case OP_SET_PROPERTY:
+            // 赋值表达式的结果是赋的值
+            stack[depth - 2] = stack[depth - 1];
+            return depth - 1;
+        default: {
+            int pops;
+            int pushes;
+            stackEffect(ssa->chunk, code, &pops, &pushes);
+            depth -= pops;
+            for (int i = 0; i < pushes; i++) {
+                stack[depth++] = SSA_ANY;
+            }
+            return depth;
+        }
+    }
+}
+
+/**
+ * 把一条边上的值传给后继，需要 phi 的后继添加输入，否则直接作为后继入口的值
+ * @param ssa
+ * @param successor
+ * @param values
+ */
+static void passValues(Ssa *ssa, SsaBlock *successor, const int *values) {
+    for (int slot = 0; slot < successor->depth; slot++) {
+        if (successor->phi) {
+            addInput(ssa, successor->entry[slot], values[slot]);
+        } else {
+            successor->entry[slot] = values[slot];
+        }
+    }
+}
+
+/**
+ * 参数推测的类型，只推测只见过一种类型的参数
+ * @param ssa
+ * @param slot
+ * @return
+ */
+static SsaType speculateArgument(Ssa *ssa, int slot) {
+    if (slot == 0 || slot > PROFILED_ARGS || ssa->captured[slot]) {
+        return SSA_ANY;
+    }
+    switch (ssa->function->argTypes[slot - 1]) {
+        case PROFILE_NUMBER:
+            return SSA_NUMBER;
+        case PROFILE_STRING:
+            return SSA_STRING;
+        default:
+            return SSA_ANY;
+    }
+}
+
+/**
+ * 按照地址顺序提升每个基本块
+ * 只有一个在前面的前驱的基本块直接沿用前驱的值，其他可达的基本块在入口为每个槽位建立 phi
+ * @param ssa
+ */
+static void liftBlocks(Ssa *ssa) {
+    for (int b = 0; b < ssa->blockCount; b++) {
+        SsaBlock *block = &ssa->blocks[b];
+        if (block->depth < 0) {
+            continue;
+        }
+        for (int i = 0; i < block->successorCount; i++) {
+            SsaBlock *successor = &ssa->blocks[block->successors[i]];
+            successor->predecessorCount++;
+            successor->predecessor = b;
+        }
+    }
+
+    ssa->stack = ALLOCATE(int, ssa->stackSize + 1);
+    for (int b = 0; b < ssa->blockCount; b++) {
+        SsaBlock *block = &ssa->blocks[b];
+        if (block->depth < 0) {
+            continue;
+        }
+        block->phi = b == 0 ? block->predecessorCount > 0
+                            : block->predecessorCount != 1 || block->predecessor >= b;
+        block->entry = ALLOCATE(int, block->depth + 1);
+        if (block->phi) {
+            for (int slot = 0; slot < block->depth; slot++) {
+                block->entry[slot] = newValue(ssa, VALUE_PHI, SSA_NONE);
+            }
+        }
+    }
+
+    // 函数入口的参数
+    for (int slot = 0; slot < ssa->blocks[0].depth; slot++) {
+        ssa->stack[slot] = (int) speculateArgument(ssa, slot);
+    }
+    passValues(ssa, &ssa->blocks[0], ssa->stack);
+
+    for (int b = 0; b < ssa->blockCount; b++) {
+        SsaBlock *block = &ssa->blocks[b];
+        if (block->depth < 0) {
+            continue;
+        }
+        memcpy(ssa->stack, block->entry, sizeof(int) * block->depth);
+        int depth = block->depth;
+        for (int i = block->first; i <= block->last; i++) {
+            depth = lift(ssa, &ssa->codes[i], depth);
+        }
+        for (int i = 0; i < block->successorCount; i++) {
+            if (edgeDelta(ssa, block, i) > 0) {
+                ssa->stack[depth] = SSA_BOOL;
+            }
+            passValues(ssa, &ssa->blocks[block->successors[i]], ssa->stack);
+        }
+    }
+}
+
+/**
+ * 合并两个类型
+ * @param a
+ * @param b
+ * @return
+ */
+static SsaType join(SsaType a, SsaType b) {
+    if (a == SSA_NONE) {
+        return b;
+    }
+    if (b == SSA_NONE || a == b) {
+        return a;
+    }
+    return SSA_ANY;
+}
+
+/**
+ * 推导每个值的类型，直到不再变化
+ * 类型只会往 SSA_ANY 的方向变化，所以一定会停下来
+ * @param ssa
+ */
+static void inferTypes(Ssa *ssa) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = SSA_TYPE_COUNT; i < ssa->valueCount; i++) {
+            SsaValue *value = &ssa->values[i];
+            SsaType type = value->type;
+            if (value->kind == VALUE_ADD) {
+                SsaType left = ssa->values[value->left].type;
+                SsaType right = ssa->values[value->right].type;
+                if (left == SSA_NONE || right == SSA_NONE) {
+                    type = SSA_NONE;
+                } else if (left == right && (left == SSA_NUMBER || left == SSA_STRING)) {
+                    type = left;
+                } else {
+                    type = SSA_ANY;
+                }
+            } else if (value->kind == VALUE_PHI) {
+                type = SSA_NONE;
+                for (int j = 0; j < value->inputCount; j++) {
+                    type = join(type, ssa->values[value->inputs[j]].type);
+                }
+            }
+            if (type != value->type) {
+                value->type = join(value->type, type);
+                changed = true;
+            }
+        }
+    }
+}
+
+/**
+ * 指令的两个操作数是否都是某个类型
+ * @param ssa
+ * @param code
+ * @param type
+ * @return
+ */
+static bool operandsAre(Ssa *ssa, SsaCode *code, SsaType type) {
+    return code->left >= 0 && ssa->values[code->left].type == type && ssa->values[code->right].type == type;
+}
+
+/**
+ * 类型确定的运算对应的特化指令
+ * @param ssa
+ * @param code
+ * @return 不能特化时返回 OP_COUNT
+ */
+static OpCode specialize(Ssa *ssa, SsaCode *code) {
+    bool numbers = operandsAre(ssa, code, SSA_NUMBER);
+    switch (code->opcode) {
+        case OP_ADD:
+            if (numbers) {
+                return OP_ADD_NUM;
+            }
+            return operandsAre(ssa, code, SSA_STRING) ? OP_ADD_STR : OP_COUNT;
+        case OP_SUBTRACT:
+            return numbers ? OP_SUBTRACT_NUM : OP_COUNT;
+        case OP_MULTIPLY:
+            return numbers ? OP_MULTIPLY_NUM : OP_COUNT;
+        case OP_DIVIDE:
+            return numbers ? OP_DIVIDE_NUM : OP_COUNT;
+        case OP_GREATER:
+            return numbers ? OP_GREATER_NUM : OP_COUNT;
+        case OP_LESS:
+            return numbers ? OP_LESS_NUM : OP_COUNT;
+        default:
+            return OP_COUNT;
+    }
+}
+
+/**
+ * 指令在指令流中占用的字数
+ * @param ssa
+ * @param index 指令编号
+ * @return
+ */
+static int codeWords(Ssa *ssa, int index) {
+    int next = index + 1 < ssa->codeCount ? ssa->codes[index + 1].index : ssa->chunk->instructionCount;
+    return next - ssa->codes[index].index;
+}
+
+/**
+ * 是否为调用，调用可能执行任何代码
+ * @param opcode
+ * @return
+ */
+static bool isCall(uint8_t opcode) {
+    return opcode == OP_CALL || opcode == OP_TAIL_CALL || opcode == OP_INVOKE || opcode == OP_INVOKE_PROPERTY
+           || opcode == OP_TAIL_INVOKE || opcode == OP_SUPER_INVOKE;
+}
+
+/**
+ * 记录每条指令弹出的操作数从哪条指令开始计算，只在基本块内部追踪
+ * 表达式的指令是连续的，结果从 first 开始计算，到这条指令为止
+ * @param ssa
+ */
+static void findOperands(Ssa *ssa) {
+    // 栈上每个位置的值从哪条指令开始计算
+    int *starts = ALLOCATE(int, ssa->stackSize + 1);
+    for (int b = 0; b < ssa->blockCount; b++) {
+        SsaBlock *block = &ssa->blocks[b];
+        if (block->depth < 0) {
+            continue;
+        }
+        for (int slot = 0; slot < block->depth; slot++) {
+            starts[slot] = -1;
+        }
+        for (int i = block->first; i <= block->last; i++) {
+            SsaCode *code = &ssa->codes[i];
+            int pops;
+            int pushes;
+            stackEffect(ssa->chunk, code, &pops, &pushes);
+            int bottom = code->depth - pops;
+            code->first = pops > 0 ? starts[bottom] : i;
+            code->split = pops > 1 ? starts[bottom + 1] : i;
+            for (int slot = bottom; slot < code->depth; slot++) {
+                if (starts[slot] < 0) {
+                    code->first = -1;
+                }
+            }
+            if (pushes > 0) {
+                starts[bottom] = code->first;
+            }
+        }
+    }
+    FREE_ARRAY(int, starts, ssa->stackSize + 1);
+}
+
+/**
+ * 找出自然循环：从回边往回找能不经过循环头走到回边的基本块
+ * 函数入口也在里面时循环头不支配回边，不是自然循环，比如 for 循环的增量子句
+ * @param ssa
+ */
+static void findLoops(Ssa *ssa) {
+    ssa->loops = ALLOCATE(SsaLoop, ssa->blockCount);
+    for (int h = 0; h < ssa->blockCount; h++) {
+        SsaBlock *header = &ssa->blocks[h];
+        if (!header->loopHeader || header->depth < 0) {
+            continue;
+        }
+        bool *body = ALLOCATE(bool, ssa->blockCount);
+        memset(body, 0, sizeof(bool) * ssa->blockCount);
+        body[h] = true;
+        for (int b = 0; b < ssa->blockCount; b++) {
+            SsaCode *last = &ssa->codes[ssa->blocks[b].last];
+            if (ssa->blocks[b].depth >= 0 && last->opcode == OP_LOOP && last->target == header->first) {
+                body[b] = true;
+            }
+        }
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int b = 0; b < ssa->blockCount; b++) {
+                SsaBlock *block = &ssa->blocks[b];
+                if (body[b] || block->depth < 0) {
+                    continue;
+                }
+                for (int i = 0; i < block->successorCount; i++) {
+                    if (block->successors[i] != h && body[block->successors[i]]) {
+                        body[b] = true;
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+        if (h != 0 && body[0]) {
+            FREE_ARRAY(bool, body, ssa->blockCount);
+            continue;
+        }
+        SsaLoop *loop = &ssa->loops[ssa->loopCount++];
+        loop->header = h;
+        loop->body = body;
+        loop->innermost = true;
+        loop->move = -1;
+        loop->shapes = NULL;
+        loop->guardCount = 0;
+        loop->hoistedCount = 0;
+        loop->words = 0;
+        loop->preheader = -1;
+    }
+    for (int i = 0; i < ssa->loopCount; i++) {
+        for (int j = 0; j < ssa->loopCount; j++) {
+            if (i != j && ssa->loops[i].body[ssa->loops[j].header]) {
+                ssa->loops[i].innermost = false;
+            }
+        }
+    }
+}
+
+/**
+ * 有预备块的循环里包含这个基本块的那一个，这样的循环都是最内层的，互不重叠
+ * @param ssa
+ * @param block
+ * @return 没有时返回 NULL
+ */
+static SsaLoop *preheaderLoop(Ssa *ssa, int block) {
+    for (int i = 0; i < ssa->loopCount; i++) {
+        if (ssa->loops[i].words > 0 && ssa->loops[i].body[block]) {
+            return &ssa->loops[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 可以原样挪到预备块里执行的指令：不跳转，不调用，操作数里没有指令流中的位置
+ * @param opcode
+ * @return
+ */
+static bool isMovable(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UP_VALUE:
+        case OP_SET_UP_VALUE:
+        case OP_GET_COPIED:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_CLOSE_UP_VALUE:
+        case OP_ADD_LOCALS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * 预备块放在指令流后面，从循环外面跳进循环头的跳转改成跳到预备块
+ * 顺序执行进循环头的路径没有地方插入跳转，于是把循环头之前的几条指令挪到预备块开头，
+ * 原来的位置换成跳到预备块的 OP_JUMP，至少要挪出两个字
+ * @param ssa
+ * @param loop
+ * @return 挪到预备块里的第一条指令，不需要挪时是循环头的第一条指令，不能建立预备块时返回 -1
+ */
+static int findMove(Ssa *ssa, SsaLoop *loop) {
+    int first = ssa->blocks[loop->header].first;
+    if (first == 0) {
+        return -1;
+    }
+    int previous = ssa->blockOf[first - 1];
+    uint8_t opcode = ssa->codes[first - 1].opcode;
+    if (ssa->blocks[previous].depth < 0 || opcode == OP_JUMP || opcode == OP_LOOP || opcode == OP_RETURN) {
+        return first;
+    }
+    // 只有最内层的循环会被改写，挪走的指令不能在里面
+    for (int i = 0; i < ssa->loopCount; i++) {
+        if (ssa->loops[i].innermost && ssa->loops[i].body[previous]) {
+            return -1;
+        }
+    }
+    for (int i = first - 1; i >= ssa->blocks[previous].first; i--) {
+        if (!isMovable(ssa->codes[i].opcode)) {
+            return -1;
+        }
+        if (codeWords(ssa, i) >= 2) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * 结果一定是数字并且没有副作用的运算
+ * @param ssa
+ * @param code
+ * @return
+ */
+static bool isNumberArithmetic(Ssa *ssa, SsaCode *code) {
+    switch (code->opcode) {
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_LOCALS:
+            return operandsAre(ssa, code, SSA_NUMBER);
+        default:
+            return false;
+    }
+}
+
+/**
+ * 从 first 到 last 的指令是否只用数字常量和循环里不变的局部变量做数字运算
+ * @param ssa
+ * @param first
+ * @param last
+ * @param invariant 每个槽位在循环里是否不变
+ * @return
+ */
+static bool isInvariantExpression(Ssa *ssa, int first, int last, const bool *invariant) {
+    for (int i = first; i <= last; i++) {
+        SsaCode *code = &ssa->codes[i];
+        uint8_t *bytes = &ssa->chunk->code[code->offset];
+        switch (code->opcode) {
+            case OP_CONSTANT:
+                if (!IS_NUMBER(ssa->chunk->constants.values[bytes[1]])) {
+                    return false;
+                }
+                break;
+            case OP_GET_LOCAL:
+                if (!invariant[bytes[1]]) {
+                    return false;
+                }
+                break;
+            case OP_ADD_LOCALS:
+                if (!invariant[bytes[1]] || !invariant[bytes[2]] || !isNumberArithmetic(ssa, code)) {
+                    return false;
+                }
+                break;
+            default:
+                if (!isNumberArithmetic(ssa, code)) {
+                    return false;
+                }
+                break;
+        }
+    }
+    return true;
+}
+
+/**
+ * 找出循环里不变的数字表达式，外提到预备块里只算一次
+ * 从后往前找，只外提最大的表达式，里面的子表达式跟着一起外提
+ * @param ssa
+ * @param loop
+ * @param invariant
+ */
+static void hoistInvariants(Ssa *ssa, SsaLoop *loop, const bool *invariant) {
+    int covered = ssa->codeCount;
+    for (int i = ssa->codeCount - 1; i >= 0; i--) {
+        SsaCode *code = &ssa->codes[i];
+        if (i >= covered || code->depth < 0 || code->first < 0 || !loop->body[ssa->blockOf[i]]) {
+            continue;
+        }
+        if (isNumberArithmetic(ssa, code) && isInvariantExpression(ssa, code->first, i, invariant)) {
+            code->hoisted = ssa->hoistedCount++;
+            loop->hoistedCount++;
+            // 表达式本身加上 OP_SET_HOISTED
+            loop->words += code->index + codeWords(ssa, i) - ssa->codes[code->first].index + 2;
+            covered = code->first;
+        }
+    }
+}
+
+/**
+ * 属性访问处的接收者是哪个局部变量
+ * @param ssa
+ * @param index
+ * @return 接收者不是直接读取的局部变量时返回 -1
+ */
+static int receiverSlot(Ssa *ssa, int index) {
+    SsaCode *code = &ssa->codes[index];
+    switch (code->opcode) {
+        case OP_GET_LOCAL_PROPERTY:
+            return ssa->chunk->code[code->offset + 1];
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY: {
+            // 接收者只由一条 OP_GET_LOCAL 算出来
+            int next = code->opcode == OP_GET_PROPERTY ? index : code->split;
+            if (code->first >= 0 && next == code->first + 1 && ssa->codes[code->first].opcode == OP_GET_LOCAL) {
+                return ssa->chunk->code[ssa->codes[code->first].offset + 1];
+            }
+            return -1;
+        }
+        default:
+            return -1;
+    }
+}
+
+/**
+ * 属性访问处的内联缓存
+ * @param instruction
+ * @param opcode
+ * @return
+ */
+static InlineCache *propertyCache(Instruction *instruction, uint8_t opcode) {
+    return opcode == OP_GET_LOCAL_PROPERTY ? instruction[3].cache : instruction[2].cache;
+}
+
+/**
+ * 内联缓存记录的这个形状上的字段槽位，写字段时只认已有的字段
+ * @param cache
+ * @param shape
+ * @return 缓存里没有这个形状，或者这个形状上是方法或者要新增字段时返回 -1
+ */
+static int cachedField(InlineCache *cache, ObjectShape *shape) {
+    if (cache->epoch != vm.methodEpoch) {
+        return -1;
+    }
+    for (int i = 0; i < cache->count && i < INLINE_CACHE_ENTRIES; i++) {
+        InlineCacheEntry *entry = &cache->entries[i];
+        if (entry->shape == shape) {
+            return entry->method == NULL && entry->transition == NULL ? entry->slot : -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * 循环里不变的局部变量的形状在预备块里检查一次，循环里对它的属性访问直接按槽位读写字段
+ * 循环里有调用，或者写字段的接收者不是确定了形状的局部变量，或者写的不是已有的字段时，
+ * 别的实例的形状可能改变，这时不做
+ * @param ssa
+ * @param loop
+ * @param invariant
+ */
+static void trackShapes(Ssa *ssa, SsaLoop *loop, const bool *invariant) {
+    ObjectShape *shapes[UINT8_COUNT];
+    memset(shapes, 0, sizeof(shapes));
+    // 每个局部变量按照第一处只见过一个形状的属性访问确定形状
+    for (int i = 0; i < ssa->codeCount; i++) {
+        SsaCode *code = &ssa->codes[i];
+        if (code->depth < 0 || !loop->body[ssa->blockOf[i]]) {
+            continue;
+        }
+        if (isCall(code->opcode)) {
+            return;
+        }
+        int slot = receiverSlot(ssa, i);
+        if (slot < 0 || !invariant[slot] || shapes[slot] != NULL) {
+            continue;
+        }
+        InlineCache *cache = propertyCache(&ssa->chunk->instructions[code->index], code->opcode);
+        if (cache->epoch == vm.methodEpoch && cache->count == 1) {
+            shapes[slot] = cache->entries[0].shape;
+        }
+    }
+    for (int i = 0; i < ssa->codeCount; i++) {
+        SsaCode *code = &ssa->codes[i];
+        if (code->depth < 0 || !loop->body[ssa->blockOf[i]] || code->opcode != OP_SET_PROPERTY) {
+            continue;
+        }
+        int slot = receiverSlot(ssa, i);
+        if (slot < 0 || !invariant[slot] || shapes[slot] == NULL
+            || cachedField(ssa->chunk->instructions[code->index + 2].cache, shapes[slot]) < 0) {
+            return;
+        }
+    }
+
+    bool used[UINT8_COUNT];
+    memset(used, 0, sizeof(used));
+    for (int i = 0; i < ssa->codeCount; i++) {
+        SsaCode *code = &ssa->codes[i];
+        if (code->depth < 0 || !loop->body[ssa->blockOf[i]]) {
+            continue;
+        }
+        int slot = receiverSlot(ssa, i);
+        if (slot >= 0 && invariant[slot] && shapes[slot] != NULL) {
+            InlineCache *cache = propertyCache(&ssa->chunk->instructions[code->index], code->opcode);
+            code->field = cachedField(cache, shapes[slot]);
+            used[slot] |= code->field >= 0;
+        }
+    }
+    int depth = ssa->blocks[loop->header].depth;
+    for (int slot = 0; slot < depth; slot++) {
+        if (used[slot]) {
+            loop->guardCount++;
+        }
+    }
+    if (loop->guardCount == 0) {
+        return;
+    }
+    loop->shapes = ALLOCATE(ObjectShape *, depth);
+    for (int slot = 0; slot < depth; slot++) {
+        loop->shapes[slot] = used[slot] ? shapes[slot] : NULL;
+    }
+    ssa->guardCount += loop->guardCount;
+    // 每个检查占三个字
+    loop->words += loop->guardCount * 3;
+}
+
+/**
+ * 为最内层的循环建立预备块：外提不变的表达式，检查不变的局部变量的形状
+ * @param ssa
+ */
+static void planLoops(Ssa *ssa) {
+    for (int i = 0; i < ssa->loopCount; i++) {
+        SsaLoop *loop = &ssa->loops[i];
+        if (!loop->innermost) {
+            continue;
+        }
+        loop->move = findMove(ssa, loop);
+        if (loop->move < 0) {
+            continue;
+        }
+        // 循环开头就有，不被闭包捕获，循环里没有赋值的局部变量
+        SsaBlock *header = &ssa->blocks[loop->header];
+        bool invariant[UINT8_COUNT];
+        memset(invariant, 0, sizeof(invariant));
+        for (int slot = 0; slot < header->depth; slot++) {
+            invariant[slot] = !ssa->captured[slot];
+        }
+        for (int j = 0; j < ssa->codeCount; j++) {
+            SsaCode *code = &ssa->codes[j];
+            if (code->opcode == OP_SET_LOCAL && code->depth >= 0 && loop->body[ssa->blockOf[j]]) {
+                invariant[ssa->chunk->code[code->offset + 1]] = false;
+            }
+        }
+        hoistInvariants(ssa, loop, invariant);
+        trackShapes(ssa, loop, invariant);
+        if (loop->words > 0) {
+            // 挪过来的指令和最后跳回循环头的 OP_JUMP
+            loop->words += ssa->codes[header->first].index - ssa->codes[loop->move].index + 2;
+        }
+    }
+}
+
+/**
+ * 方法体是否可以内联：没有跳转、调用、上值和闭包，只在最后返回
+ * @param function
+ * @return
+ */
+static bool isInlinable(ObjectFunction *function) {
+    Chunk *chunk = &function->chunk;
+    if (function->upValueCount != 0 || chunk->instructions == NULL || chunk->instructionCount > SSA_INLINE_WORDS) {
+        return false;
+    }
+    for (int offset = 0; offset < chunk->size;) {
+        int length = getInstructionLength(chunk, offset, NULL);
+        switch (chunk->code[offset]) {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_POP:
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_GET_LOCAL_PROPERTY:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_ADD_LOCALS:
+            case OP_PRINT:
+                break;
+            case OP_RETURN:
+                if (offset + length != chunk->size) {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+        offset += length;
+    }
+    return chunk->size > 0 && chunk->code[chunk->size - 1] == OP_RETURN;
+}
+
+/**
+ * 调用处的被调用者直接读取自全局变量时，这个全局变量现在的闭包
+ * @param ssa
+ * @param index
+ * @return 被调用者不是直接读取的全局变量，或者全局变量不是闭包时返回 NULL
+ */
+static ObjectClosure *calledGlobal(Ssa *ssa, int index) {
+    SsaCode *code = &ssa->codes[index];
+    int argCount = ssa->chunk->code[code->offset + 1];
+    int next = argCount == 0 ? index : code->split;
+    if (code->first < 0 || next != code->first + 1 || ssa->codes[code->first].opcode != OP_GET_GLOBAL) {
+        return NULL;
+    }
+    uint8_t *bytes = &ssa->chunk->code[ssa->codes[code->first].offset];
+    Value value = vm.globalValues.values[(bytes[1] << 8) | bytes[2]];
+    return IS_CLOSURE(value) ? AS_CLOSURE(value) : NULL;
+}
+
+/**
+ * 调用处可以内联的方法或者函数
+ * 方法调用要求内联缓存是单态的并且在当前的方法表版本下有效，由接收者的形状保证调用的还是这个方法
+ * 函数调用要求被调用者直接读取自全局变量，按照全局变量现在的闭包内联，由闭包检查保证调用的还是这个函数
+ * @param ssa
+ * @param code
+ * @return 不能内联时返回 NULL
+ */
+static ObjectClosure *inlineCandidate(Ssa *ssa, SsaCode *code) {
+    if (code->depth < 0) {
+        return NULL;
+    }
+    ObjectClosure *method;
+    int argCount;
+    if (code->opcode == OP_INVOKE) {
+        InlineCache *cache = ssa->chunk->instructions[code->index + 3].cache;
+        if (cache->epoch != vm.methodEpoch || cache->count != 1 || cache->entries[0].method == NULL) {
+            return NULL;
+        }
+        method = cache->entries[0].method;
+        argCount = ssa->chunk->code[code->offset + 2];
+    } else if (code->opcode == OP_CALL) {
+        method = calledGlobal(ssa, (int) (code - ssa->codes));
+        argCount = ssa->chunk->code[code->offset + 1];
+    } else {
+        return NULL;
+    }
+    if (method == NULL || method->function->arity != argCount || !isInlinable(method->function)) {
+        return NULL;
+    }
+    return method;
+}
+
+/**
+ * 改写成按槽位读写字段，字段槽位放在原来名字的位置，后面的内联缓存不再使用
+ * @param instruction
+ * @param opcode 原来的属性访问指令
+ * @param field
+ * @param handlers
+ */
+static void rewriteField(Instruction *instruction, uint8_t opcode, int field, void *const *handlers) {
+    switch (opcode) {
+        case OP_GET_LOCAL_PROPERTY:
+            setOpcode(instruction, OP_GET_LOCAL_FIELD, handlers);
+            instruction[2].operand = field;
+            break;
+        case OP_GET_PROPERTY:
+            setOpcode(instruction, OP_GET_FIELD, handlers);
+            instruction[1].operand = field;
+            break;
+        default:
+            setOpcode(instruction, OP_SET_FIELD, handlers);
+            instruction[1].operand = field;
+            break;
+    }
+}
+
+/**
+ * 复制内联的方法体，局部变量的槽位加上接收者在调用者栈帧中的位置，最后的返回换成 OP_INLINE_RETURN
+ * 调用处已经检查过接收者的形状，方法体里 this 的属性访问直接按槽位读写字段，
+ * 直到遇到可能改变形状的写字段为止
+ * @param method
+ * @param body
+ * @param base
+ * @param continuation
+ * @param shape 接收者的形状，内联的是函数时为 NULL
+ * @param handlers
+ * @param fields 是否有按槽位读写的字段
+ * @return 写入的字数
+ */
+static int copyBody(ObjectClosure *method, Instruction *body, int base, Instruction *continuation,
+                    ObjectShape *shape, void *const *handlers, bool *fields) {
+    Chunk *chunk = &method->function->chunk;
+    // 最后的 OP_RETURN 只占一个字
+    int count = chunk->instructionCount - 1;
+    memcpy(body, chunk->instructions, sizeof(Instruction) * count);
+
+    // 栈上每个位置的值是不是直接读取的 this
+    bool receivers[UINT8_COUNT + SSA_INLINE_WORDS];
+    memset(receivers, 0, sizeof(receivers));
+    int depth = method->function->arity + 1;
+    bool known = shape != NULL;
+    *fields = false;
+    int index = 0;
+    for (int offset = 0; offset < chunk->size;) {
+        int words;
+        int length = getInstructionLength(chunk, offset, &words);
+        uint8_t *bytes = &chunk->code[offset];
+        Instruction *instruction = &body[index];
+        bool receiver = false;
+        int field = -1;
+        switch (bytes[0]) {
+            case OP_GET_LOCAL:
+                receiver = bytes[1] == 0;
+                instruction[1].operand += base;
+                break;
+            case OP_SET_LOCAL:
+                known = known && bytes[1] != 0;
+                instruction[1].operand += base;
+                break;
+            case OP_GET_LOCAL_PROPERTY:
+                instruction[1].operand += base;
+                if (known && bytes[1] == 0) {
+                    field = cachedField(instruction[3].cache, shape);
+                }
+                break;
+            case OP_GET_PROPERTY:
+                if (known && receivers[depth - 1]) {
+                    field = cachedField(instruction[2].cache, shape);
+                }
+                break;
+            case OP_SET_PROPERTY:
+                if (known && receivers[depth - 2]) {
+                    field = cachedField(instruction[2].cache, shape);
+                }
+                known = field >= 0;
+                break;
+            case OP_ADD_LOCALS:
+                instruction[1].operand += base;
+                instruction[2].operand += base;
+                break;
+            default:
+                break;
+        }
+        if (field >= 0) {
+            rewriteField(instruction, bytes[0], field, handlers);
+            *fields = true;
+        }
+
+        SsaCode code = {.opcode = bytes[0], .offset = offset};
+        int pops;
+        int pushes;
+        stackEffect(chunk, &code, &pops, &pushes);
+        depth -= pops;
+        if (pushes > 0) {
+            receivers[depth++] = receiver;
+        }
+        index += words;
+        offset += length;
+    }
+    setOpcode(&body[count], OP_INLINE_RETURN, handlers);
+    body[count + 1].operand = base;
+    body[count + 2].target = continuation;
+    return count + 3;
+}
+
+/**
+ * 记录优化代码用到的形状，GC 时标记
+ * @param ssa
+ * @param optimized
+ * @param shape
+ */
+static void addShape(Ssa *ssa, OptimizedCode *optimized, ObjectShape *shape) {
+    for (int i = 0; i < optimized->shapeCount; i++) {
+        if (optimized->shapes[i] == NULL) {
+            optimized->shapes[i] = shape;
+            writeBarrierObject((Object *) ssa->function, (Object *) shape);
+            return;
+        }
+    }
+}
+
+/**
+ * 生成循环的预备块：挪过来的指令、外提的表达式、形状检查，最后跳回循环头
+ * 外提的表达式和形状检查在 sites 里对应循环头，检查失败时从基线指令流的循环头重新执行
+ * @param ssa
+ * @param loop
+ * @param optimized
+ * @param next 预备块开始的位置
+ * @param handlers
+ */
+static void emitPreheader(Ssa *ssa, SsaLoop *loop, OptimizedCode *optimized, Instruction *next,
+                          void *const *handlers) {
+    Instruction *instructions = optimized->instructions;
+    SsaBlock *header = &ssa->blocks[loop->header];
+    int headerIndex = ssa->codes[header->first].index;
+
+    // 顺序执行进循环头之前的几条指令，原来的位置改成跳到这里
+    int moveIndex = ssa->codes[loop->move].index;
+    if (moveIndex < headerIndex) {
+        memcpy(next, instructions + moveIndex, sizeof(Instruction) * (headerIndex - moveIndex));
+        setOpcode(&instructions[moveIndex], OP_JUMP, handlers);
+        instructions[moveIndex + 1].target = next;
+        for (int i = moveIndex; i < headerIndex; i++) {
+            optimized->sites[next - instructions] = i;
+            next++;
+        }
+    }
+
+    for (int i = 0; i < ssa->codeCount; i++) {
+        SsaCode *code = &ssa->codes[i];
+        if (code->hoisted < 0 || !loop->body[ssa->blockOf[i]]) {
+            continue;
+        }
+        int start = ssa->codes[code->first].index;
+        int end = code->index + codeWords(ssa, i);
+        memcpy(next, instructions + start, sizeof(Instruction) * (end - start));
+        for (int j = start; j < end; j++) {
+            optimized->sites[next - instructions] = j;
+            next++;
+        }
+        setOpcode(next, OP_SET_HOISTED, handlers);
+        next[1].hoisted = &optimized->hoisted[code->hoisted];
+        optimized->sites[next - instructions] = headerIndex;
+        optimized->sites[next + 1 - instructions] = headerIndex;
+        next += 2;
+    }
+
+    Instruction *guards = next;
+    if (loop->shapes != NULL) {
+        for (int slot = 0; slot < header->depth; slot++) {
+            if (loop->shapes[slot] != NULL) {
+                setOpcode(next, OP_GUARD_SHAPE, handlers);
+                next[1].operand = slot;
+                next[2].shape = loop->shapes[slot];
+                addShape(ssa, optimized, loop->shapes[slot]);
+                next += 3;
+            }
+        }
+    }
+    setOpcode(next, OP_JUMP, handlers);
+    next[1].target = instructions + headerIndex;
+    next += 2;
+    for (Instruction *word = guards; word < next; word++) {
+        optimized->sites[word - instructions] = headerIndex;
+    }
+
+    // 从循环外面跳进循环头的跳转改成跳到预备块
+    for (int i = 0; i < ssa->codeCount; i++) {
+        SsaCode *code = &ssa->codes[i];
+        if (code->target == header->first && code->depth >= 0 && !loop->body[ssa->blockOf[i]]) {
+            instructions[code->index + 1].target = instructions + loop->preheader;
+        }
+    }
+}
+
+/**
+ * 生成优化后的指令流
+ * @param ssa
+ * @param handlers
+ * @param cold 是否有还没有执行过的方法调用处
+ * @return 没有可以优化的地方，或者生成过程中方法表发生了变化时返回 NULL
+ */
+static OptimizedCode *emit(Ssa *ssa, void *const *handlers, bool *cold) {
+    // 分配内存可能触发 GC，GC 释放形状时方法表版本会变化，这时缓存里的方法和形状可能已经被释放了
+    uint32_t epoch = vm.methodEpoch;
+    Chunk *chunk = ssa->chunk;
+    planLoops(ssa);
+
+    int specialized = 0;
+    int callCount = 0;
+    int fieldCount = 0;
+    int guardCount = 0;
+    int bodyWords = 0;
+    int loopCount = 0;
+    int extraStack = 0;
+    for (int i = 0; i < ssa->codeCount; i++) {
+        SsaCode *code = &ssa->codes[i];
+        if (code->depth < 0) {
+            continue;
+        }
+        if (specialize(ssa, code) != OP_COUNT) {
+            specialized++;
+        }
+        if (code->field >= 0) {
+            fieldCount++;
+        }
+        if (code->opcode == OP_INVOKE) {
+            InlineCache *cache = chunk->instructions[code->index + 3].cache;
+            if (cache->count == 0 || cache->epoch != vm.methodEpoch) {
+                *cold = true;
+            }
+        }
+        ObjectClosure *method = inlineCandidate(ssa, code);
+        if (method != NULL) {
+            int words = method->function->chunk.instructionCount + 2;
+            callCount++;
+            bodyWords += words;
+            if (words > extraStack) {
+                extraStack = words;
+            }
+        }
+    }
+    if (specialized == 0 && callCount == 0 && fieldCount == 0 && ssa->hoistedCount == 0) {
+        return NULL;
+    }
+    for (int slot = 1; slot < ssa->blocks[0].depth; slot++) {
+        if (speculateArgument(ssa, slot) != SSA_ANY) {
+            guardCount++;
+        }
+    }
+    // 预备块放在内联的方法体后面
+    int preheaders = chunk->instructionCount + bodyWords;
+    int position = preheaders;
+    for (int i = 0; i < ssa->loopCount; i++) {
+        SsaLoop *loop = &ssa->loops[i];
+        if (loop->words > 0) {
+            loop->preheader = position + ssa->codes[ssa->blocks[loop->header].first].index
+                              - ssa->codes[loop->move].index;
+            position += loop->words;
+        }
+    }
+    for (int b = 0; b < ssa->blockCount; b++) {
+        SsaLoop *loop = preheaderLoop(ssa, b);
+        // 从循环中间切换进来会跳过预备块
+        if (ssa->blocks[b].loopHeader && ssa->blocks[b].depth >= 0 && (loop == NULL || loop->header == b)) {
+            loopCount++;
+        }
+    }
+
+    int prologue = guardCount > 0 ? guardCount * 2 + 2 : 0;
+    int count = position + prologue;
+    OptimizedCode *optimized = ALLOCATE(OptimizedCode, 1);
+    optimized->instructions = NULL;
+    optimized->count = 0;
+    optimized->sites = NULL;
+    optimized->loops = NULL;
+    optimized->loopCount = 0;
+    optimized->calls = NULL;
+    optimized->callCount = 0;
+    optimized->hoisted = NULL;
+    optimized->hoistedCount = 0;
+    optimized->shapes = NULL;
+    optimized->shapeCount = 0;
+    optimized->previous = NULL;
+    optimized->instructions = ALLOCATE(Instruction, count);
+    optimized->count = count;
+    optimized->sites = ALLOCATE(int, count);
+    optimized->calls = ALLOCATE(InlinedCall, callCount);
+    optimized->callCount = callCount;
+    optimized->hoisted = ALLOCATE(HoistedValue, ssa->hoistedCount);
+    optimized->hoistedCount = ssa->hoistedCount;
+    optimized->shapes = ALLOCATE(ObjectShape *, ssa->guardCount + callCount);
+    optimized->shapeCount = ssa->guardCount + callCount;
+    optimized->loops = ALLOCATE(LoopEntry, loopCount);
+    optimized->extraStack = extraStack;
+    optimized->deopts = 0;
+    for (int i = 0; i < optimized->hoistedCount; i++) {
+        optimized->hoisted[i].value = NIL_VAL;
+        optimized->hoisted[i].frame = -1;
+    }
+    for (int i = 0; i < optimized->shapeCount; i++) {
+        optimized->shapes[i] = NULL;
+    }
+    for (int b = 0; b < ssa->blockCount; b++) {
+        SsaBlock *block = &ssa->blocks[b];
+        SsaLoop *loop = preheaderLoop(ssa, b);
+        if (block->loopHeader && block->depth >= 0 && (loop == NULL || loop->header == b)) {
+            LoopEntry *entry = &optimized->loops[optimized->loopCount];
+            entry->index = ssa->codes[block->first].index;
+            entry->entry = loop != NULL ? loop->preheader : entry->index;
+            entry->depth = block->depth;
+            entry->types = ALLOCATE(uint8_t, block->depth);
+            optimized->loopCount++;
+            for (int slot = 0; slot < block->depth; slot++) {
+                entry->types[slot] = (uint8_t) ssa->values[block->entry[slot]].type;
+            }
+        }
+    }
+    if (epoch != vm.methodEpoch) {
+        freeOptimizedCode(optimized);
+        return NULL;
+    }
+
+    // 和基线指令流对应的部分，跳转目标重新指向优化后的指令流
+    Instruction *instructions = optimized->instructions;
+    memcpy(instructions, chunk->instructions, sizeof(Instruction) * chunk->instructionCount);
+    for (int i = 0; i < chunk->instructionCount; i++) {
+        optimized->sites[i] = i;
+    }
+    Instruction *next = instructions + chunk->instructionCount;
+    InlinedCall *inlined = optimized->calls;
+    for (int i = 0; i < ssa->codeCount; i++) {
+        SsaCode *code = &ssa->codes[i];
+        if (code->target >= 0) {
+            instructions[code->index + 1].target = instructions + ssa->codes[code->target].index;
+        }
+        if (code->depth < 0) {
+            continue;
+        }
+        if (code->opcode == OP_LOOP && !(*cold && ssa->function->optimizeCount < SSA_MAX_ATTEMPTS)) {
+            // 不会再重新优化的时候，回边不再需要统计热度和切换版本
+            setOpcode(&instructions[code->index], OP_JUMP, handlers);
+        }
+        OpCode opcode = specialize(ssa, code);
+        if (opcode != OP_COUNT) {
+            setOpcode(&instructions[code->index], opcode, handlers);
+        }
+        if (code->field >= 0) {
+            rewriteField(&instructions[code->index], code->opcode, code->field, handlers);
+        }
+
+        ObjectClosure *method = inlineCandidate(ssa, code);
+        if (method != NULL) {
+            bool invoke = code->opcode == OP_INVOKE;
+            InlineCache *cache = invoke ? instructions[code->index + 3].cache : NULL;
+            inlined->name = invoke ? instructions[code->index + 1].string : NULL;
+            inlined->method = method;
+            writeBarrierObject((Object *) ssa->function, (Object *) method);
+            inlined->shape = invoke ? cache->entries[0].shape : NULL;
+            inlined->epoch = epoch;
+            inlined->cache = cache;
+            inlined->body = next;
+
+            int argCount = chunk->code[code->offset + (invoke ? 2 : 1)];
+            int base = code->depth - argCount - 1;
+            int words = copyBody(method, next, base, instructions + code->index + codeWords(ssa, i),
+                                 inlined->shape, handlers, &inlined->fields);
+            if (inlined->fields) {
+                addShape(ssa, optimized, inlined->shape);
+            }
+            for (int j = 0; j < words; j++) {
+                optimized->sites[next - instructions + j] = code->index;
+            }
+            next += words;
+            setOpcode(&instructions[code->index], invoke ? OP_INVOKE_INLINE : OP_CALL_INLINE, handlers);
+            instructions[code->index + 1].inlined = inlined++;
+        }
+    }
+
+    // 预备块从改写之后的指令复制表达式，复制完再把循环里的表达式换成读取外提的值
+    for (int i = 0; i < ssa->loopCount; i++) {
+        SsaLoop *loop = &ssa->loops[i];
+        if (loop->words > 0) {
+            emitPreheader(ssa, loop, optimized, next, handlers);
+            next += loop->words;
+        }
+    }
+    for (int i = 0; i < ssa->codeCount; i++) {
+        SsaCode *code = &ssa->codes[i];
+        if (code->hoisted >= 0) {
+            Instruction *load = instructions + ssa->codes[code->first].index;
+            setOpcode(load, OP_GET_HOISTED, handlers);
+            load[1].hoisted = &optimized->hoisted[code->hoisted];
+            load[2].target = instructions + code->index + codeWords(ssa, i);
+        }
+    }
+
+    // 入口检查推测的参数类型，都符合时跳到优化后的指令流开头
+    optimized->entry = instructions;
+    if (guardCount > 0) {
+        optimized->entry = next;
+        for (int slot = 1; slot < ssa->blocks[0].depth; slot++) {
+            SsaType type = speculateArgument(ssa, slot);
+            if (type != SSA_ANY) {
+                setOpcode(next, type == SSA_NUMBER ? OP_GUARD_NUMBER : OP_GUARD_STRING, handlers);
+                next[1].operand = slot;
+                next += 2;
+            }
+        }
+        setOpcode(next, OP_JUMP, handlers);
+        next[1].target = instructions;
+        next += 2;
+        for (Instruction *word = optimized->entry; word < next; word++) {
+            optimized->sites[word - instructions] = 0;
+        }
+    }
+    dbg("SSA Optimize [%d] Specialized, [%d] Inlined, [%d] Guards, [%d] Hoisted, [%d] Fields",
+        specialized, callCount, guardCount + ssa->guardCount, ssa->hoistedCount, fieldCount);
+    return optimized;
+}
+
+/**
+ * 释放分析过程中用到的内存
+ * @param ssa
+ */
+static void freeSsa(Ssa *ssa) {
+    for (int i = 0; i < ssa->valueCount; i++) {
+        FREE_ARRAY(int, ssa->values[i].inputs, ssa->values[i].inputCapacity);
+    }
+    FREE_ARRAY(SsaValue, ssa->values, ssa->valueCapacity);
+    for (int b = 0; b < ssa->blockCount; b++) {
+        if (ssa->blocks[b].entry != NULL) {
+            FREE_ARRAY(int, ssa->blocks[b].entry, ssa->blocks[b].depth + 1);
+        }
+    }
+    for (int i = 0; i < ssa->loopCount; i++) {
+        FREE_ARRAY(bool, ssa->loops[i].body, ssa->blockCount);
+        if (ssa->loops[i].shapes != NULL) {
+            FREE_ARRAY(ObjectShape *, ssa->loops[i].shapes, ssa->blocks[ssa->loops[i].header].depth);
+        }
+    }
+    if (ssa->loops != NULL) {
+        FREE_ARRAY(SsaLoop, ssa->loops, ssa->blockCount);
+    }
+    FREE_ARRAY(SsaBlock, ssa->blocks, ssa->blockCount);
+    FREE_ARRAY(int, ssa->blockOf, ssa->codeCount);
+    if (ssa->stack != NULL) {
+        FREE_ARRAY(int, ssa->stack, ssa->stackSize + 1);
+    }
+    FREE_ARRAY(int, ssa->codeAt, ssa->chunk->size + 1);
+    FREE_ARRAY(SsaCode, ssa->codes, ssa->chunk->size);
+}
+
+void ssaOptimize(ObjectFunction *function, void *const *handlers) {
+    Chunk *chunk = &function->chunk;
+    if (chunk->instructions == NULL || chunk->size == 0 || function->optimizeCount >= SSA_MAX_ATTEMPTS
+        || (chunk->optimized != NULL && chunk->optimized->entry == NULL)) {
+        return;
+    }
+    function->optimizeCount++;
+
+    Ssa ssa;
+    memset(&ssa, 0, sizeof(Ssa));
+    ssa.function = function;
+    ssa.chunk = chunk;
+    decode(&ssa);
+    buildBlocks(&ssa);
+    if (computeDepths(&ssa)) {
+        // 固定类型的值直接用类型作为编号
+        for (int type = 0; type < SSA_TYPE_COUNT; type++) {
+            newValue(&ssa, VALUE_FIXED, (SsaType) type);
+        }
+        liftBlocks(&ssa);
+        inferTypes(&ssa);
+        findOperands(&ssa);
+        findLoops(&ssa);
+        bool cold = false;
+        OptimizedCode *optimized = emit(&ssa, handlers, &cold);
+        if (optimized != NULL) {
+            optimized->previous = chunk->optimized;
+            chunk->optimized = optimized;
+            chunk->entry = optimized->entry;
+            // 旧版本可能还有栈帧在执行，栈帧大小只增不减
+            if (chunk->instructionCount + optimized->extraStack > chunk->frameSize) {
+                chunk->frameSize = chunk->instructionCount + optimized->extraStack;
+            }
+        }
+        // 等这些调用处执行过之后再优化一次
+        if (cold && function->optimizeCount < SSA_MAX_ATTEMPTS) {
+            function->hotness = 0;
+        }
+    }
+    freeSsa(&ssa);
+}
+
+/**
+ * 槽位上的值是否符合推导出来的类型
+ * @param type
+ * @param value
+ * @return
+ */
+static bool matchType(SsaType type, Value value) {
+    switch (type) {
+        case SSA_NUMBER:
+            return IS_NUMBER(value);
+        case SSA_STRING:
+            return IS_STRING(value);
+        case SSA_BOOL:
+            return IS_BOOL(value);
+        case SSA_NIL:
+            return IS_NIL(value);
+        default:
+            return true;
+    }
+}
+
+Instruction *ssaEnterLoop(Chunk *chunk, Instruction *ip, Value *slots) {
+    OptimizedCode *optimized = chunk->optimized;
+    if ((uintptr_t) ip - (uintptr_t) optimized->instructions < (uintptr_t) optimized->count * sizeof(Instruction)) {
+        return NULL;
+    }
+    int index = getInstructionIndex(chunk, ip);
+    for (int i = 0; i < optimized->loopCount; i++) {
+        LoopEntry *loop = &optimized->loops[i];
+        if (loop->index != index) {
+            continue;
+        }
+        for (int slot = 0; slot < loop->depth; slot++) {
+            if (!matchType((SsaType) loop->types[slot], slots[slot])) {
+                ssaDeoptimize(chunk);
+                return NULL;
+            }
+        }
+        return optimized->instructions + loop->entry;
+    }
+    return NULL;
+}
+
+void ssaDeoptimize(Chunk *chunk) {
+    OptimizedCode *optimized = chunk->optimized;
+    if (++optimized->deopts >= SSA_DEOPT_LIMIT) {
+        dbg("SSA Code Retired After [%d] Deopts", optimized->deopts);
+        optimized->entry = NULL;
+        chunk->entry = chunk->instructions;
+    }
+}
+
+Instruction *ssaInlinedInstruction(Chunk *chunk, Instruction *instruction, ObjectFunction **function) {
+    for (OptimizedCode *code = chunk->optimized; code != NULL; code = code->previous) {
+        for (int i = 0; i < code->callCount; i++) {
+            InlinedCall *inlined = &code->calls[i];
+            Chunk *body = &inlined->method->function->chunk;
+            // 最后的 OP_INLINE_RETURN 对应原来的 OP_RETURN
+            uintptr_t distance = (uintptr_t) instruction - (uintptr_t) inlined->body;
+            if (distance < (uintptr_t) body->instructionCount * sizeof(Instruction)) {
+                *function = inlined->method->function;
+                return body->instructions + distance / sizeof(Instruction);
+            }
+        }
+    }
+    return NULL;
+}
+
+void freeOptimizedCode(OptimizedCode *code) {
+    if (code == NULL) {
+        return;
+    }
+    for (int i = 0; i < code->loopCount; i++) {
+        FREE_ARRAY(uint8_t, code->loops[i].types, code->loops[i].depth);
+    }
+    FREE_ARRAY(LoopEntry, code->loops, code->loopCount);
+    FREE_ARRAY(InlinedCall, code->calls, code->callCount);
+    FREE_ARRAY(HoistedValue, code->hoisted, code->hoistedCount);
+    FREE_ARRAY(ObjectShape *, code->shapes, code->shapeCount);
+    FREE_ARRAY(Instruction, code->instructions, code->count);
+    FREE_ARRAY(int, code->sites, code->count);
+    freeOptimizedCode(code->previous);
+    FREE(OptimizedCode, code);
+}
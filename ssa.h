@@ -0,0 +1,63 @@
+#ifndef CLOX_SSA_H
+#define CLOX_SSA_H
+
+#include "common.h"
+#include "object.h"
+
+// 函数调用和循环回边的次数达到这个值时用 SSA 优化层重新编译
+#define SSA_THRESHOLD 500
+// 方法体在指令流中不超过这么多个字时才内联
+#define SSA_INLINE_WORDS 48
+// 退回基线指令流的次数超过这个值时优化代码作废
+#define SSA_DEOPT_LIMIT 16
+// 有方法调用处的内联缓存还是空的时候，函数再次变热会重新优化，最多优化这么多次
+#define SSA_MAX_ATTEMPTS 3
+
+/**
+ * 用 SSA 优化层重新编译热点函数
+ * 把基线指令流提升成 SSA 形式的值，推导每个值的类型，参数类型按照调用时记录的类型推测，
+ * 生成和基线指令流布局相同的优化指令流：类型确定的运算直接使用特化的指令，
+ * 单态的小方法和直接读取自全局变量的小函数在调用处内联，分别检查接收者的形状和被调用的闭包，
+ * 最内层的循环建立预备块：不变的数字表达式外提到预备块里只算一次，
+ * 不变的局部变量的形状在预备块里检查一次，之后对它的属性访问直接按槽位读写字段，
+ * 推测的参数类型在入口检查，检查失败时退回基线指令流
+ * 没有可以优化的地方时不生成优化代码
+ * 有方法调用处还没有执行过时，之后再次变热会重新优化，新的版本替换旧的版本，旧的版本保留到函数释放
+ * 没有做的优化：只追踪局部变量的形状，循环里有调用或者会增加字段时不追踪，外提只针对数字运算
+ * @param function
+ * @param handlers 每个字节码的处理程序地址，为 NULL 时指令流中存放字节码本身
+ */
+void ssaOptimize(ObjectFunction *function, void *const *handlers);
+
+/**
+ * 循环回边处尝试切换到最新的优化后的指令流
+ * 槽位上的值都符合循环开头推导出来的类型时才能切换，不符合时记一次退回
+ * @param chunk 必须已经有没有作废的优化代码
+ * @param ip 基线指令流或者旧版本的优化后的指令流中循环开头的位置
+ * @param slots 栈帧的槽位
+ * @return 优化后的指令流中对应的位置，不能切换时返回 NULL
+ */
+Instruction *ssaEnterLoop(Chunk *chunk, Instruction *ip, Value *slots);
+
+/**
+ * 记一次退回基线指令流，次数太多时优化代码作废，之后的调用和循环都不再进入
+ * @param chunk
+ */
+void ssaDeoptimize(Chunk *chunk);
+
+/**
+ * 优化后的指令流中的位置是否在内联的函数体里，报告运行时错误时用来补上内联的函数
+ * @param chunk
+ * @param instruction 位置可以在任何一个版本中
+ * @param function 返回内联的函数
+ * @return 内联的函数的基线指令流中对应的位置，不在内联的函数体里时返回 NULL
+ */
+Instruction *ssaInlinedInstruction(Chunk *chunk, Instruction *instruction, ObjectFunction **function);
+
+/**
+ * 释放优化代码
+ * @param code
+ */
+void freeOptimizedCode(OptimizedCode *code);
+
+#endif //CLOX_SSA_H
@@ -0,0 +1,164 @@
+#include "sweeper.h"
+#include "heap.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef BACKGROUND_SWEEP
+
+#include <pthread.h>
+
+static pthread_t thread;
+static bool started = false;
+static bool stopping = false;
+
+// 交给后台线程和等待它结束
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCondition = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCondition = PTHREAD_COND_INITIALIZER;
+static Page *pending[HEAP_CLASSES];    // 交给后台线程的页，每个类别一个链表
+static bool hasPending = false;
+static bool finished = false;           // 后台线程写完结果之后设置
+static bool running = false;            // 有交出去还没有收回结果的清除，只由程序的线程读写
+
+// 清除的结果，后台线程设置 finished 之前写好
+static SweptPages swept;
+static size_t freedBytes = 0;
+static bool freedShape = false;
+
+/**
+ * 释放死掉的对象，只在后台线程执行
+ * @param object
+ */
+static void releaseInBackground(Object *object) {
+    freedShape = freedShape || object->type == OBJECT_SHAPE;
+    freeObjectInBackground(object, &freedBytes);
+}
+
+/**
+ * 按顺序清除交过来的页，没有对象的页直接还给系统，只在后台线程执行
+ * 字符串的页不在里面：字符串还在常量池里，程序的线程随时可能查找并读取它们
+ */
+static void sweepPages() {
+    freedBytes = 0;
+    freedShape = false;
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        Page *page = pending[i];
+        pending[i] = NULL;
+        while (page != NULL) {
+            Page *next = page->next;
+            if (sweepPage(page, releaseInBackground)) {
+                addSweptPage(&swept, page);
+            } else {
+                freePage(page);
+            }
+            page = next;
+        }
+    }
+}
+
+static void *sweeperThread(void *arg) {
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!hasPending && !stopping) {
+            pthread_cond_wait(&workCondition, &lock);
+        }
+        if (!hasPending) {
+            break;
+        }
+        hasPending = false;
+        pthread_mutex_unlock(&lock);
+
+        sweepPages();
+
+        pthread_mutex_lock(&lock);
+        __atomic_store_n(&finished, true, __ATOMIC_RELEASE);
+        pthread_cond_signal(&doneCondition);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * 收回后台清除的结果
+ * 清除完的页每个类别一次接回堆；释放的字节数一次从统计里减去；
+ * 释放过形状时让内联缓存失效，在这之前缓存里的形状不会被复用，因为新建形状时缓存也会失效
+ */
+static void collectResults() {
+    running = false;
+    returnSweptPages(&swept);
+    addBytesAllocated(-freedBytes);
+    if (freedShape) {
+        invalidateInlineCaches();
+    }
+}
+
+void sweepInBackground() {
+    if (!started) {
+        if (pthread_create(&thread, NULL, sweeperThread, NULL) != 0) {
+            return;
+        }
+        started = true;
+    }
+    pthread_mutex_lock(&lock);
+    if (takeObjectPages(pending)) {
+        hasPending = true;
+        finished = false;
+        running = true;
+        pthread_cond_signal(&workCondition);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+bool backgroundSweepDone() {
+    if (!running) {
+        return true;
+    }
+    if (!__atomic_load_n(&finished, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    collectResults();
+    return true;
+}
+
+void waitBackgroundSweep() {
+    if (!running) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    while (!__atomic_load_n(&finished, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&doneCondition, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    collectResults();
+}
+
+void freeSweeper() {
+    waitBackgroundSweep();
+    if (!started) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&workCondition);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    started = false;
+    stopping = false;
+}
+
+#else
+
+void sweepInBackground() {
+}
+
+bool backgroundSweepDone() {
+    return true;
+}
+
+void waitBackgroundSweep() {
+}
+
+void freeSweeper() {
+}
+
+#endif
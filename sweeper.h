@@ -0,0 +1,32 @@
+#ifndef CLOX_SWEEPER_H
+#define CLOX_SWEEPER_H
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * 把等待清除的页交给后台清除线程，第一次调用时启动线程
+ * 后台线程逐页释放没有标记的对象，活下来的对象清掉标记，空了的页还给系统；字符串的页留给程序的线程
+ * 释放的字节数和内联缓存的失效攒到清除结束时，由程序的线程一次处理
+ * 不支持线程或者线程启动失败时什么都不做，所有页留给程序的线程增量清除
+ */
+void sweepInBackground();
+
+/**
+ * 后台清除是否结束，结束时把清除完的页交回堆
+ * 不会等待后台线程
+ * @return 没有进行中的后台清除时也返回 true
+ */
+bool backgroundSweepDone();
+
+/**
+ * 等待后台清除结束，并把清除完的页交回堆
+ */
+void waitBackgroundSweep();
+
+/**
+ * 等待进行中的清除，结束后台清除线程
+ */
+void freeSweeper();
+
+#endif //CLOX_SWEEPER_H
@@ -119,6 +119,18 @@ bool tableGet(Table *table, ObjectString *key, Value *value) {
     return true;
 }
 
+int tableGetIndex(Table *table, ObjectString *key) {
+    if (table->count == 0) {
+        return -1;
+    }
+
+    Entry *entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) {
+        return -1;
+    }
+    return (int) (entry - table->entries);
+}
+
 bool tableDelete(Table *table, ObjectString *key) {
     if (table->count == 0) {
         return false;
@@ -176,13 +188,4 @@ void markTable(Table *table) {
         markObject((Object *) entry->key);
         markValue(entry->value);
     }
-}
-
-void tableRemoveWhite(Table *table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->object.isMarked) {
-            tableDelete(table, entry->key);
-        }
-    }
 }
\ No newline at end of file
@@ -49,6 +49,14 @@ bool tableSet(Table *table, ObjectString *key, Value value);
  */
 bool tableGet(Table *table, ObjectString *key, Value *value);
 
+/**
+ * 获取 key 在哈希表中的下标
+ * @param table
+ * @param key
+ * @return 不存在时返回 -1
+ */
+int tableGetIndex(Table *table, ObjectString *key);
+
 /**
  * 从哈希表中删除条目
  * @param table
@@ -80,11 +88,4 @@ ObjectString* tableFindKey(Table* table, const char* chars, int length, uint32_t
  */
 void markTable(Table* table);
 
-/**
- * 清理哈希表
- * 这里不能依靠GC，因为要保证哈希表的正确性
- * @param table
- */
-void tableRemoveWhite(Table* table);
-
 #endif //CLOX_TABLE_H
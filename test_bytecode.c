@@ -0,0 +1,176 @@
+/**
+ * 损坏的字节码文件的回归测试
+ * 编译一段脚本，每次改坏一条指令后写入字节码文件再读回来，加载必须失败，不能留到执行时让虚拟机崩溃
+ */
+
+#include <stdio.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "trie.h"
+#include "vm.h"
+
+#define TEST_PATH "test_bytecode.loxc"
+// 改写成函数中第一个不是字符串的常量的下标
+#define NOT_STRING (-1)
+
+static const char *source =
+        "class Counter {\n"
+        "  init(start) { this.count = start; }\n"
+        "  add(n) { this.count = this.count + n; return this.count; }\n"
+        "}\n"
+        "fun makeAdder(counter) {\n"
+        "  var total = 0;\n"
+        "  fun add(n) { total = total + counter.add(n + 1); return total; }\n"
+        "  return add;\n"
+        "}\n"
+        "var adder = makeAdder(Counter(1));\n"
+        "for (var i = 0; i < 3; i = i + 1) {\n"
+        "  if (i > 0) print adder(i);\n"
+        "}\n"
+        "print Counter(5).count + 2;\n";
+
+/**
+ * 一处改动：找到第一条 opcode 指令，从 position 开始写入 length 个字节的 value
+ */
+typedef struct {
+    const char *name;
+    OpCode opcode;
+    int position;
+    int length;
+    int value;
+} Mutation;
+
+static const Mutation mutations[] = {
+        {"property name is not a string",              OP_GET_PROPERTY, 1, 1, NOT_STRING},
+        {"method name is not a string",                OP_INVOKE,       1, 1, NOT_STRING},
+        {"call takes more arguments than the stack",   OP_CALL,         1, 1, 200},
+        {"invoke takes more arguments than the stack", OP_INVOKE,       2, 1, 200},
+        {"loop jumps into an instruction",             OP_LOOP,         1, 2, 2},
+        {"jump lands past the end",                    OP_JUMP,         1, 2, 0xffff},
+        {"local slot is beyond the stack",             OP_GET_LOCAL,    1, 1, 200},
+        {"up-value index is out of range",             OP_GET_UP_VALUE, 1, 1, 200},
+        {"copied value is read as an up-value",        OP_GET_COPIED,   0, 1, OP_GET_UP_VALUE},
+        {"script runs past the end",                   OP_RETURN,       0, 1, OP_POP},
+        {"specialized instruction in the file",        OP_ADD,          0, 1, OP_ADD_NUM},
+};
+
+/**
+ * 按照先外层后嵌套的顺序查找第一条指令
+ * @param function
+ * @param opcode
+ * @param offset 找到的指令的偏移
+ * @return 指令所在的函数，没有找到时返回 NULL
+ */
+static ObjectFunction *findInstruction(ObjectFunction *function, uint8_t opcode, int *offset) {
+    Chunk *chunk = &function->chunk;
+    for (int i = 0; i < chunk->size; i += getInstructionLength(chunk, i, NULL)) {
+        if (chunk->code[i] == opcode) {
+            *offset = i;
+            return function;
+        }
+    }
+    for (int i = 0; i < chunk->constants.size; i++) {
+        if (IS_FUNCTION(chunk->constants.values[i])) {
+            ObjectFunction *found = findInstruction(AS_FUNCTION(chunk->constants.values[i]), opcode, offset);
+            if (found != NULL) {
+                return found;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @param chunk
+ * @return 第一个不是字符串的常量的下标，没有时返回 -1
+ */
+static int findNonString(Chunk *chunk) {
+    for (int i = 0; i < chunk->constants.size; i++) {
+        if (!IS_STRING(chunk->constants.values[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * 写入字节码文件再读回来
+ * @param script
+ * @return 是否加载成功
+ */
+static bool roundTrip(ObjectFunction *script) {
+    if (!writeBytecode(TEST_PATH, script, 0)) {
+        printf("could not write %s\n", TEST_PATH);
+        return false;
+    }
+    return readBytecode(TEST_PATH, 0, false) != NULL;
+}
+
+/**
+ * 改坏一条指令，确认文件加载失败，之后恢复原来的字节码
+ * @param script
+ * @param mutation
+ * @return
+ */
+static bool rejects(ObjectFunction *script, const Mutation *mutation) {
+    int offset;
+    ObjectFunction *function = findInstruction(script, mutation->opcode, &offset);
+    if (function == NULL) {
+        printf("no instruction to change\n");
+        return false;
+    }
+    int value = mutation->value == NOT_STRING ? findNonString(&function->chunk) : mutation->value;
+    if (value < 0) {
+        printf("no constant that is not a string\n");
+        return false;
+    }
+
+    uint8_t *code = &function->chunk.code[offset + mutation->position];
+    uint8_t saved[2];
+    for (int i = 0; i < mutation->length; i++) {
+        saved[i] = code[i];
+        code[i] = (value >> (8 * (mutation->length - 1 - i))) & 0xff;
+    }
+    bool loaded = roundTrip(script);
+    for (int i = 0; i < mutation->length; i++) {
+        code[i] = saved[i];
+    }
+    return !loaded;
+}
+
+int main() {
+    initKeyWordTrie();
+    initVM();
+    setOptimizeLevel(0);
+
+    ObjectFunction *script = compile(source);
+    if (script == NULL) {
+        printf("FAIL compile\n");
+        return 1;
+    }
+    push(OBJECT_VAL(script));
+
+    int failures = 0;
+    if (roundTrip(script)) {
+        printf("ok - unchanged file loads\n");
+    } else {
+        printf("FAIL - unchanged file loads\n");
+        failures++;
+    }
+    for (int i = 0; i < (int) (sizeof(mutations) / sizeof(mutations[0])); i++) {
+        if (rejects(script, &mutations[i])) {
+            printf("ok - %s\n", mutations[i].name);
+        } else {
+            printf("FAIL - %s\n", mutations[i].name);
+            failures++;
+        }
+    }
+    remove(TEST_PATH);
+
+    pop();
+    freeVM();
+    freeTrie();
+    return failures == 0 ? 0 : 1;
+}
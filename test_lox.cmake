@@ -0,0 +1,63 @@
+# 运行一个 Lox 测试脚本，检查输出和退出码
+# cmake -DCLOX=<解释器> -DSCRIPT=<脚本> [-DARGS=<选项>] [-DREFERENCE_ARGS=<选项>] -P test_lox.cmake
+# 脚本里 "// expect: 文字" 按顺序给出期望的每一行输出，
+# "// expect runtime error: 消息" 表示脚本以运行时错误结束，错误输出里有这一行，"// expect compile error" 表示编译失败
+# "// expect trace: [line 行号] in 函数()" 按顺序给出错误之后调用栈里的栈帧，中间可以有别的栈帧
+# 给出 REFERENCE_ARGS 时再用这些选项运行一次，两次的输出和退出码必须完全相同
+
+separate_arguments(ARGS)
+separate_arguments(REFERENCE_ARGS)
+
+file(STRINGS ${SCRIPT} lines REGEX "// expect")
+set(expected "")
+set(expected_error "")
+set(expected_result 0)
+set(expected_trace "")
+foreach (line IN LISTS lines)
+    if (line MATCHES "// expect: (.*)$")
+        string(APPEND expected "${CMAKE_MATCH_1}\n")
+    elseif (line MATCHES "// expect runtime error: (.*)$")
+        set(expected_error "${CMAKE_MATCH_1}")
+        set(expected_result 70)
+    elseif (line MATCHES "// expect trace: (.*)$")
+        list(APPEND expected_trace "${CMAKE_MATCH_1}")
+    elseif (line MATCHES "// expect compile error")
+        set(expected_result 65)
+    endif ()
+endforeach ()
+
+execute_process(COMMAND ${CLOX} ${ARGS} ${SCRIPT}
+        OUTPUT_VARIABLE output ERROR_VARIABLE error RESULT_VARIABLE result)
+
+if (NOT result EQUAL expected_result)
+    message(FATAL_ERROR "exit code ${result}, expected ${expected_result}\n${output}${error}")
+endif ()
+if (NOT output STREQUAL expected)
+    message(FATAL_ERROR "output:\n${output}\nexpected:\n${expected}")
+endif ()
+if (expected_error)
+    string(FIND "${error}" "${expected_error}\n" found)
+    if (found EQUAL -1)
+        message(FATAL_ERROR "error:\n${error}\nexpected:\n${expected_error}")
+    endif ()
+    string(LENGTH "${expected_error}\n" length)
+    math(EXPR found "${found} + ${length}")
+    string(SUBSTRING "${error}" ${found} -1 rest)
+    foreach (frame IN LISTS expected_trace)
+        string(FIND "${rest}" "${frame}\n" found)
+        if (found EQUAL -1)
+            message(FATAL_ERROR "error:\n${error}\nexpected frame:\n${frame}")
+        endif ()
+        string(LENGTH "${frame}\n" length)
+        math(EXPR found "${found} + ${length}")
+        string(SUBSTRING "${rest}" ${found} -1 rest)
+    endforeach ()
+endif ()
+
+if (DEFINED REFERENCE_ARGS)
+    execute_process(COMMAND ${CLOX} ${REFERENCE_ARGS} ${SCRIPT}
+            OUTPUT_VARIABLE reference_output ERROR_VARIABLE reference_error RESULT_VARIABLE reference_result)
+    if (NOT "${output}${error}${result}" STREQUAL "${reference_output}${reference_error}${reference_result}")
+        message(FATAL_ERROR "differs from ${REFERENCE_ARGS}:\n${output}${error}\n--\n${reference_output}${reference_error}")
+    endif ()
+endif ()
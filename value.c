@@ -40,6 +40,8 @@ void printValue(Value value) {
         printf("%g", AS_NUMBER(value));
     } else if (IS_OBJECT(value)) {
         printObject(value);
+    } else if (IS_UNDEFINED(value)) {
+        printf("undefined");
     }
 #else
     switch (value.type) {
@@ -55,24 +57,44 @@ void printValue(Value value) {
         case VAL_OBJECT:
             printObject(value);
             break;
+        case VAL_UNDEFINED:
+            printf("undefined");
+            break;
     }
 #endif
 }
 
+/**
+ * 绑定的方法按照接收者和方法比较
+ * 实例会复用最近一次绑定的方法，同一个方法取两次得到的是不是同一个对象取决于之前取过什么，按照对象比较的结果不确定
+ * @param a
+ * @param b
+ * @return
+ */
+static bool boundMethodsEqual(Value a, Value b) {
+    if (!IS_BOUND_METHOD(a) || !IS_BOUND_METHOD(b)) {
+        return false;
+    }
+    ObjectBoundMethod *left = AS_BOUND_METHOD(a);
+    ObjectBoundMethod *right = AS_BOUND_METHOD(b);
+    return left->method == right->method && valuesEqual(left->receiver, right->receiver);
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
-    return a == b;
+    return a == b || boundMethodsEqual(a, b);
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:
             return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:
+        case VAL_UNDEFINED:
             return true;
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJECT:
-            return AS_OBJECT(a) == AS_OBJECT(b);
+            return AS_OBJECT(a) == AS_OBJECT(b) || boundMethodsEqual(a, b);
         default:
             return false; // Unreachable.
     }
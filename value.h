@@ -20,6 +20,21 @@ typedef struct Object Object;
  */
 typedef struct ObjectString ObjectString;
 
+/**
+ * 闭包对象
+ */
+typedef struct ObjectClosure ObjectClosure;
+
+/**
+ * 类对象
+ */
+typedef struct ObjectClass ObjectClass;
+
+/**
+ * 实例字段的形状
+ */
+typedef struct ObjectShape ObjectShape;
+
 #ifdef NAN_BOXING
 
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
@@ -27,11 +42,13 @@ typedef struct ObjectString ObjectString;
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
+#define TAG_UNDEFINED 4 // 100.
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
 #define IS_OBJECT(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
@@ -49,6 +66,7 @@ static inline double valueToNum(Value value) {
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJECT_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -61,6 +79,7 @@ static inline Value numToValue(double num) {
 #else
 #define IS_BOOL(value)     ((value).type == VAL_BOOL)
 #define IS_NIL(value)      ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value)   ((value).type == VAL_NUMBER)
 #define IS_OBJECT(value)   ((value).type == VAL_OBJECT)
 
@@ -70,6 +89,7 @@ static inline Value numToValue(double num) {
 
 #define BOOL_VAL(value)    ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL            ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL      ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value)  ((Value){VAL_NUMBER, {.number = value}})
 #define OBJECT_VAL(value)  ((Value){VAL_OBJECT, {.object = (Object*)value}})
 
@@ -80,7 +100,8 @@ typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJECT
+    VAL_OBJECT,
+    VAL_UNDEFINED   // 只用于标记还没有定义的全局变量，不会出现在栈上
 } ValueType;
 
 /**
@@ -12,12 +12,24 @@
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "jit.h"
+#include "ssa.h"
+#include "snapshot.h"
+#include "marker.h"
+#include "sweeper.h"
+#include "heap.h"
 
 /**
  * 单例
  */
 VM vm;
 
+/**
+ * 每个字节码的处理程序地址，预解码时写入指令流
+ * 使用 switch 分发时为 NULL
+ */
+static void *const *dispatchHandlers = NULL;
+
 /**
  * 重制虚拟机栈顶
  */
@@ -27,6 +39,21 @@ static void resetStack() {
     vm.openUpValues = NULL;
 }
 
+/**
+ * 打印一个栈帧
+ * @param function
+ * @param instruction 正在执行的指令
+ */
+static void printFrame(ObjectFunction *function, Instruction *instruction) {
+    int offset = getInstructionOffset(&function->chunk, instruction);
+    fprintf(stderr, "[line %d] in ", getLine(&function->chunk, offset));
+    if (function->name == NULL) {
+        fprintf(stderr, "script\n");
+    } else {
+        fprintf(stderr, "%s()\n", function->name->chars);
+    }
+}
+
 /**
  * 运行时错误
  */
@@ -37,17 +64,21 @@ static void runtimeError(const char *format, ...) {
     va_end(args);
     fputs("\n", stderr);
 
-    // 打印栈帧
+    // 打印栈帧，调用栈很深的时候省略中间的部分
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        if (vm.frameCount > TRACE_FRAMES && i == vm.frameCount - TRACE_FRAMES / 2 - 1) {
+            fprintf(stderr, "...%d more frames...\n", vm.frameCount - TRACE_FRAMES);
+            i = TRACE_FRAMES / 2 - 1;
+        }
         CallFrame *frame = &vm.frames[i];
         ObjectFunction *function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
-        if (function->name == NULL) {
-            fprintf(stderr, "script\n");
-        } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+        // 内联的函数没有自己的栈帧，先打印它，再打印调用处
+        ObjectFunction *inlined;
+        Instruction *instruction = ssaInlinedInstruction(&function->chunk, frame->ip - 1, &inlined);
+        if (instruction != NULL) {
+            printFrame(inlined, instruction);
         }
+        printFrame(function, frame->ip - 1);
     }
     resetStack();
 }
@@ -56,11 +87,14 @@ static void runtimeError(const char *format, ...) {
  * 定义本地函数
  * @param name
  * @param function
+ * @param arity 参数数量，NATIVE_VARIADIC 表示不检查
+ * @param pure 是否不分配内存
  */
-static void defineNative(const char *name, NativeFn function) {
+static void defineNative(const char *name, NativeFn function, int arity, bool pure) {
     push(OBJECT_VAL(copyString(name, (int) strlen(name))));
-    push(OBJECT_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJECT_VAL(newNative(function, arity, pure)));
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
@@ -71,8 +105,58 @@ static void defineNative(const char *name, NativeFn function) {
  * @param args
  * @return
  */
-static Value clockNative(int argCount, Value *args) {
-    return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+static bool clockNative(int argCount, Value *args) {
+    args[-1] = NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+#ifdef CLOX_TEST_NATIVES
+/**
+ * 测试用：任意多个数字求和
+ * @param argCount
+ * @param args
+ * @return
+ */
+static bool sumNative(int argCount, Value *args) {
+    double sum = 0;
+    for (int i = 0; i < argCount; i++) {
+        if (!IS_NUMBER(args[i])) {
+            return nativeError("Operands must be numbers.");
+        }
+        sum += AS_NUMBER(args[i]);
+    }
+    args[-1] = NUMBER_VAL(sum);
+    return true;
+}
+
+/**
+ * 测试用：拼接两个字符串，会分配内存
+ * @param argCount
+ * @param args
+ * @return
+ */
+static bool joinNative(int argCount, Value *args) {
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+        return nativeError("Operands must be strings.");
+    }
+    ObjectString *a = AS_STRING(args[0]);
+    ObjectString *b = AS_STRING(args[1]);
+    int length = a->length + b->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+    args[-1] = OBJECT_VAL(takeString(chars, length));
+    return true;
+}
+#endif
+
+bool nativeError(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(vm.nativeError, NATIVE_ERROR_MAX, format, args);
+    va_end(args);
+    return false;
 }
 
 /**
@@ -105,32 +189,214 @@ static void concatString() {
 }
 
 /**
- * 函数调用
+ * 记录参数的类型，SSA 优化层据此推测参数类型
+ * @param function
+ * @param argCount
+ */
+static void profileArguments(ObjectFunction *function, int argCount) {
+    Value *args = vm.stackTop - argCount;
+    for (int i = 0; i < argCount && i < PROFILED_ARGS; i++) {
+        if (IS_NUMBER(args[i])) {
+            function->argTypes[i] |= PROFILE_NUMBER;
+        } else if (IS_STRING(args[i])) {
+            function->argTypes[i] |= PROFILE_STRING;
+        } else {
+            function->argTypes[i] |= PROFILE_OTHER;
+        }
+    }
+}
+
+/**
+ * 打开 SSA 优化层时统计热度，优化之前还要记录调用的参数类型
+ * 不内联进调用路径，没有打开的时候调用路径上只多一次判断
  * @param function
  * @param argCount
+ */
+static void countSsaHotness(ObjectFunction *function, int argCount) {
+    if (function->hotness < SSA_THRESHOLD) {
+        profileArguments(function, argCount);
+        if (++function->hotness == SSA_THRESHOLD) {
+            ssaOptimize(function, dispatchHandlers);
+        }
+    }
+}
+
+/**
+ * 统计函数的调用和循环回边次数，达到阈值时 JIT 编译或者 SSA 优化
+ * 编译会分配内存，调用的时候栈顶必须已经写回
+ * @param function
+ * @param argCount 调用的参数数量，循环回边为 0
+ */
+static inline void countHotness(ObjectFunction *function, int argCount) {
+#ifdef JIT_SUPPORTED
+    if (vm.jitEnabled) {
+        if (function->jit == NULL && function->hotness < JIT_THRESHOLD && ++function->hotness == JIT_THRESHOLD) {
+            jitCompile(function);
+        }
+        return;
+    }
+#endif
+    if (vm.ssaEnabled) {
+        countSsaHotness(function, argCount);
+    }
+}
+
+/**
+ * 调用闭包之前检查参数数量，第一次调用的时候编译延迟编译的函数体并预解码
+ * @param closure
+ * @param argCount
  * @return
  */
-static bool call(ObjectClosure *closure, int argCount) {
+static bool prepareCall(ObjectClosure *closure, int argCount) {
+    // 延迟编译的函数第一次调用时编译，编译错误已经报告过
+    ObjectFunction *function = closure->function;
+    if (function->lazy != NULL && !compileLazyFunction(function)) {
+        runtimeError("Could not compile function %s.", function->name->chars);
+        return false;
+    }
+
     // 参数数量检查
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
 
-    // 调用溢出检查
-    if (vm.frameCount == FRAMES_MAX) {
+    // 第一次调用的时候预解码
+    Chunk *chunk = &closure->function->chunk;
+    if (chunk->instructions == NULL) {
+        decodeChunk(chunk, dispatchHandlers);
+    }
+    countHotness(closure->function, argCount);
+    return true;
+}
+
+/**
+ * 虚拟机栈扩容
+ * 栈会移动到新的内存，栈帧的槽位、打开的上值和栈顶都要重新定位
+ * @param needed
+ * @return 超过 STACK_MAX 时报告栈溢出并返回 false
+ */
+static bool growStack(int needed) {
+    int used = (int) (vm.stackTop - vm.stack);
+    if (used + needed > STACK_MAX) {
         runtimeError("Stack overflow.");
         return false;
     }
 
+    int capacity = vm.stackCapacity;
+    while (capacity < used + needed) {
+        capacity *= 2;
+    }
+    if (capacity > STACK_MAX) {
+        capacity = STACK_MAX;
+    }
+    Value *stack = (Value *) malloc(sizeof(Value) * capacity);
+    if (stack == NULL) {
+        dbg("Error when grow vm stack");
+        exit(1);
+    }
+    memcpy(stack, vm.stack, sizeof(Value) * used);
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjectUpValue *upValue = vm.openUpValues; upValue != NULL; upValue = upValue->next) {
+        upValue->location = stack + (upValue->location - vm.stack);
+    }
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stackTop = stack + used;
+    vm.stackCapacity = capacity;
+    return true;
+}
+
+/**
+ * 确保栈顶之上至少还有 needed 个槽位
+ * @param needed
+ * @return
+ */
+static inline bool ensureStack(int needed) {
+    if (vm.stackTop + needed <= vm.stack + vm.stackCapacity) {
+        return true;
+    }
+    return growStack(needed);
+}
+
+/**
+ * 调用栈扩容，调用栈中没有指向自己的指针，可以直接移动
+ * @return 超过 FRAMES_MAX 时报告栈溢出并返回 false
+ */
+static bool growFrames() {
+    if (vm.frameCapacity >= FRAMES_MAX) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
+    int capacity = vm.frameCapacity * 2 > FRAMES_MAX ? FRAMES_MAX : vm.frameCapacity * 2;
+    CallFrame *frames = (CallFrame *) realloc(vm.frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL) {
+        dbg("Error when grow call frames");
+        exit(1);
+    }
+    vm.frames = frames;
+    vm.frameCapacity = capacity;
+    return true;
+}
+
+/**
+ * 确保还能压入一个栈帧
+ * @return
+ */
+static inline bool ensureFrame() {
+    return vm.frameCount < vm.frameCapacity || growFrames();
+}
+
+/**
+ * 函数调用
+ * 栈帧可能用到的栈空间不会超过指令流的长度，调用时一次性预留，执行过程中不再检查
+ * @param function
+ * @param argCount
+ * @return
+ */
+static bool call(ObjectClosure *closure, int argCount) {
+    if (!prepareCall(closure, argCount)) {
+        return false;
+    }
+
+    // 调用溢出检查
+    Chunk *chunk = &closure->function->chunk;
+    if (!ensureFrame() || !ensureStack(chunk->frameSize + STACK_RESERVE)) {
+        return false;
+    }
+
     CallFrame *frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = chunk->entry;
     // 复用形参
     frame->slots = vm.stackTop - argCount - 1;
     return true;
 }
 
+/**
+ * 本地函数调用，结果直接写入被调用者的槽位，不需要额外的出栈入栈
+ * @param native
+ * @param argCount
+ * @return
+ */
+static inline bool callNative(ObjectNative *native, int argCount) {
+    if (native->arity != NATIVE_VARIADIC && argCount != native->arity) {
+        runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+        return false;
+    }
+    Value *args = vm.stackTop - argCount;
+    if (!native->function(argCount, args)) {
+        runtimeError("%s", vm.nativeError);
+        return false;
+    }
+    vm.stackTop = args;
+    return true;
+}
+
 /**
  * 函数调用检查
  * @param callee
@@ -162,13 +428,8 @@ static bool callValue(Value callee, int argCount) {
             }
             case OBJECT_CLOSURE:
                 return call(AS_CLOSURE(callee), argCount);
-            case OBJECT_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
-                return true;
-            }
+            case OBJECT_NATIVE:
+                return callNative(AS_NATIVE(callee), argCount);
             default:
                 break; // Non-callable object type.
         }
@@ -217,10 +478,90 @@ static void closeUpValues(Value *last) {
         // 隐含的拷贝
         upValue->closed = *upValue->location;
         upValue->location = &upValue->closed;
+        writeBarrier((Object *) upValue, upValue->closed);
         vm.openUpValues = upValue->next;
     }
 }
 
+/**
+ * 尾调用，被调用的函数复用当前的栈帧
+ * 先关闭当前函数的上值，再把被调用者和参数移动到栈帧的开头
+ * @param closure
+ * @param argCount
+ * @return
+ */
+static bool tailCall(ObjectClosure *closure, int argCount) {
+    if (!prepareCall(closure, argCount)) {
+        return false;
+    }
+    // 新函数需要的栈空间可能比当前函数多
+    if (!ensureStack(closure->function->chunk.frameSize + STACK_RESERVE)) {
+        return false;
+    }
+
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    closeUpValues(frame->slots);
+    memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.entry;
+    return true;
+}
+
+/**
+ * 尾调用检查，类和本地函数按照普通调用处理，由之后的 OP_RETURN 返回结果
+ * @param callee
+ * @param argCount
+ * @return
+ */
+static bool tailCallValue(Value callee, int argCount) {
+    if (IS_CLOSURE(callee)) {
+        return tailCall(AS_CLOSURE(callee), argCount);
+    }
+    if (IS_BOUND_METHOD(callee)) {
+        ObjectBoundMethod *bound = AS_BOUND_METHOD(callee);
+        vm.stackTop[-argCount - 1] = bound->receiver;
+        return tailCall(bound->method, argCount);
+    }
+    return callValue(callee, argCount);
+}
+
+int globalSlot(ObjectString *name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) {
+        return (int) AS_NUMBER(slot);
+    }
+
+    // 避免扩容的时候名字被GC回收
+    push(OBJECT_VAL(name));
+    int index = vm.globalValues.size;
+    writeValueArray(&vm.globalNames, OBJECT_VAL(name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+    pop();
+    return index;
+}
+
+ObjectString *globalName(int slot) {
+    return AS_STRING(vm.globalNames.values[slot]);
+}
+
+void enableJit() {
+#ifdef JIT_SUPPORTED
+    vm.jitEnabled = true;
+#else
+    fprintf(stderr, "JIT is not supported on this platform, falling back to the interpreter.\n");
+#endif
+}
+
+void enableSsa() {
+    vm.ssaEnabled = true;
+}
+
+void invalidateInlineCaches() {
+    vm.methodEpoch++;
+}
+
 /**
  * 定义方法
  * @param name
@@ -231,9 +572,185 @@ static void defineMethod(ObjectString *name) {
     // 类
     ObjectClass *klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    writeBarrierObject((Object *) klass, (Object *) name);
+    writeBarrier((Object *) klass, method);
+    invalidateInlineCaches();
     pop();
 }
 
+/**
+ * 查找内联缓存中形状对应的条目
+ * @param cache
+ * @param shape
+ * @return 没有缓存或者已经超多态时返回 NULL
+ */
+static inline InlineCacheEntry *findInlineCache(InlineCache *cache, ObjectShape *shape) {
+    if (cache->epoch != vm.methodEpoch) {
+        cache->epoch = vm.methodEpoch;
+        cache->count = 0;
+    }
+    for (int i = 0; i < cache->count && i < INLINE_CACHE_ENTRIES; i++) {
+        if (cache->entries[i].shape == shape) {
+            return &cache->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 为形状新增一个缓存条目
+ * @param cache
+ * @param shape
+ * @return 缓存已满时返回 NULL，之后这个位置不再缓存
+ */
+static InlineCacheEntry *addInlineCache(InlineCache *cache, ObjectShape *shape) {
+    if (cache->count >= INLINE_CACHE_ENTRIES) {
+        cache->count = INLINE_CACHE_ENTRIES + 1;
+        return NULL;
+    }
+    InlineCacheEntry *entry = &cache->entries[cache->count++];
+    entry->shape = shape;
+    entry->method = NULL;
+    entry->transition = NULL;
+    entry->slot = -1;
+    return entry;
+}
+
+/**
+ * 属性查找结果
+ */
+typedef enum {
+    PROPERTY_FIELD,
+    PROPERTY_METHOD,
+    PROPERTY_UNDEFINED,
+} PropertyKind;
+
+/**
+ * 内联缓存没有命中时查找属性，并更新缓存
+ * 字典模式的实例不缓存
+ * @param instance
+ * @param name
+ * @param cache
+ * @param value
+ * @return
+ */
+static PropertyKind findPropertySlow(ObjectInstance *instance, ObjectString *name, InlineCache *cache, Value *value) {
+    ObjectShape *shape = instance->shape;
+    if (shape == NULL) {
+        if (tableGet(&instance->fields, name, value)) {
+            return PROPERTY_FIELD;
+        }
+        return tableGet(&instance->klass->methods, name, value) ? PROPERTY_METHOD : PROPERTY_UNDEFINED;
+    }
+
+    int slot = shapeSlot(shape, name);
+    if (slot >= 0) {
+        *value = instance->slots[slot];
+        InlineCacheEntry *entry = addInlineCache(cache, shape);
+        if (entry != NULL) {
+            entry->slot = slot;
+        }
+        return PROPERTY_FIELD;
+    }
+    if (!tableGet(&instance->klass->methods, name, value)) {
+        return PROPERTY_UNDEFINED;
+    }
+    // 形状里没有同名字段，这个形状的实例一定会找到这个方法
+    InlineCacheEntry *entry = addInlineCache(cache, shape);
+    if (entry != NULL) {
+        entry->method = AS_CLOSURE(*value);
+    }
+    return PROPERTY_METHOD;
+}
+
+/**
+ * 通过内联缓存查找属性，先找字段再找方法
+ * @param instance
+ * @param name
+ * @param cache
+ * @param value 找到的字段值或者方法闭包
+ * @return
+ */
+static inline PropertyKind findProperty(ObjectInstance *instance, ObjectString *name, InlineCache *cache, Value *value) {
+    InlineCacheEntry *entry = findInlineCache(cache, instance->shape);
+    if (entry != NULL) {
+        if (entry->method != NULL) {
+            *value = OBJECT_VAL(entry->method);
+            return PROPERTY_METHOD;
+        }
+        *value = instance->slots[entry->slot];
+        return PROPERTY_FIELD;
+    }
+    return findPropertySlow(instance, name, cache, value);
+}
+
+/**
+ * 内联缓存没有命中时设置字段，并缓存字段的槽位或者形状转换
+ * @param instance
+ * @param name
+ * @param cache
+ */
+static void setPropertySlow(ObjectInstance *instance, ObjectString *name, InlineCache *cache) {
+    ObjectShape *shape = instance->shape;
+    setField(instance, name, peek(0));
+    if (shape == NULL || instance->shape == NULL) {
+        return;
+    }
+
+    // 新建形状会让缓存失效，所以设置完字段之后再查找缓存
+    InlineCacheEntry *entry = findInlineCache(cache, shape);
+    if (entry == NULL) {
+        entry = addInlineCache(cache, shape);
+    }
+    if (entry != NULL) {
+        entry->slot = shapeSlot(instance->shape, name);
+        entry->transition = instance->shape != shape ? instance->shape : NULL;
+    }
+}
+
+/**
+ * 通过内联缓存设置字段，值在栈顶
+ * @param instance
+ * @param name
+ * @param cache
+ */
+static inline void setProperty(ObjectInstance *instance, ObjectString *name, InlineCache *cache) {
+    InlineCacheEntry *entry = findInlineCache(cache, instance->shape);
+    if (entry != NULL) {
+        if (entry->transition == NULL) {
+            instance->slots[entry->slot] = peek(0);
+            writeBarrier((Object *) instance, peek(0));
+            return;
+        }
+        // 新增字段，槽位已经预先分配好的时候直接转换形状
+        if (entry->slot < instance->slotCapacity) {
+            instance->slots[entry->slot] = peek(0);
+            instance->shape = entry->transition;
+            writeBarrier((Object *) instance, peek(0));
+            writeBarrierObject((Object *) instance, (Object *) entry->transition);
+            return;
+        }
+    }
+    setPropertySlow(instance, name, cache);
+}
+
+/**
+ * 取出实例的方法，和上一次取出的是同一个方法时复用绑定好的方法
+ * 绑定的方法创建之后不会改变，相等按照接收者和方法比较（见 valuesEqual），复用不会被察觉
+ * @param instance 必须在栈上，分配的时候可能触发垃圾回收
+ * @param method
+ * @return
+ */
+static inline ObjectBoundMethod *bindInstanceMethod(ObjectInstance *instance, ObjectClosure *method) {
+    if (instance->bound != NULL && instance->bound->method == method) {
+        return instance->bound;
+    }
+    ObjectBoundMethod *bound = newBoundMethod(OBJECT_VAL(instance), method);
+    instance->bound = bound;
+    writeBarrierObject((Object *) instance, (Object *) bound);
+    return bound;
+}
+
 /**
  * 为方法绑定实例
  * @param klass
@@ -247,7 +764,7 @@ static bool bindMethod(ObjectClass *klass, ObjectString *name) {
         return false;
     }
 
-    ObjectBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjectBoundMethod *bound = bindInstanceMethod(AS_INSTANCE(peek(0)), AS_CLOSURE(method));
     pop();
     push(OBJECT_VAL(bound));
     return true;
@@ -272,21 +789,141 @@ static bool invokeFromClass(ObjectClass *klass, ObjectString *name, int argCount
  * 方法调用
  * @param name
  * @param argCount
+ * @param cache
+ * @param tail 是否为尾调用
+ * @param property 是否由 (a.b)(...) 编译而来，接收者不是实例时和读取属性报同样的错误
  * @return
  */
-static bool invoke(ObjectString *name, int argCount) {
+static bool invoke(ObjectString *name, int argCount, InlineCache *cache, bool tail, bool property) {
     Value receiver = peek(argCount);
     if (!IS_INSTANCE(receiver)) {
-        runtimeError("Only instances have methods.");
+        runtimeError(property ? "Only instances have properties." : "Only instances have methods.");
         return false;
     }
     ObjectInstance *instance = AS_INSTANCE(receiver);
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    PropertyKind kind = findProperty(instance, name, cache, &value);
+    if (kind == PROPERTY_METHOD) {
+        return tail ? tailCall(AS_CLOSURE(value), argCount) : call(AS_CLOSURE(value), argCount);
+    }
+    if (kind == PROPERTY_FIELD) {
         vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+        return tail ? tailCallValue(value, argCount) : callValue(value, argCount);
+    }
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+}
+
+/**
+ * 内联的方法调用处检查接收者
+ * 形状变化之后，只要内联缓存确认这个形状找到的还是同一个方法，就记下新的形状继续使用内联的方法体
+ * @param inlined
+ * @param receiver
+ * @return
+ */
+static inline bool inlineGuard(InlinedCall *inlined, Value receiver) {
+    if (!IS_INSTANCE(receiver)) {
+        return false;
+    }
+    ObjectShape *shape = AS_INSTANCE(receiver)->shape;
+    if (shape == inlined->shape && inlined->epoch == vm.methodEpoch) {
+        return true;
+    }
+    // 方法体按槽位读写字段时只认记录的形状
+    if (shape == NULL || (inlined->fields && shape != inlined->shape)) {
+        return false;
+    }
+    InlineCacheEntry *entry = findInlineCache(inlined->cache, shape);
+    if (entry == NULL || entry->method != inlined->method) {
+        return false;
+    }
+    inlined->shape = shape;
+    inlined->epoch = vm.methodEpoch;
+    return true;
+}
+
+/**
+ * 优化后的指令流中的检查失败，记一次退回，从基线指令流中对应的位置继续执行
+ * 两个指令流中相同下标处的栈是一样的，对应的下标记录在优化代码的 sites 里
+ * @param frame
+ * @param instruction 检查所在的指令
+ * @return 基线指令流中继续执行的位置
+ */
+static Instruction *deoptimize(CallFrame *frame, Instruction *instruction) {
+    Chunk *chunk = &frame->closure->function->chunk;
+    int index = getInstructionIndex(chunk, instruction);
+    ssaDeoptimize(chunk);
+    return chunk->instructions + index;
+}
+
+/**
+ * 循环回边处切换到优化后的指令流，优化代码可能需要更多的栈空间
+ * @param frame 栈顶必须已经写回
+ * @return 切换之后栈可能已经移动，需要重新加载栈帧
+ */
+static bool enterOptimizedLoop(CallFrame *frame) {
+    Chunk *chunk = &frame->closure->function->chunk;
+    if (chunk->optimized == NULL || chunk->optimized->entry == NULL) {
+        return false;
+    }
+    Instruction *ip = ssaEnterLoop(chunk, frame->ip, frame->slots);
+    if (ip == NULL) {
+        return false;
+    }
+    int needed = chunk->frameSize + STACK_RESERVE;
+    if (vm.stackTop - vm.stack + needed > STACK_MAX || !ensureStack(needed)) {
+        return false;
+    }
+    frame->ip = ip;
+    return true;
+}
+
+/**
+ * 循环回边处统计热度，然后尝试进入机器码或者切换到优化后的指令流
+ * 放在解释器循环外面，没有打开 JIT 和 SSA 优化层时回边上只多一次判断
+ * @param frame 栈顶必须已经写回
+ * @return 是否执行过机器码或者切换了指令流，这时需要重新加载栈帧
+ */
+static bool loopTierUp(CallFrame *frame) {
+    ObjectFunction *function = frame->closure->function;
+    countHotness(function, 0);
+#ifdef JIT_SUPPORTED
+    if (vm.jitEnabled) {
+        if (function->jit != NULL && function->jit->entries[frame->ip - function->chunk.instructions] != NULL) {
+            jitRun(frame);
+            return true;
+        }
+        return false;
+    }
+#endif
+    return enterOptimizedLoop(frame);
+}
+
+bool getPropertyFast(Value receiver, ObjectString *name, InlineCache *cache, Value *value) {
+    if (!IS_INSTANCE(receiver)) {
+        return false;
+    }
+    Value property;
+    PropertyKind kind = findProperty(AS_INSTANCE(receiver), name, cache, &property);
+    if (kind == PROPERTY_FIELD) {
+        *value = property;
+        return true;
+    }
+    if (kind == PROPERTY_METHOD) {
+        *value = OBJECT_VAL(bindInstanceMethod(AS_INSTANCE(receiver), AS_CLOSURE(property)));
+        return true;
+    }
+    return false;
+}
+
+bool setPropertyFast(Value receiver, ObjectString *name, InlineCache *cache, Value value) {
+    if (!IS_INSTANCE(receiver)) {
+        return false;
     }
-    return invokeFromClass(instance->klass, name, argCount);
+    // 设置字段的值从栈顶读取
+    vm.stackTop[-1] = value;
+    setProperty(AS_INSTANCE(receiver), name, cache);
+    return true;
 }
 
 /**
@@ -294,342 +931,871 @@ static bool invoke(ObjectString *name, int argCount) {
  * @return
  */
 static InterpretResult run() {
+#ifdef COMPUTED_GOTO
+    // 每个字节码有自己的处理程序，分发的间接跳转分散在每个处理程序的末尾
+    // 这样CPU可以按照"上一条指令"分别预测下一条指令，而不是共用一个 switch 跳转
+    static void *dispatchTable[] = {
+            [OP_CONSTANT]       = &&TARGET_OP_CONSTANT,
+            [OP_NIL]            = &&TARGET_OP_NIL,
+            [OP_TRUE]           = &&TARGET_OP_TRUE,
+            [OP_FALSE]          = &&TARGET_OP_FALSE,
+            [OP_POP]            = &&TARGET_OP_POP,
+            [OP_DEFINE_GLOBAL]  = &&TARGET_OP_DEFINE_GLOBAL,
+            [OP_GET_GLOBAL]     = &&TARGET_OP_GET_GLOBAL,
+            [OP_SET_GLOBAL]     = &&TARGET_OP_SET_GLOBAL,
+            [OP_GET_LOCAL]      = &&TARGET_OP_GET_LOCAL,
+            [OP_SET_LOCAL]      = &&TARGET_OP_SET_LOCAL,
+            [OP_GET_UP_VALUE]   = &&TARGET_OP_GET_UP_VALUE,
+            [OP_SET_UP_VALUE]   = &&TARGET_OP_SET_UP_VALUE,
+            [OP_GET_COPIED]     = &&TARGET_OP_GET_COPIED,
+            [OP_GET_PROPERTY]   = &&TARGET_OP_GET_PROPERTY,
+            [OP_SET_PROPERTY]   = &&TARGET_OP_SET_PROPERTY,
+            [OP_GET_SUPER]      = &&TARGET_OP_GET_SUPER,
+            [OP_EQUAL]          = &&TARGET_OP_EQUAL,
+            [OP_NOT_EQUAL]      = &&TARGET_OP_NOT_EQUAL,
+            [OP_GREATER]        = &&TARGET_OP_GREATER,
+            [OP_LESS]           = &&TARGET_OP_LESS,
+            [OP_ADD]            = &&TARGET_OP_ADD,
+            [OP_SUBTRACT]       = &&TARGET_OP_SUBTRACT,
+            [OP_MULTIPLY]       = &&TARGET_OP_MULTIPLY,
+            [OP_DIVIDE]         = &&TARGET_OP_DIVIDE,
+            [OP_NOT]            = &&TARGET_OP_NOT,
+            [OP_NEGATE]         = &&TARGET_OP_NEGATE,
+            [OP_PRINT]          = &&TARGET_OP_PRINT,
+            [OP_JUMP]           = &&TARGET_OP_JUMP,
+            [OP_JUMP_IF_FALSE]  = &&TARGET_OP_JUMP_IF_FALSE,
+            [OP_LOOP]           = &&TARGET_OP_LOOP,
+            [OP_CALL]           = &&TARGET_OP_CALL,
+            [OP_INVOKE]         = &&TARGET_OP_INVOKE,
+            [OP_INVOKE_PROPERTY] = &&TARGET_OP_INVOKE_PROPERTY,
+            [OP_SUPER_INVOKE]   = &&TARGET_OP_SUPER_INVOKE,
+            [OP_CLOSURE]        = &&TARGET_OP_CLOSURE,
+            [OP_CLOSE_UP_VALUE] = &&TARGET_OP_CLOSE_UP_VALUE,
+            [OP_CLASS]          = &&TARGET_OP_CLASS,
+            [OP_INHERIT]        = &&TARGET_OP_INHERIT,
+            [OP_METHOD]         = &&TARGET_OP_METHOD,
+            [OP_RETURN]         = &&TARGET_OP_RETURN,
+            [OP_ADD_LOCALS]         = &&TARGET_OP_ADD_LOCALS,
+            [OP_JUMP_IF_NOT_LESS]   = &&TARGET_OP_JUMP_IF_NOT_LESS,
+            [OP_GET_LOCAL_PROPERTY] = &&TARGET_OP_GET_LOCAL_PROPERTY,
+            [OP_TAIL_CALL]          = &&TARGET_OP_TAIL_CALL,
+            [OP_TAIL_INVOKE]        = &&TARGET_OP_TAIL_INVOKE,
+            [OP_ADD_NUM]            = &&TARGET_OP_ADD_NUM,
+            [OP_ADD_STR]            = &&TARGET_OP_ADD_STR,
+            [OP_SUBTRACT_NUM]       = &&TARGET_OP_SUBTRACT_NUM,
+            [OP_MULTIPLY_NUM]       = &&TARGET_OP_MULTIPLY_NUM,
+            [OP_DIVIDE_NUM]         = &&TARGET_OP_DIVIDE_NUM,
+            [OP_GREATER_NUM]        = &&TARGET_OP_GREATER_NUM,
+            [OP_LESS_NUM]           = &&TARGET_OP_LESS_NUM,
+            [OP_CALL_NATIVE]        = &&TARGET_OP_CALL_NATIVE,
+            [OP_GUARD_NUMBER]       = &&TARGET_OP_GUARD_NUMBER,
+            [OP_GUARD_STRING]       = &&TARGET_OP_GUARD_STRING,
+            [OP_INVOKE_INLINE]      = &&TARGET_OP_INVOKE_INLINE,
+            [OP_INLINE_RETURN]      = &&TARGET_OP_INLINE_RETURN,
+            [OP_CALL_INLINE]        = &&TARGET_OP_CALL_INLINE,
+            [OP_GUARD_SHAPE]        = &&TARGET_OP_GUARD_SHAPE,
+            [OP_GET_FIELD]          = &&TARGET_OP_GET_FIELD,
+            [OP_GET_LOCAL_FIELD]    = &&TARGET_OP_GET_LOCAL_FIELD,
+            [OP_SET_FIELD]          = &&TARGET_OP_SET_FIELD,
+            [OP_GET_HOISTED]        = &&TARGET_OP_GET_HOISTED,
+            [OP_SET_HOISTED]        = &&TARGET_OP_SET_HOISTED,
+    };
+#endif
+
+    // 没有栈帧时只导出处理程序地址，预解码的时候要用
+    if (vm.frameCount == 0) {
+#ifdef COMPUTED_GOTO
+        dispatchHandlers = dispatchTable;
+#endif
+        return INTERPRET_OK;
+    }
+
     CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    // 热点状态放在局部变量中，编译器可以把它们放进寄存器
+    // 只有在调用、返回、分配内存和报错的时候才写回 CallFrame 和 VM
+    Instruction *ip = frame->ip;
+    Value *stackTop = vm.stackTop;
+    Value *slots = frame->slots;
+
+// 写回寄存器中的状态
+#define STORE_FRAME() (frame->ip = ip, vm.stackTop = stackTop)
+// 从当前栈帧重新加载状态
+#define LOAD_FRAME()                                                        \
+    do {                                                                    \
+        frame = &vm.frames[vm.frameCount - 1];                              \
+        ip = frame->ip;                                                     \
+        slots = frame->slots;                                               \
+        stackTop = vm.stackTop;                                             \
+    } while (false)
+// 分配内存之前需要写回栈顶，GC 要扫描整个栈
+#define STORE_STACK() (vm.stackTop = stackTop)
+#define LOAD_STACK() (stackTop = vm.stackTop)
+// 当前指令有机器码入口时执行机器码，退回解释器后重新加载状态
+#ifdef JIT_SUPPORTED
+#define JIT_ENTER()                                                                 \
+    do {                                                                            \
+        ObjectFunction *current = frame->closure->function;                         \
+        if (current->jit != NULL                                                    \
+            && current->jit->entries[ip - current->chunk.instructions] != NULL) {   \
+            STORE_FRAME();                                                          \
+            jitRun(frame);                                                          \
+            LOAD_FRAME();                                                           \
+        }                                                                           \
+    } while (false)
+#else
+#define JIT_ENTER() ((void) 0)
+#endif
+// 运行时错误
+#define RUNTIME_ERROR(...)                  \
+    do {                                    \
+        STORE_FRAME();                      \
+        runtimeError(__VA_ARGS__);          \
+        return INTERPRET_RUNTIME_ERROR;     \
+    } while (false)
 
-// 读取字节码
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-// 读取常量
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-// 读取字符串
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+// 栈操作
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+// 读取操作数，操作数在预解码的时候已经解码好了
+#define READ_OPERAND() ((ip++)->operand)
+#define READ_VALUE() ((ip++)->value)
+#define READ_STRING() ((ip++)->string)
+#define READ_TARGET() ((ip++)->target)
+#define READ_CACHE() ((ip++)->cache)
+// 快速化：改写指令流中的指令，之后执行到这里的时候直接分发到新的处理程序
+#ifdef COMPUTED_GOTO
+#define QUICKEN(instruction, op) ((instruction)->handler = dispatchTable[op])
+#else
+#define QUICKEN(instruction, op) ((instruction)->opcode = (op))
+#endif
+// 当前指令的快速化计数，放在指令流外面，特化之后的指令不用跳过它
+#define QUICKEN_COUNTER() \
+    (frame->closure->function->chunk.quickenCounters[getInstructionIndex(&frame->closure->function->chunk, ip - 1)])
+// 统计指令看到的类型，次数够了就改写成特化的指令
+#define COUNT_QUICKEN(op)                                   \
+    do {                                                    \
+        if (++QUICKEN_COUNTER() >= QUICKEN_THRESHOLD) {     \
+            QUICKEN(ip - 1, op);                            \
+        }                                                   \
+    } while (false)
+// 特化指令的类型检查失败，改回通用的指令并重新执行
+#define DEQUICKEN(op) (QUICKEN_COUNTER() = -QUICKEN_BACKOFF, QUICKEN(ip - 1, op), ip--)
 // 二元运算
-#define BINARY_OP(valueType, op)                        \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {   \
-        runtimeError("Operands must be numbers.");      \
-        return INTERPRET_RUNTIME_ERROR;                 \
-    }                                                   \
-    do {                                                \
-        double b = AS_NUMBER(pop());                    \
-        double a = AS_NUMBER(pop());                    \
-        push(valueType(a op b));                        \
+#define BINARY_OP(valueType, op, quickOp)                   \
+    do {                                                    \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {   \
+            RUNTIME_ERROR("Operands must be numbers.");     \
+        }                                                   \
+        COUNT_QUICKEN(quickOp);                             \
+        double b = AS_NUMBER(POP());                        \
+        double a = AS_NUMBER(PEEK(0));                      \
+        PEEK(0) = valueType(a op b);                        \
+    } while (false)
+// 特化的数字二元运算，类型不对的时候改回通用的指令
+#define BINARY_OP_NUM(valueType, op, genericOp)             \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {       \
+        DEQUICKEN(genericOp);                               \
+        NEXT();                                             \
+    }                                                       \
+    double b = AS_NUMBER(POP());                            \
+    PEEK(0) = valueType(AS_NUMBER(PEEK(0)) op b);
+
+// 调试输出当前栈和指令
+#ifdef debug
+#define TRACE()                                                                 \
+    do {                                                                        \
+        STORE_FRAME();                                                          \
+        dbgStack(vm);                                                           \
+        dbgInstruction(&frame->closure->function->chunk,                        \
+                       getInstructionOffset(&frame->closure->function->chunk, ip)); \
     } while (false)
+#else
+#define TRACE()
+#endif
+
+// 统计执行的指令序列，用来挑选要合并的超级指令
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE()                                                                               \
+    profileOpcode(frame->closure->function->chunk.code[                                         \
+                  getInstructionOffset(&frame->closure->function->chunk, ip)])
+#else
+#define PROFILE()
+#endif
+
+#ifdef COMPUTED_GOTO
+#define DISPATCH()                              \
+    do {                                        \
+        TRACE();                                \
+        PROFILE();                              \
+        goto *(ip++)->handler;                  \
+    } while (false)
+#define CASE(op)        TARGET_##op
+#define NEXT()          DISPATCH()
+#define DISPATCH_LOOP() DISPATCH();
+#define DISPATCH_END()
+#else
+#define CASE(op)        case op
+#define NEXT()          break
+#define DISPATCH_LOOP() for (;;) { TRACE(); PROFILE(); switch ((ip++)->opcode) {
+#define DISPATCH_END()  } }
+#endif
+
+    DISPATCH_LOOP()
+    CASE(OP_RETURN): {
+        Value result = POP();
+        // 从函数返回的时候关闭上值
+        closeUpValues(slots);
+        vm.frameCount--;
+        if (vm.frameCount == 0) {
+            vm.stackTop = slots;
+            return INTERPRET_OK;
+        }
 
-    for (;;) {
-        dbgStack(vm);
-        dbgInstruction(&frame->closure->function->chunk, (int) (frame->ip - frame->closure->function->chunk.code));
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_RETURN: {
-                Value result = pop();
-                // 从函数返回的时候关闭上值
-                closeUpValues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
+        stackTop = slots;
+        PUSH(result);
+        STORE_STACK();
+        LOAD_FRAME();
+        JIT_ENTER();
+        NEXT();
+    }
+    CASE(OP_CONSTANT):
+        PUSH(READ_VALUE());
+        NEXT();
+    CASE(OP_NIL):
+        PUSH(NIL_VAL);
+        NEXT();
+    CASE(OP_TRUE):
+        PUSH(BOOL_VAL(true));
+        NEXT();
+    CASE(OP_FALSE):
+        PUSH(BOOL_VAL(false));
+        NEXT();
+    CASE(OP_POP):
+        stackTop--;
+        NEXT();
+    CASE(OP_DEFINE_GLOBAL):
+        vm.globalValues.values[READ_OPERAND()] = POP();
+        NEXT();
+    CASE(OP_GET_GLOBAL): {
+        int slot = READ_OPERAND();
+        Value value = vm.globalValues.values[slot];
+        if (IS_UNDEFINED(value)) {
+            RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+        }
+        PUSH(value);
+        NEXT();
+    }
+    CASE(OP_SET_GLOBAL): {
+        int slot = READ_OPERAND();
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+            RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+        }
+        vm.globalValues.values[slot] = PEEK(0);
+        NEXT();
+    }
+    CASE(OP_GET_LOCAL):
+        PUSH(slots[READ_OPERAND()]);
+        NEXT();
+    CASE(OP_SET_LOCAL):
+        slots[READ_OPERAND()] = PEEK(0);
+        NEXT();
+    CASE(OP_GET_UP_VALUE):
+        PUSH(*frame->closure->upValues[READ_OPERAND()]->location);
+        NEXT();
+    CASE(OP_SET_UP_VALUE): {
+        ObjectUpValue *upValue = frame->closure->upValues[READ_OPERAND()];
+        *upValue->location = PEEK(0);
+        writeBarrier((Object *) upValue, PEEK(0));
+        NEXT();
+    }
+    CASE(OP_GET_COPIED):
+        PUSH(frame->closure->copies[READ_OPERAND()]);
+        NEXT();
+    CASE(OP_GET_PROPERTY): {
+        if (!IS_INSTANCE(PEEK(0))) {
+            RUNTIME_ERROR("Only instances have properties.");
+        }
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL:
-                push(NIL_VAL);
-                break;
-            case OP_TRUE:
-                push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(BOOL_VAL(false));
-                break;
-            case OP_POP:
-                pop();
-                break;
-            case OP_DEFINE_GLOBAL: {
-                ObjectString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjectString *name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjectString *name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_UP_VALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upValues[slot]->location);
-                break;
-            }
-            case OP_SET_UP_VALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upValues[slot]->location = peek(0);
-                break;
-            }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        ObjectInstance *instance = AS_INSTANCE(PEEK(0));
+        ObjectString *name = READ_STRING();
+        InlineCache *cache = READ_CACHE();
 
-                ObjectInstance *instance = AS_INSTANCE(peek(0));
-                ObjectString *name = READ_STRING();
+        Value value;
+        PropertyKind kind = findProperty(instance, name, cache, &value);
+        if (kind == PROPERTY_FIELD) {
+            PEEK(0) = value;
+            NEXT();
+        }
+        // 方法
+        STORE_FRAME();
+        if (kind == PROPERTY_METHOD) {
+            ObjectBoundMethod *bound = bindInstanceMethod(instance, AS_CLOSURE(value));
+            PEEK(0) = OBJECT_VAL(bound);
+            NEXT();
+        }
+        bindMethod(instance->klass, name);
+        RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+    }
+    CASE(OP_SET_PROPERTY): {
+        if (!IS_INSTANCE(PEEK(1))) {
+            RUNTIME_ERROR("Only instances have fields.");
+        }
+        ObjectInstance *instance = AS_INSTANCE(PEEK(1));
+        ObjectString *name = READ_STRING();
+        InlineCache *cache = READ_CACHE();
+        STORE_STACK();
+        setProperty(instance, name, cache);
+        Value value = POP();
+        PEEK(0) = value;
+        NEXT();
+    }
+    CASE(OP_GET_SUPER): {
+        ObjectString *name = READ_STRING();
+        // 编译器生成的字节码总是满足，只有损坏的字节码文件会不满足
+        if (!IS_CLASS(PEEK(0)) || !IS_INSTANCE(PEEK(1))) {
+            RUNTIME_ERROR("Superclass must be a class.");
+        }
+        ObjectClass *superclass = AS_CLASS(POP());
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
+        STORE_FRAME();
+        if (!bindMethod(superclass, name)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_STACK();
+        NEXT();
+    }
+    CASE(OP_EQUAL): {
+        Value b = POP();
+        PEEK(0) = BOOL_VAL(valuesEqual(PEEK(0), b));
+        NEXT();
+    }
+    CASE(OP_NOT_EQUAL): {
+        Value b = POP();
+        PEEK(0) = BOOL_VAL(!valuesEqual(PEEK(0), b));
+        NEXT();
+    }
+    CASE(OP_GREATER):
+        BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+        NEXT();
+    CASE(OP_LESS):
+        BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+        NEXT();
+    CASE(OP_ADD): {
+        if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+            COUNT_QUICKEN(OP_ADD_STR);
+            STORE_STACK();
+            concatString();
+            LOAD_STACK();
+        } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+            COUNT_QUICKEN(OP_ADD_NUM);
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(PEEK(0));
+            PEEK(0) = NUMBER_VAL(a + b);
+        } else {
+            RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        NEXT();
+    }
+    CASE(OP_SUBTRACT):
+        BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+        NEXT();
+    CASE(OP_MULTIPLY):
+        BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+        NEXT();
+    CASE(OP_DIVIDE):
+        BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+        NEXT();
+    CASE(OP_NOT):
+        PEEK(0) = BOOL_VAL(isFalse(PEEK(0)));
+        NEXT();
+    CASE(OP_NEGATE):
+        if (!IS_NUMBER(PEEK(0))) {
+            RUNTIME_ERROR("Operand must be a number.");
+        }
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+        NEXT();
+    CASE(OP_PRINT): {
+        printValue(POP());
+        printf("\n");
+        NEXT();
+    }
+    CASE(OP_JUMP):
+        ip = ip->target;
+        NEXT();
+    CASE(OP_JUMP_IF_FALSE): {
+        Instruction *target = READ_TARGET();
+        if (isFalse(PEEK(0))) {
+            ip = target;
+        }
+        NEXT();
+    }
+    CASE(OP_LOOP):
+        ip = ip->target;
+        if (vm.jitEnabled || vm.ssaEnabled) {
+            STORE_FRAME();
+            if (loopTierUp(frame)) {
+                LOAD_FRAME();
+            }
+        }
+        NEXT();
+    CASE(OP_INVOKE): {
+        ObjectString *method = READ_STRING();
+        int argCount = READ_OPERAND();
+        InlineCache *cache = READ_CACHE();
+        STORE_FRAME();
+        if (!invoke(method, argCount, cache, false, false)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        JIT_ENTER();
+        NEXT();
+    }
+    CASE(OP_INVOKE_PROPERTY): {
+        ObjectString *method = READ_STRING();
+        int argCount = READ_OPERAND();
+        InlineCache *cache = READ_CACHE();
+        STORE_FRAME();
+        if (!invoke(method, argCount, cache, false, true)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        JIT_ENTER();
+        NEXT();
+    }
+    CASE(OP_SUPER_INVOKE): {
+        ObjectString *method = READ_STRING();
+        int argCount = READ_OPERAND();
+        if (!IS_CLASS(PEEK(0))) {
+            RUNTIME_ERROR("Superclass must be a class.");
+        }
+        ObjectClass *superclass = AS_CLASS(POP());
+        STORE_FRAME();
+        if (!invokeFromClass(superclass, method, argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        JIT_ENTER();
+        NEXT();
+    }
+    CASE(OP_CALL): {
+        // 反复调用本地函数的时候改写成 OP_CALL_NATIVE
+        if (IS_NATIVE(PEEK(ip->operand))) {
+            COUNT_QUICKEN(OP_CALL_NATIVE);
+        }
+        int argCount = READ_OPERAND();
+        STORE_FRAME();
+        if (!callValue(PEEK(argCount), argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        // 函数调用会创建新的栈侦
+        LOAD_FRAME();
+        JIT_ENTER();
+        NEXT();
+    }
+    CASE(OP_TAIL_CALL): {
+        int argCount = READ_OPERAND();
+        STORE_FRAME();
+        if (!tailCallValue(PEEK(argCount), argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        // 尾调用替换了当前栈帧的闭包和指令
+        LOAD_FRAME();
+        JIT_ENTER();
+        NEXT();
+    }
+    CASE(OP_TAIL_INVOKE): {
+        ObjectString *method = READ_STRING();
+        int argCount = READ_OPERAND();
+        InlineCache *cache = READ_CACHE();
+        STORE_FRAME();
+        if (!invoke(method, argCount, cache, true, false)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        JIT_ENTER();
+        NEXT();
+    }
+    CASE(OP_CLOSURE): {
+        ObjectFunction *function = AS_FUNCTION(READ_VALUE());
+        STORE_STACK();
+        ObjectClosure *closure = newClosure(function);
+        PUSH(OBJECT_VAL(closure));
+        STORE_STACK();
+        // 闭包已经在栈上，捕获自己的局部函数也能复制到自己
+        for (int i = 0; i < closure->upValueCount; i++) {
+            int kind = READ_OPERAND();
+            int index = READ_OPERAND();
+            switch (kind) {
+                case CAPTURE_UP_VALUE:
+                    closure->upValues[i] = frame->closure->upValues[index];
                     break;
-                }
-                // 方法
-                if (bindMethod(instance->klass, name)) {
+                case CAPTURE_LOCAL:
+                    closure->upValues[i] = captureUpValue(slots + index);
+                    break;
+                case CAPTURE_COPIED:
+                    closure->copies[i] = frame->closure->copies[index];
+                    break;
+                case CAPTURE_LOCAL_COPY:
+                    closure->copies[i] = slots[index];
                     break;
-                }
-                runtimeError("Undefined property '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjectInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
-            }
-            case OP_GET_SUPER: {
-                ObjectString *name = READ_STRING();
-                ObjectClass *superclass = AS_CLASS(pop());
-
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_NOT_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(!valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER: {
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            }
-            case OP_LESS: {
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            }
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatString();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SUBTRACT: {
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-            }
-            case OP_MULTIPLY: {
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            }
-            case OP_DIVIDE: {
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-            }
-            case OP_NOT:
-                push(BOOL_VAL(isFalse(pop())));
-                break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalse(peek(0))) {
-                    frame->ip += offset;
-                }
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
-            }
-            case OP_INVOKE: {
-                ObjectString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_SUPER_INVOKE: {
-                ObjectString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjectClass *superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                // 函数调用会创建新的栈侦
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_CLOSURE: {
-                ObjectFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjectClosure *closure = newClosure(function);
-                push(OBJECT_VAL(closure));
-                for (int i = 0; i < closure->upValueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upValues[i] = captureUpValue(frame->slots + index);
-                    } else {
-                        closure->upValues[i] = frame->closure->upValues[index];
-                    }
-                }
-                break;
-            }
-            case OP_CLOSE_UP_VALUE:
-                // 此时这个局部变量已经被闭包捕捉了
-                closeUpValues(vm.stackTop - 1);
-                pop();
-                break;
-            case OP_CLASS:
-                push(OBJECT_VAL(newClass(READ_STRING())));
-                break;
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjectClass *subclass = AS_CLASS(peek(0));
-                // 一旦某个类的声明执行完毕，该类的方法集就永远不能更改
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
             }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
         }
+        // 捕获上值时可能触发回收，闭包已经晋升的话要进入记忆集
+        writeBarrierAll((Object *) closure);
+        NEXT();
     }
+    CASE(OP_CLOSE_UP_VALUE):
+        // 此时这个局部变量已经被闭包捕捉了
+        closeUpValues(stackTop - 1);
+        stackTop--;
+        NEXT();
+    CASE(OP_CLASS): {
+        ObjectString *name = READ_STRING();
+        STORE_STACK();
+        PUSH(OBJECT_VAL(newClass(name)));
+        NEXT();
+    }
+    CASE(OP_INHERIT): {
+        Value superclass = PEEK(1);
+        if (!IS_CLASS(superclass) || !IS_CLASS(PEEK(0))) {
+            RUNTIME_ERROR("Superclass must be a class.");
+        }
+        ObjectClass *subclass = AS_CLASS(PEEK(0));
+        // 一旦某个类的声明执行完毕，该类的方法集就永远不能更改
+        STORE_STACK();
+        tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+        writeBarrierAll((Object *) subclass);
+        invalidateInlineCaches();
+        stackTop--; // Subclass.
+        NEXT();
+    }
+    CASE(OP_METHOD):
+        // 编译器生成的字节码总是满足，只有损坏的字节码文件会不满足
+        if (!IS_CLASS(PEEK(1)) || !IS_CLOSURE(PEEK(0))) {
+            RUNTIME_ERROR("Only classes have methods.");
+        }
+        STORE_STACK();
+        defineMethod(READ_STRING());
+        LOAD_STACK();
+        NEXT();
+    CASE(OP_ADD_LOCALS): {
+        Value a = slots[READ_OPERAND()];
+        Value b = slots[READ_OPERAND()];
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+            PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        } else if (IS_STRING(a) && IS_STRING(b)) {
+            PUSH(a);
+            PUSH(b);
+            STORE_STACK();
+            concatString();
+            LOAD_STACK();
+        } else {
+            RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        NEXT();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS): {
+        Instruction *target = READ_TARGET();
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+            RUNTIME_ERROR("Operands must be numbers.");
+        }
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        if (!(a < b)) {
+            // 跳转目标处会弹出条件
+            PUSH(BOOL_VAL(false));
+            ip = target;
+        }
+        NEXT();
+    }
+    CASE(OP_GET_LOCAL_PROPERTY): {
+        Value receiver = slots[READ_OPERAND()];
+        ObjectString *name = READ_STRING();
+        InlineCache *cache = READ_CACHE();
+        if (!IS_INSTANCE(receiver)) {
+            RUNTIME_ERROR("Only instances have properties.");
+        }
 
-#undef READ_BYTE
-#undef READ_SHORT
-#undef READ_CONSTANT
+        ObjectInstance *instance = AS_INSTANCE(receiver);
+        Value value;
+        PropertyKind kind = findProperty(instance, name, cache, &value);
+        if (kind == PROPERTY_FIELD) {
+            PUSH(value);
+            NEXT();
+        }
+        // 方法
+        PUSH(receiver);
+        STORE_FRAME();
+        if (kind == PROPERTY_METHOD) {
+            ObjectBoundMethod *bound = bindInstanceMethod(instance, AS_CLOSURE(value));
+            PEEK(0) = OBJECT_VAL(bound);
+            NEXT();
+        }
+        bindMethod(instance->klass, name);
+        RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+    }
+    CASE(OP_ADD_NUM): {
+        BINARY_OP_NUM(NUMBER_VAL, +, OP_ADD);
+        NEXT();
+    }
+    CASE(OP_ADD_STR):
+        if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+            DEQUICKEN(OP_ADD);
+            NEXT();
+        }
+        STORE_STACK();
+        concatString();
+        LOAD_STACK();
+        NEXT();
+    CASE(OP_SUBTRACT_NUM): {
+        BINARY_OP_NUM(NUMBER_VAL, -, OP_SUBTRACT);
+        NEXT();
+    }
+    CASE(OP_MULTIPLY_NUM): {
+        BINARY_OP_NUM(NUMBER_VAL, *, OP_MULTIPLY);
+        NEXT();
+    }
+    CASE(OP_DIVIDE_NUM): {
+        BINARY_OP_NUM(NUMBER_VAL, /, OP_DIVIDE);
+        NEXT();
+    }
+    CASE(OP_GREATER_NUM): {
+        BINARY_OP_NUM(BOOL_VAL, >, OP_GREATER);
+        NEXT();
+    }
+    CASE(OP_LESS_NUM): {
+        BINARY_OP_NUM(BOOL_VAL, <, OP_LESS);
+        NEXT();
+    }
+    CASE(OP_CALL_NATIVE): {
+        // 被调用者不是参数数量相符的本地函数时改回通用的调用，由它检查和报错
+        int argCount = ip->operand;
+        Value callee = PEEK(argCount);
+        if (!IS_NATIVE(callee)
+            || (AS_NATIVE(callee)->arity != NATIVE_VARIADIC && AS_NATIVE(callee)->arity != argCount)) {
+            DEQUICKEN(OP_CALL);
+            NEXT();
+        }
+        ip++;
+        ObjectNative *native = AS_NATIVE(callee);
+        Value *args = stackTop - argCount;
+        // 会分配内存的本地函数可能触发 GC，需要先写回栈顶
+        if (!native->pure) {
+            STORE_FRAME();
+        }
+        if (!native->function(argCount, args)) {
+            RUNTIME_ERROR("%s", vm.nativeError);
+        }
+        stackTop = args;
+        NEXT();
+    }
+    CASE(OP_GUARD_NUMBER): {
+        if (!IS_NUMBER(slots[READ_OPERAND()])) {
+            ssaDeoptimize(&frame->closure->function->chunk);
+            ip = frame->closure->function->chunk.instructions;
+        }
+        NEXT();
+    }
+    CASE(OP_GUARD_STRING): {
+        if (!IS_STRING(slots[READ_OPERAND()])) {
+            ssaDeoptimize(&frame->closure->function->chunk);
+            ip = frame->closure->function->chunk.instructions;
+        }
+        NEXT();
+    }
+    CASE(OP_INVOKE_INLINE): {
+        InlinedCall *inlined = (ip++)->inlined;
+        int argCount = READ_OPERAND();
+        InlineCache *cache = READ_CACHE();
+        if (inlineGuard(inlined, PEEK(argCount))) {
+            ip = inlined->body;
+            NEXT();
+        }
+        STORE_FRAME();
+        if (!invoke(inlined->name, argCount, cache, false, false)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        NEXT();
+    }
+    CASE(OP_INLINE_RETURN): {
+        // 结果放到接收者的槽位上，和调用返回之后的栈一样
+        int base = READ_OPERAND();
+        Instruction *target = READ_TARGET();
+        slots[base] = PEEK(0);
+        stackTop = slots + base + 1;
+        ip = target;
+        NEXT();
+    }
+    CASE(OP_CALL_INLINE): {
+        // 内联的函数的参数数量和调用处的一样
+        InlinedCall *inlined = (ip++)->inlined;
+        int argCount = inlined->method->function->arity;
+        Value callee = PEEK(argCount);
+        if (IS_CLOSURE(callee) && AS_CLOSURE(callee) == inlined->method) {
+            ip = inlined->body;
+            NEXT();
+        }
+        STORE_FRAME();
+        if (!callValue(callee, argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        NEXT();
+    }
+    CASE(OP_GUARD_SHAPE): {
+        Instruction *guard = ip - 1;
+        Value receiver = slots[READ_OPERAND()];
+        ObjectShape *shape = (ip++)->shape;
+        if (!IS_INSTANCE(receiver) || AS_INSTANCE(receiver)->shape != shape) {
+            ip = deoptimize(frame, guard);
+        }
+        NEXT();
+    }
+    CASE(OP_GET_FIELD): {
+        PEEK(0) = AS_INSTANCE(PEEK(0))->slots[READ_OPERAND()];
+        // 跳过原来的内联缓存
+        ip++;
+        NEXT();
+    }
+    CASE(OP_GET_LOCAL_FIELD): {
+        ObjectInstance *instance = AS_INSTANCE(slots[READ_OPERAND()]);
+        PUSH(instance->slots[READ_OPERAND()]);
+        ip++;
+        NEXT();
+    }
+    CASE(OP_SET_FIELD): {
+        ObjectInstance *instance = AS_INSTANCE(PEEK(1));
+        Value value = POP();
+        instance->slots[READ_OPERAND()] = value;
+        writeBarrier((Object *) instance, value);
+        PEEK(0) = value;
+        ip++;
+        NEXT();
+    }
+    CASE(OP_GET_HOISTED): {
+        Instruction *load = ip - 1;
+        HoistedValue *hoisted = (ip++)->hoisted;
+        // 循环里的调用重新进入了同一个循环，值已经被覆盖
+        if (hoisted->frame != (int) (frame - vm.frames)) {
+            ip = deoptimize(frame, load);
+            NEXT();
+        }
+        PUSH(hoisted->value);
+        ip = ip->target;
+        NEXT();
+    }
+    CASE(OP_SET_HOISTED): {
+        HoistedValue *hoisted = (ip++)->hoisted;
+        hoisted->value = POP();
+        hoisted->frame = (int) (frame - vm.frames);
+        NEXT();
+    }
+    DISPATCH_END()
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef STORE_STACK
+#undef LOAD_STACK
+#undef RUNTIME_ERROR
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef READ_OPERAND
+#undef READ_VALUE
 #undef READ_STRING
+#undef READ_TARGET
+#undef READ_CACHE
+#undef QUICKEN
+#undef QUICKEN_COUNTER
+#undef COUNT_QUICKEN
+#undef DEQUICKEN
 #undef BINARY_OP
+#undef BINARY_OP_NUM
+#undef TRACE
+#undef PROFILE
+#undef CASE
+#undef NEXT
+#undef DISPATCH_LOOP
+#undef DISPATCH_END
+#ifdef COMPUTED_GOTO
+#undef DISPATCH
+#endif
 }
 
 /**
  * 释放所有对象
  */
 static void freeObjects() {
-    Object *object = vm.objects;
-    while (object != NULL) {
-        Object *next = object->next;
-        freeObject(object);
-        object = next;
-    }
+    freeHeap(freeObject);
+    free(vm.youngObjects);
     free(vm.grayStack);
+    free(vm.remembered);
 }
 
 void initVM() {
+    vm.frames = (CallFrame *) malloc(sizeof(CallFrame) * FRAMES_INIT);
+    vm.frameCapacity = FRAMES_INIT;
+    vm.stack = (Value *) malloc(sizeof(Value) * STACK_INIT);
+    vm.stackCapacity = STACK_INIT;
+    if (vm.frames == NULL || vm.stack == NULL) {
+        dbg("Error when alloc vm stack");
+        exit(1);
+    }
     resetStack();
-    vm.objects = NULL;
+    // 没有栈帧时执行只会导出处理程序地址
+    run();
+    vm.youngCount = 0;
+    vm.youngCapacity = 0;
+    vm.youngObjects = NULL;
 
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm.youngBytes = 0;
+    vm.nextGC = GC_INITIAL_HEAP;
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.grayBase = 0;
+
+    vm.gcPhase = GC_IDLE;
+
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
 
     initTable(&vm.strings);
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalNames);
+    initValueArray(&vm.globalValues);
 
     vm.initString = copyString("init", 4);
-
-    defineNative("clock", clockNative);
+    vm.methodEpoch = 0;
+    vm.jitEnabled = false;
+    vm.ssaEnabled = false;
+
+    defineNative("clock", clockNative, 0, true);
+#ifdef CLOX_TEST_NATIVES
+    defineNative("sum", sumNative, NATIVE_VARIADIC, true);
+    defineNative("join", joinNative, 2, false);
+#endif
 }
 
 void freeVM() {
+#ifdef DEBUG_PROFILE_OPCODES
+    printOpcodeProfile();
+#endif
     freeTable(&vm.strings);
-    freeTable(&vm.globals);
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalNames);
+    freeValueArray(&vm.globalValues);
     vm.initString = NULL;
+    freeMarker();
+    freeSweeper();
     freeObjects();
+    free(vm.stack);
+    free(vm.frames);
 }
 
 InterpretResult interpret(const char *source) {
@@ -639,12 +1805,17 @@ InterpretResult interpret(const char *source) {
     if (function == NULL) {
         return INTERPRET_COMPILE_ERROR;
     }
+    return interpretFunction(function);
+}
 
+InterpretResult interpretFunction(ObjectFunction *function) {
     push(OBJECT_VAL(function));
     ObjectClosure *closure = newClosure(function);
     pop();
     push(OBJECT_VAL(closure));
-    call(closure, 0);
+    if (!call(closure, 0)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
 
     dbg("Start Run");
     InterpretResult result = run();
@@ -668,8 +1839,16 @@ Value peek(int distance) {
 }
 
 void addObject(Object *object) {
-    object->next = vm.objects;
-    vm.objects = object;
+    if (vm.youngCapacity < vm.youngCount + 1) {
+        vm.youngCapacity = GROW_CAPACITY(vm.youngCapacity);
+        vm.youngObjects = (Object **) realloc(vm.youngObjects, sizeof(Object *) * vm.youngCapacity);
+        if (vm.youngObjects == NULL) {
+            dbg("Error when realloc new young objects");
+            exit(1);
+        }
+    }
+
+    vm.youngObjects[vm.youngCount++] = object;
 }
 
 void holdString(ObjectString *string) {
@@ -679,15 +1858,38 @@ void holdString(ObjectString *string) {
     pop();
 }
 
-ObjectString *findSting(const char *chars, int length, u_int32_t hash) {
-    return tableFindKey(&vm.strings, chars, length, hash);
+ObjectString *findSting(const char *chars, int length, uint32_t hash) {
+    ObjectString *string = tableFindKey(&vm.strings, chars, length, hash);
+    // 清除过程中常量池里还有没清除的死字符串，再次用到的字符串标记一下让清除留下它
+    // 已经清除过的字符串会带着标记进入下一轮，多活一轮
+    if (string != NULL && vm.gcPhase == GC_SWEEPING && string->object.isOld) {
+        string->object.isMarked = true;
+    }
+    return string;
 }
 
 void markRoots() {
-    // 栈中局部变量
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    markRootsPart(0, 1);
+}
+
+void markRootsPart(int part, int parts) {
+    // 栈中局部变量，按范围分给各个部分
+    int stackSize = (int) (vm.stackTop - vm.stack);
+    Value *stackEnd = vm.stack + stackSize * (part + 1) / parts;
+    for (Value *slot = vm.stack + stackSize * part / parts; slot < stackEnd; slot++) {
         markValue(*slot);
     }
+    // 全局变量，按范围分给各个部分
+    int globalCount = vm.globalValues.size;
+    int globalEnd = globalCount * (part + 1) / parts;
+    for (int i = globalCount * part / parts; i < globalEnd; i++) {
+        markValue(vm.globalNames.values[i]);
+        markValue(vm.globalValues.values[i]);
+    }
+    // 其余的根不多，都由最后一个部分扫描
+    if (part != parts - 1) {
+        return;
+    }
     // 调用栈
     for (int i = 0; i < vm.frameCount; i++) {
         markObject((Object *) vm.frames[i].closure);
@@ -698,16 +1900,22 @@ void markRoots() {
          upValue = upValue->next) {
         markObject((Object *) upValue);
     }
-    // 全局变量
-    markTable(&vm.globals);
+    // 全局变量名到槽位
+    markTable(&vm.globalSlots);
     // 编译器：函数
     markCompilerRoots();
+    // 正在加载的堆快照
+    markSnapshotRoots();
 
     // 驻留
     markObject((Object *) vm.initString);
 }
 
 void addGray(Object *object) {
+    // 并行标记时放进当前线程的灰色队列
+    if (pushMarkerGray(object)) {
+        return;
+    }
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
         vm.grayStack = (Object **) realloc(vm.grayStack, sizeof(Object *) * vm.grayCapacity);
@@ -720,37 +1928,97 @@ void addGray(Object *object) {
     vm.grayStack[vm.grayCount++] = object;
 }
 
+void rememberObject(Object *object) {
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Object **) realloc(vm.remembered, sizeof(Object *) * vm.rememberedCapacity);
+        if (vm.remembered == NULL) {
+            dbg("Error when realloc new remembered set");
+            exit(1);
+        }
+    }
+
+    object->isRemembered = true;
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+void markRememberedSet() {
+    // 回收之后新生代都晋升了，记忆集里的对象不会再引用新生代对象
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        Object *object = vm.remembered[i];
+        object->isRemembered = false;
+        blackenObject(object);
+    }
+    vm.rememberedCount = 0;
+}
+
 void traceReferences() {
-    while (vm.grayCount > 0) {
+    while (vm.grayCount > vm.grayBase) {
         Object *object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
     }
 }
 
-void sweepStrings() {
-    tableRemoveWhite(&vm.strings);
+bool traceReferencesStep(int count) {
+    while (vm.grayCount > 0 && count-- > 0) {
+        Object *object = vm.grayStack[--vm.grayCount];
+        blackenObject(object);
+    }
+    return vm.grayCount == 0;
 }
 
-void sweep() {
-    Object *previous = NULL;
-    Object *object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
+/**
+ * 释放死掉的对象，字符串先从常量池删除
+ * @param object
+ */
+static void releaseObject(Object *object) {
+    if (object->type == OBJECT_STRING) {
+        tableDelete(&vm.strings, (ObjectString *) object);
+    }
+    freeObject(object);
+}
+
+void beginSweep() {
+    // 清除过程中分配和晋升的对象都在新的页里，不会被这一轮清除看到
+    detachPages();
+    vm.gcPhase = GC_SWEEPING;
+    sweepInBackground();
+}
+
+bool sweepStep(int count) {
+    while (count > 0) {
+        Page *page = takeSweepPage();
+        if (page == NULL) {
+            return true;
+        }
+        count -= page->cellCount;
+        if (sweepPage(page, releaseObject)) {
+            returnPage(page);
         } else {
-            Object *unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
+            freePage(page);
+        }
+    }
+    return false;
+}
+
+void sweepYoung() {
+    for (int i = 0; i < vm.youngCount; i++) {
+        Object *object = vm.youngObjects[i];
+        if (object->isMarked) {
+            object->isOld = true;
+            // 增量标记进行中，晋升的对象变灰，由增量标记继续扫描
+            if (vm.gcPhase == GC_MARKING) {
+                addGray(object);
             } else {
-                vm.objects = object;
+                object->isMarked = false;
             }
-
-            freeObject(unreached);
+        } else {
+            releaseObject(object);
+            heapFree(object);
         }
     }
+    vm.youngCount = 0;
+    vm.youngBytes = 0;
 }
 
 bool addBytesAllocated(size_t diff) {
@@ -758,6 +2026,11 @@ bool addBytesAllocated(size_t diff) {
     return vm.bytesAllocated > vm.nextGC;
 }
 
+bool addYoungBytes(size_t diff) {
+    vm.youngBytes += diff;
+    return vm.youngBytes > NURSERY_SIZE;
+}
+
 size_t getBytesAllocated() {
     return vm.bytesAllocated;
 }
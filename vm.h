@@ -5,8 +5,21 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// 调用栈和虚拟机栈从较小的容量开始按倍数扩容，超过上限时报告栈溢出
+#define FRAMES_INIT 16
+#define FRAMES_MAX (1 << 16)
+#define STACK_INIT 1024
+#define STACK_MAX (1 << 22)
+// 每次调用时除了函数本身需要的空间以外，为运行时临时压栈额外预留的槽位
+#define STACK_RESERVE 16
+// 运行时错误最多打印的栈帧数量
+#define TRACE_FRAMES 64
+// 本地函数错误信息的最大长度
+#define NATIVE_ERROR_MAX 256
+// 指令连续看到同一种类型的次数达到这个值时改写成特化的指令
+#define QUICKEN_THRESHOLD 4
+// 特化指令的类型检查失败后，需要多看到这么多次才会再次特化
+#define QUICKEN_BACKOFF 64
 
 #include "chunk.h"
 #include "value.h"
@@ -18,33 +31,65 @@
  */
 typedef struct {
     ObjectClosure *closure;
-    uint8_t *ip;
+    Instruction *ip;
     Value *slots;
 } CallFrame;
 
+/**
+ * 老年代回收的阶段，标记和清除都和程序的执行穿插进行
+ */
+typedef enum {
+    GC_IDLE,        // 没有进行中的回收
+    GC_MARKING,     // 增量标记
+    GC_SWEEPING,    // 增量清除
+} GcPhase;
+
 /**
  * 虚拟机
  */
 typedef struct {
-    CallFrame frames[FRAMES_MAX];   // 调用栈
+    CallFrame *frames;              // 调用栈，扩容时会移动
     int frameCount;                 // 调用栈数量
-    Value stack[STACK_MAX];         // 虚拟机栈
+    int frameCapacity;
+    Value *stack;                   // 虚拟机栈，扩容时会移动，指向栈中的指针需要重新定位
     Value *stackTop;                // 虚拟机栈顶
-    Object *objects;                // 所有对象的链表
+    int stackCapacity;
+    int youngCount;                 // 新生代对象，新分配的对象都在这里，对象本身放在堆的页里
+    int youngCapacity;
+    Object **youngObjects;
     Table strings;                  // 字符串常量池
-    Table globals;                  // 全局变量
+    Table globalSlots;              // 全局变量名到槽位
+    ValueArray globalNames;         // 每个槽位的变量名
+    ValueArray globalValues;        // 每个槽位的值，还没有定义的是 UNDEFINED_VAL
     ObjectUpValue *openUpValues;    // 被关闭的上值
 
     int grayCount;
     int grayCapacity;
     Object **grayStack;
+    int grayBase;                   // 新生代回收只处理这个位置之上的灰色对象，下面是增量标记还没处理的
+
+    GcPhase gcPhase;
+
+    int rememberedCount;            // 记忆集：可能引用了新生代对象的老年代对象
+    int rememberedCapacity;
+    Object **remembered;
+    size_t youngBytes;              // 上次回收之后分配的字节数
 
     size_t bytesAllocated;
     size_t nextGC;
 
     ObjectString* initString;
+
+    uint32_t methodEpoch;           // 方法表版本，新建形状或者方法表变化时增加，让所有内联缓存失效
+
+    bool jitEnabled;                // 是否 JIT 编译热点函数
+    bool ssaEnabled;                // 是否用 SSA 优化层重新编译热点函数，和 JIT 同时打开时 JIT 优先
+
+    char nativeError[NATIVE_ERROR_MAX]; // 本地函数的错误信息，不分配内存，纯的本地函数也可以报错
 } VM;
 
+extern VM vm;
+
 /**
  * 字节码执行结果
  */
@@ -72,7 +117,15 @@ void freeVM();
 InterpretResult interpret(const char *source);
 
 /**
- * 入栈
+ * 执行已经编译好的脚本函数，比如从字节码文件读取的函数
+ * @param function
+ * @return
+ */
+InterpretResult interpretFunction(ObjectFunction *function);
+
+/**
+ * 入栈，不检查容量
+ * 调用函数时已经为栈帧预留了足够的空间，运行时临时压栈使用 STACK_RESERVE 预留的槽位
  * @param value
  */
 void push(Value value);
@@ -91,7 +144,7 @@ Value pop();
 Value peek(int distance);
 
 /**
- * 添加一个堆对象，用于内存释放
+ * 新分配的对象加入新生代
  * @param object
  */
 void addObject(Object *object);
@@ -106,32 +159,126 @@ void holdString(ObjectString *string);
  * 从常量池寻找字符串
  * @param string
  */
-ObjectString *findSting(const char *chars, int length, u_int32_t hash);
+ObjectString *findSting(const char *chars, int length, uint32_t hash);
+
+/**
+ * 全局变量的槽位，第一次出现的名字会分配新的槽位
+ * 编译的时候就确定槽位，变量可以在用到它的代码之后才定义
+ * @param name
+ * @return
+ */
+int globalSlot(ObjectString *name);
+
+/**
+ * 全局变量槽位对应的变量名
+ * @param slot
+ * @return
+ */
+ObjectString *globalName(int slot);
+
+/**
+ * 本地函数报告错误，格式化错误信息之后返回 false，本地函数直接返回这个结果
+ * @param format
+ * @param ...
+ * @return
+ */
+bool nativeError(const char *format, ...);
+
+/**
+ * 打开 JIT，平台不支持时给出提示并继续使用解释器
+ */
+void enableJit();
+
+/**
+ * 打开 SSA 优化层
+ */
+void enableSsa();
+
+/**
+ * 通过内联缓存读取属性，供 JIT 的机器码调用
+ * 缓存没有命中并且慢路径也找不到的时候返回 false，不产生任何副作用
+ * @param receiver
+ * @param name
+ * @param cache
+ * @param value 读取到的属性
+ * @return
+ */
+bool getPropertyFast(Value receiver, ObjectString *name, InlineCache *cache, Value *value);
+
+/**
+ * 通过内联缓存写入字段，供 JIT 的机器码调用
+ * 接收者不是实例的时候返回 false，不产生任何副作用
+ * @param receiver
+ * @param name
+ * @param cache
+ * @param value
+ * @return
+ */
+bool setPropertyFast(Value receiver, ObjectString *name, InlineCache *cache, Value value);
+
+/**
+ * 让所有内联缓存失效
+ */
+void invalidateInlineCaches();
 
 /**
  * 扫描根节点
  */
 void markRoots();
 
+/**
+ * 扫描一部分根节点，并行标记时每个线程扫描一部分
+ * 栈和全局变量按范围分开，其余的根由最后一个部分扫描
+ * @param part 第几部分
+ * @param parts 一共分成几部分
+ */
+void markRootsPart(int part, int parts);
+
 /**
  * 添加灰色节点
  */
 void addGray(Object *object);
 
 /**
- * 跟踪引用
+ * 老年代对象加入记忆集，下次新生代回收时作为根扫描
+ * @param object
+ */
+void rememberObject(Object *object);
+
+/**
+ * 扫描记忆集，新生代回收时使用
+ */
+void markRememberedSet();
+
+/**
+ * 跟踪引用，处理完所有灰色对象
  */
 void traceReferences();
 
 /**
- * 清除字符串常量池
+ * 跟踪一部分引用
+ * @param count 最多黑化的对象数量
+ * @return 是否已经没有灰色对象
+ */
+bool traceReferencesStep(int count);
+
+/**
+ * 开始清除老年代，标记结束时所有对象都在老年代，堆的所有页都等待清除
+ * 能用后台清除线程时交给它，字符串的页之外不再由程序的线程清除
+ */
+void beginSweep();
+
+/**
+ * 清除一部分等待清除的页，死掉的字符串先从常量池删除
+ * @param count 最多处理的格子数量，至少清除一页
+ * @return 是否已经清除完
  */
-void sweepStrings();
+bool sweepStep(int count);
 
 /**
- * 清除对象
+ * 只清除新生代对象，活下来的对象晋升到老年代
  */
-void sweep();
+void sweepYoung();
 
 /**
  * 统计字节码
@@ -139,6 +286,13 @@ void sweep();
  */
 bool addBytesAllocated(size_t diff);
 
+/**
+ * 统计新生代分配的字节数
+ * @param diff
+ * @return 新生代是否已满
+ */
+bool addYoungBytes(size_t diff);
+
 /**
  * 更新GC阈值
  */